@@ -0,0 +1,169 @@
+/* vim: tabstop=4 softtabstop=4 shiftwidth=4 expandtab
+** Copyright (c) 2002  Hughes Technologies Pty Ltd.  All rights
+** reserved.
+**
+** Terms under which this software may be used or copied are
+** provided in the  specific license associated with this product.
+**
+** Hughes Technologies disclaims all warranties with regard to this
+** software, including all implied warranties of merchantability and
+** fitness, in no event shall Hughes Technologies be liable for any
+** special, indirect or consequential damages or any damages whatsoever
+** resulting from loss of use, data or profits, whether in an action of
+** contract, negligence or other tortious action, arising out of or in
+** connection with the use or performance of this software.
+**
+**
+** $Id$
+**
+*/
+
+/*
+**  Recycling of request and variable structures.
+**
+**  A request is several kilobytes, most of it buffers that are
+**  overwritten before they are read.  Released requests and variables
+**  are kept on free lists (up to a limit) instead of going back to
+**  malloc, and a recycled request only has the fields cleared that are
+**  read before being set.  Response buffers stay attached to a
+**  recycled request unless they grew unusually large.
+*/
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#include "httpd.h"
+#include "httpd_priv.h"
+
+#define HTTP_MAX_FREE_REQUESTS	32
+#define HTTP_MAX_FREE_VARS	256
+#define HTTP_MAX_KEPT_BUF	16384
+
+static pthread_mutex_t _httpd_freeMutex = PTHREAD_MUTEX_INITIALIZER;
+static request *_httpd_freeRequests = NULL;
+static httpVar *_httpd_freeVars = NULL;
+static int _httpd_freeRequestCount = 0, _httpd_freeVarCount = 0;
+
+request *
+_httpd_allocRequest()
+{
+    request *r;
+    char *headBuf, *outBuf;
+    int headSize, outSize;
+
+    pthread_mutex_lock(&_httpd_freeMutex);
+    r = _httpd_freeRequests;
+    if (r) {
+        _httpd_freeRequests = r->next;
+        _httpd_freeRequestCount--;
+    }
+    pthread_mutex_unlock(&_httpd_freeMutex);
+
+    if (r == NULL) {
+        r = (request *) malloc(sizeof(request));
+        if (r == NULL)
+            return (NULL);
+        r->headBuf = r->outBuf = NULL;
+        r->headSize = r->outSize = 0;
+    }
+
+    /*
+     ** Clear everything up to the auth buffer, which is only read once
+     ** an Authorization header filled it, and from the variables up to
+     ** the read buffer, but keep the output buffers.  The response
+     ** strings are set by httpdReadRequest().
+     */
+    headBuf = r->headBuf;
+    headSize = r->headSize;
+    outBuf = r->outBuf;
+    outSize = r->outSize;
+    memset((void *)r, 0, offsetof(request, request.authBuf));
+    memset((void *)&r->variables, 0, offsetof(request, readBuf) - offsetof(request, variables));
+    r->response.responseLength = r->response.modTime = 0;
+    r->response.content = NULL;
+    r->response.headersSent = 0;
+    *r->response.headers = *r->response.response = *r->response.contentType = 0;
+    r->headBuf = headBuf;
+    r->headSize = headSize;
+    r->outBuf = outBuf;
+    r->outSize = outSize;
+    _httpd_initRequest(r);
+    return (r);
+}
+
+/*
+** The caller has closed the socket already
+*/
+void
+_httpd_releaseRequest(request * r)
+{
+    _httpd_freeVariables(r->variables);
+    r->variables = NULL;
+    if (r->outSize > HTTP_MAX_KEPT_BUF) {
+        free(r->outBuf);
+        r->outBuf = NULL;
+        r->outSize = 0;
+    }
+
+    pthread_mutex_lock(&_httpd_freeMutex);
+    if (_httpd_freeRequestCount < HTTP_MAX_FREE_REQUESTS) {
+        r->next = _httpd_freeRequests;
+        _httpd_freeRequests = r;
+        _httpd_freeRequestCount++;
+        r = NULL;
+    }
+    pthread_mutex_unlock(&_httpd_freeMutex);
+
+    if (r) {
+        free(r->headBuf);
+        free(r->outBuf);
+        free(r);
+    }
+}
+
+httpVar *
+_httpd_allocVar()
+{
+    httpVar *var;
+
+    pthread_mutex_lock(&_httpd_freeMutex);
+    var = _httpd_freeVars;
+    if (var) {
+        _httpd_freeVars = var->nextVariable;
+        _httpd_freeVarCount--;
+    }
+    pthread_mutex_unlock(&_httpd_freeMutex);
+
+    if (var == NULL) {
+        var = malloc(sizeof(httpVar));
+        if (var == NULL)
+            return (NULL);
+    }
+    var->name = var->value = NULL;
+    var->nextValue = var->nextVariable = NULL;
+    return (var);
+}
+
+/*
+** The name and value strings must have been freed already
+*/
+void
+_httpd_releaseVar(httpVar * var)
+{
+    pthread_mutex_lock(&_httpd_freeMutex);
+    if (_httpd_freeVarCount < HTTP_MAX_FREE_VARS) {
+        var->nextVariable = _httpd_freeVars;
+        _httpd_freeVars = var;
+        _httpd_freeVarCount++;
+        var = NULL;
+    }
+    pthread_mutex_unlock(&_httpd_freeMutex);
+
+    if (var)
+        free(var);
+}
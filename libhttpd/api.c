@@ -35,6 +35,7 @@
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netdb.h>
 #endif
 
@@ -171,8 +172,9 @@ httpdAddVariable(request * r, const char *name, const char *value)
 
     while (*name == ' ' || *name == '\t')
         name++;
-    newVar = malloc(sizeof(httpVar));
-    bzero(newVar, sizeof(httpVar));
+    newVar = _httpd_allocVar();
+    if (newVar == NULL)
+        return (-1);
     newVar->name = strdup(name);
     newVar->value = strdup(value);
     lastVar = NULL;
@@ -197,15 +199,56 @@ httpdAddVariable(request * r, const char *name, const char *value)
     return (0);
 }
 
-httpd *
-httpdCreate(host, port)
-char *host;
-int port;
+static int
+_httpd_listen(httpd * new, int reusePort)
 {
-    httpd *new;
     int sock, opt;
     struct sockaddr_in addr;
 
+    sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0)
+        return (-1);
+#	ifdef SO_REUSEADDR
+    opt = 1;
+    if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (char *)&opt, sizeof(int)) < 0) {
+        close(sock);
+        return (-1);
+    }
+#	endif
+    if (reusePort) {
+#	ifdef SO_REUSEPORT
+        opt = 1;
+        if (setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, (char *)&opt, sizeof(int)) < 0) {
+            close(sock);
+            return (-1);
+        }
+#	else
+        close(sock);
+        return (-1);
+#	endif
+    }
+    new->serverSock = sock;
+    bzero(&addr, sizeof(addr));
+    addr.sin_family = AF_INET;
+    if (new->host == HTTP_ANY_ADDR) {
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    } else {
+        addr.sin_addr.s_addr = inet_addr(new->host);
+    }
+    addr.sin_port = htons((u_short) new->port);
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(sock);
+        return (-1);
+    }
+    listen(sock, 128);
+    return (0);
+}
+
+static httpd *
+_httpd_create(char *host, int port, int reusePort, int sock)
+{
+    httpd *new;
+
     /*
      ** Create the handle and setup it's basic config
      */
@@ -261,49 +304,123 @@ int port;
     }
 #endif
 
-    sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock < 0) {
+    if (sock >= 0) {
+        new->serverSock = sock;
+    } else if (_httpd_listen(new, reusePort) < 0) {
         free(new);
         return (NULL);
     }
-#	ifdef SO_REUSEADDR
-    opt = 1;
-    if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (char *)&opt, sizeof(int)) < 0) {
-        close(sock);
-        free(new);
-        return NULL;
-    }
-#	endif
-    new->serverSock = sock;
-    bzero(&addr, sizeof(addr));
-    addr.sin_family = AF_INET;
-    if (new->host == HTTP_ANY_ADDR) {
-        addr.sin_addr.s_addr = htonl(INADDR_ANY);
-    } else {
-        addr.sin_addr.s_addr = inet_addr(new->host);
-    }
-    addr.sin_port = htons((u_short) new->port);
-    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
-        close(sock);
+    new->startTime = time(NULL);
+    return (new);
+}
+
+httpd *
+httpdCreate(host, port)
+char *host;
+int port;
+{
+    return (_httpd_create(host, port, 0, -1));
+}
+
+/*
+** Like httpdCreate(), but further listeners on the same address can
+** be added with httpdAddListener().  The kernel then spreads incoming
+** connections over them.
+*/
+httpd *
+httpdCreateReusePort(char *host, int port)
+{
+    return (_httpd_create(host, port, 1, -1));
+}
+
+/*
+** Like httpdCreate(), but serve a socket that is already bound and
+** listening, such as one handed over by a previous process.  The
+** server owns the socket from then on.
+*/
+httpd *
+httpdCreateFromSocket(char *host, int port, int sock)
+{
+    return (_httpd_create(host, port, 0, sock));
+}
+
+static httpd *
+_httpd_addListener(httpd * server, int sock)
+{
+    httpd *new;
+
+    new = malloc(sizeof(httpd));
+    if (new == NULL)
+        return (NULL);
+    memcpy(new, server, sizeof(httpd));
+    new->master = server;
+    new->lastError = 0;
+    new->accepted = new->acceptErrors = 0;
+    new->acceptState = HTTP_ACCEPT_ON;
+    if (sock >= 0) {
+        new->serverSock = sock;
+    } else if (_httpd_listen(new, 1) < 0) {
         free(new);
         return (NULL);
     }
-    listen(sock, 128);
-    new->startTime = time(NULL);
     return (new);
 }
 
+/*
+** Open another listen socket for a server created by
+** httpdCreateReusePort().  The new listener serves the content of
+** the original one, so content, ACLs, logs and error handlers must
+** all be set up on the original first.  Each listener is meant to be
+** served by its own thread.
+*/
+httpd *
+httpdAddListener(httpd * server)
+{
+    return (_httpd_addListener(server, -1));
+}
+
+/*
+** Like httpdAddListener(), with a socket that is already bound and
+** listening.  See httpdCreateFromSocket().
+*/
+httpd *
+httpdAddListenerFromSocket(httpd * server, int sock)
+{
+    return (_httpd_addListener(server, sock));
+}
+
 void
 httpdDestroy(server)
 httpd *server;
 {
     if (server == NULL)
         return;
+    if (server->master) {
+        close(server->serverSock);
+        free(server);
+        return;
+    }
     if (server->host)
         free(server->host);
+    _httpd_freeRoutes(server);
     free(server);
 }
 
+/*
+** Ask the thread serving a listener to stop accepting connections,
+** leaving them in the listen queue for whoever else holds the
+** socket.  The listen socket itself stays open.  The thread notices
+** within a second and sets acceptState to HTTP_ACCEPT_STOPPED;
+** httpdGetConnection() then fails with lastError -5 and
+** httpdEventLoop() keeps serving the connections it already has.
+*/
+void
+httpdStopAccepting(httpd * server)
+{
+    if (server->acceptState == HTTP_ACCEPT_ON)
+        server->acceptState = HTTP_ACCEPT_STOPPING;
+}
+
 request *
 httpdGetConnection(server, timeout)
 httpd *server;
@@ -312,16 +429,24 @@ struct timeval *timeout;
     int result;
     fd_set fds;
     struct sockaddr_in addr;
+    struct timeval slice;
     socklen_t addrLen;
-    char *ipaddr;
     request *r;
     /* Reset error */
     server->lastError = 0;
-    FD_ZERO(&fds);
-    FD_SET(server->serverSock, &fds);
     result = 0;
     while (result == 0) {
-        result = select(server->serverSock + 1, &fds, 0, 0, timeout);
+        if (server->acceptState != HTTP_ACCEPT_ON) {
+            server->acceptState = HTTP_ACCEPT_STOPPED;
+            server->lastError = -5;
+            return (NULL);
+        }
+        FD_ZERO(&fds);
+        FD_SET(server->serverSock, &fds);
+        /* Without a timeout, wake up now and then to check acceptState */
+        slice.tv_sec = 1;
+        slice.tv_usec = 0;
+        result = select(server->serverSock + 1, &fds, 0, 0, timeout ? timeout : &slice);
         if (result < 0) {
             server->lastError = -1;
             return (NULL);
@@ -335,24 +460,22 @@ struct timeval *timeout;
         }
     }
     /* Allocate request struct */
-    r = (request *) malloc(sizeof(request));
+    r = _httpd_allocRequest();
     if (r == NULL) {
         server->lastError = -3;
         return (NULL);
     }
-    memset((void *)r, 0, sizeof(request));
     /* Get on with it */
     bzero(&addr, sizeof(addr));
     addrLen = sizeof(addr);
     r->clientSock = accept(server->serverSock, (struct sockaddr *)&addr, &addrLen);
-    ipaddr = inet_ntoa(addr.sin_addr);
-    if (ipaddr) {
-        strncpy(r->clientAddr, ipaddr, HTTP_IP_ADDR_LEN);
-        r->clientAddr[HTTP_IP_ADDR_LEN - 1] = 0;
-    } else
+    if (r->clientSock < 0)
+        server->acceptErrors++;
+    else
+        server->accepted++;
+    /* inet_ntoa() is not safe with several listener threads */
+    if (inet_ntop(AF_INET, &addr.sin_addr, r->clientAddr, HTTP_IP_ADDR_LEN) == NULL)
         *r->clientAddr = 0;
-    r->readBufRemain = 0;
-    r->readBufPtr = NULL;
 
     /*
      ** Check the default ACL
@@ -371,10 +494,7 @@ struct timeval *timeout;
 int
 httpdReadRequest(httpd * server, request * r)
 {
-    char buf[HTTP_MAX_LEN];
-    int count, inHeaders;
-    char *cp, *cp2;
-    int _httpd_decode();
+    int len;
 
     /*
      ** Setup for a standard response
@@ -383,129 +503,106 @@ httpdReadRequest(httpd * server, request * r)
     strcpy(r->response.contentType, "text/html");
     strcpy(r->response.response, "200 Output Follows\n");
     r->response.headersSent = 0;
+    r->response.modTime = 0;
 
     /*
-     ** Read the request
+     ** Read the request head into the read buffer, unless the event
+     ** loop already did.  A client that stops sending before the end
+     ** of the head gets what it sent parsed.  On a persistent
+     ** connection the head may already be there, pipelined behind the
+     ** previous request, and the client may take up to the keep-alive
+     ** timeout to start the next one.
      */
-    count = 0;
-    inHeaders = 1;
-//    debug(LOG_INFO, "-----------start httpdReadRequest----------------");
-    while (_httpd_readLine(r, buf, HTTP_MAX_LEN) > 0) {
-        count++;
-//        debug(LOG_INFO, "line:%d:%s", count, buf);
-        if (strncasecmp(buf, "User-Agent: ", 12) == 0) {
-            cp = strchr(buf, ':');
-            if (cp) {
-                cp += 2;
-                memset(r->request.user_agent, 0, HTTP_MAX_UA);
-                strncpy(r->request.user_agent, cp, HTTP_MAX_UA);
-//                debug(LOG_INFO, "ua:%s", r->request.user_agent);
-            }
+    if (!r->headDone && r->readBufLen > 0)
+        _httpd_parseHead(r, 0);
+    while (!r->headDone) {
+        if (r->event) {
+            _httpd_parseHead(r, 1);
+            break;
         }
-        /*
-         ** Special case for the first line.  Scan the request
-         ** method and path etc
-         */
-        if (count == 1) {
-            /*
-             ** First line.  Scan the request info
-             */
-            cp = cp2 = buf;
-            while (isalpha((unsigned char)*cp2))
-                cp2++;
-            *cp2 = 0;
-            if (strcasecmp(cp, "GET") == 0)
-                r->request.method = HTTP_GET;
-            if (strcasecmp(cp, "POST") == 0)
-                r->request.method = HTTP_POST;
-            if (r->request.method == 0) {
-                _httpd_net_write(r->clientSock, HTTP_METHOD_ERROR, strlen(HTTP_METHOD_ERROR));
-                _httpd_net_write(r->clientSock, cp, strlen(cp));
-                _httpd_writeErrorLog(server, r, LEVEL_ERROR, "Invalid method received");
+        len = _httpd_net_readTimeout(r->clientSock, r->readBuf + r->readBufLen, HTTP_READ_BUF_LEN - r->readBufLen,
+                                     r->requests > 0 && r->readBufLen == 0 ? server->keepAliveTimeout : HTTP_IO_TIMEOUT);
+        if (len < 1) {
+            if (r->readBufLen == 0)
                 return (-1);
-            }
-            cp = cp2 + 1;
-            while (*cp == ' ')
-                cp++;
-            cp2 = cp;
-            while (*cp2 != ' ' && *cp2 != 0)
-                cp2++;
-            *cp2 = 0;
-            strncpy(r->request.path, cp, HTTP_MAX_URL);
-            r->request.path[HTTP_MAX_URL - 1] = 0;
-            _httpd_sanitiseUrl(r->request.path);
-            continue;
+            _httpd_parseHead(r, 1);
+            break;
         }
+        r->readBufLen += len;
+        _httpd_parseHead(r, 0);
+    }
 
-        /*
-         ** Process the headers
-         */
-        if (inHeaders) {
-            if (*buf == 0) {
-                /*
-                 ** End of headers.  Continue if there's
-                 ** data to read
-                 */
-                break;
-            }
-            if (strncasecmp(buf, "Authorization: ", 15) == 0) {
-                cp = strchr(buf, ':');
-                if (cp) {
-                    cp += 2;
-
-                    if (strncmp(cp, "Basic ", 6) != 0) {
-                        /* Unknown auth method */
-                    } else {
-                        char authBuf[100];
-
-                        cp = strchr(cp, ' ') + 1;
-                        _httpd_decode(cp, authBuf, 100);
-                        r->request.authLength = strlen(authBuf);
-                        cp = strchr(authBuf, ':');
-                        if (cp) {
-                            *cp = 0;
-                            strncpy(r->request.authPassword, cp + 1, HTTP_MAX_AUTH);
-                            r->request.authPassword[HTTP_MAX_AUTH - 1] = 0;
-                        }
-                        strncpy(r->request.authUser, authBuf, HTTP_MAX_AUTH);
-                        r->request.authUser[HTTP_MAX_AUTH - 1] = 0;
-                    }
-                }
-            } 
-            if (strncasecmp(buf, "Host: ", 6) == 0) {
-                cp = strchr(buf, ':');
-                if (cp) {
-                    cp += 2;
-                    strncpy(r->request.host, cp, HTTP_MAX_URL);
-                    r->request.host[HTTP_MAX_URL - 1] = 0;
-                }
-            }
-            /* End modification */
-            continue;
-        }
+    if (r->request.method == 0) {
+        _httpd_write(r, HTTP_METHOD_ERROR, strlen(HTTP_METHOD_ERROR));
+        _httpd_write(r, r->readBuf, strlen(r->readBuf));
+        _httpd_writeErrorLog(server, r, LEVEL_ERROR, "Invalid method received");
+        return (-1);
     }
-//    debug(LOG_INFO, "-----------end httpdReadRequest----------------");
 
     /*
      ** Process any URL data
      */
-    cp = strchr(r->request.path, '?');
-    if (cp != NULL) {
-        *cp++ = 0;
-        strncpy(r->request.query, cp, sizeof(r->request.query));
-        r->request.query[sizeof(r->request.query) - 1] = 0;
-        _httpd_storeData(r, cp);
-    }
+    if (*r->request.query)
+        _httpd_storeData(r, r->request.query);
     return (0);
 }
 
+/*
+** Send the response to the current request.  Returns 1 if the
+** connection stays open and r is ready for httpdReadRequest() again,
+** 0 if it must be closed with httpdEndRequest().  Event mode
+** connections always return 0, the event loop takes care of them.
+*/
+int
+httpdFinishRequest(httpd * server, request * r)
+{
+    if (r->event)
+        return (0);
+    _httpd_finishResponse(r, _httpd_keepAlive(server, r));
+    while (r->outSent < r->headLen + r->outLen) {
+        if (_httpd_sendResponse(r, 0) < 1) {
+            r->keepAlive = 0;
+            break;
+        }
+    }
+    if (!r->keepAlive) {
+        r->headLen = r->outLen = r->outSent = 0;
+        r->response.headersSent = 0;
+        return (0);
+    }
+    _httpd_nextRequest(r);
+    return (1);
+}
+
 void
 httpdEndRequest(request * r)
 {
-    _httpd_freeVariables(r->variables);
+    if (r->event) {
+        _httpd_eventEndRequest(r);
+        return;
+    }
+    /*
+     ** Anything not sent by httpdFinishRequest() yet goes out now
+     */
+    if (r->response.headersSent || r->outLen > 0) {
+        _httpd_finishResponse(r, 0);
+        while (r->outSent < r->headLen + r->outLen && _httpd_sendResponse(r, 0) > 0) ;
+    }
     shutdown(r->clientSock, 2);
     close(r->clientSock);
-    free(r);
+    _httpd_releaseRequest(r);
+}
+
+/*
+** Allow persistent connections.  Idle connections are closed after
+** timeout seconds, and after max requests if max is not 0.  A timeout
+** of 0 (the default) closes every connection after one request.
+*/
+void
+httpdSetKeepAlive(httpd * server, int timeout, int max)
+{
+    server->keepAliveTimeout = timeout;
+    server->keepAliveMax = max;
 }
 
 void
@@ -562,6 +659,7 @@ char *path;
     newEntry->preload = preload;
     newEntry->next = dirPtr->entries;
     dirPtr->entries = newEntry;
+    _httpd_buildRoutes(server);
     if (*path == '/') {
         /* Absolute path */
         newEntry->path = strdup(path);
@@ -594,6 +692,7 @@ char *path;
     newEntry->preload = preload;
     newEntry->next = dirPtr->entries;
     dirPtr->entries = newEntry;
+    _httpd_buildRoutes(server);
     if (*path == '/') {
         /* Absolute path */
         newEntry->path = strdup(path);
@@ -629,6 +728,7 @@ void (*function) ();
     newEntry->preload = preload;
     newEntry->next = dirPtr->entries;
     dirPtr->entries = newEntry;
+    _httpd_buildRoutes(server);
     return (0);
 }
 
@@ -654,6 +754,7 @@ void (*function) ();
     newEntry->preload = preload;
     newEntry->next = dirPtr->entries;
     dirPtr->entries = newEntry;
+    _httpd_buildRoutes(server);
     return (0);
 }
 
@@ -681,6 +782,7 @@ char *data;
     newEntry->preload = preload;
     newEntry->next = dirPtr->entries;
     dirPtr->entries = newEntry;
+    _httpd_buildRoutes(server);
     return (0);
 }
 
@@ -735,7 +837,6 @@ httpdOutput(request * r, const char *msg)
     src = msg;
     dest = buf;
     count = 0;
-    memset(buf, 0, HTTP_MAX_LEN);
     while (*src && count < HTTP_MAX_LEN) {
         if (*src == '$') {
             const char *tmp;
@@ -771,7 +872,25 @@ httpdOutput(request * r, const char *msg)
     r->response.responseLength += strlen(buf);
     if (r->response.headersSent == 0)
         httpdSendHeaders(r);
-    _httpd_net_write(r->clientSock, buf, strlen(buf));
+    _httpd_write(r, buf, strlen(buf));
+}
+
+/*
+** Output pre-built pieces verbatim, without the $variable expansion
+** and length limit of httpdOutput()
+*/
+int
+httpdWritev(request * r, const struct iovec *iov, int iovcnt)
+{
+    int count, len;
+
+    len = 0;
+    for (count = 0; count < iovcnt; count++)
+        len += iov[count].iov_len;
+    r->response.responseLength += len;
+    if (r->response.headersSent == 0)
+        httpdSendHeaders(r);
+    return (_httpd_writev(r, iov, iovcnt, len));
 }
 
 #ifdef HAVE_STDARG_H
@@ -801,37 +920,24 @@ va_dcl
     vsnprintf(buf, HTTP_MAX_LEN, fmt, args);
     va_end(args); /* Works with both stdargs.h and varargs.h */
     r->response.responseLength += strlen(buf);
-    _httpd_net_write(r->clientSock, buf, strlen(buf));
+    _httpd_write(r, buf, strlen(buf));
 }
 
 void
 httpdProcessRequest(httpd * server, request * r)
 {
-    char dirName[HTTP_MAX_URL], entryName[HTTP_MAX_URL], *cp;
-    httpDir *dir;
+    const char *path, *entryName;
     httpContent *entry;
 
     r->response.responseLength = 0;
-    strncpy(dirName, httpdRequestPath(r), HTTP_MAX_URL);
-    dirName[HTTP_MAX_URL - 1] = 0;
-    cp = strrchr(dirName, '/');
-    if (cp == NULL) {
-        /* printf("Invalid request path '%s'\n", dirName); */
-        return;
-    }
-    strncpy(entryName, cp + 1, HTTP_MAX_URL);
-    entryName[HTTP_MAX_URL - 1] = 0;
-    if (cp != dirName)
-        *cp = 0;
-    else
-        *(cp + 1) = 0;
-    dir = _httpd_findContentDir(server, dirName, HTTP_FALSE);
-    if (dir == NULL) {
-        _httpd_send404(server, r);
-        _httpd_writeAccessLog(server, r);
+    path = httpdRequestPath(r);
+    entryName = strrchr(path, '/');
+    if (entryName == NULL) {
+        /* printf("Invalid request path '%s'\n", path); */
         return;
     }
-    entry = _httpd_findContentEntry(r, dir, entryName);
+    entryName++;
+    entry = _httpd_findRoute(server, r, path, entryName);
     if (entry == NULL) {
         _httpd_send404(server, r);
         _httpd_writeAccessLog(server, r);
@@ -858,7 +964,7 @@ httpdProcessRequest(httpd * server, request * r)
         break;
 
     case HTTP_WILDCARD:
-        if (_httpd_sendDirectoryEntry(server, r, entry, entryName) < 0) {
+        if (_httpd_sendDirectoryEntry(server, r, entry, (char *)entryName) < 0) {
             _httpd_send404(server, r);
         }
         break;
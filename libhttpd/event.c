@@ -0,0 +1,478 @@
+/* vim: tabstop=4 softtabstop=4 shiftwidth=4 expandtab
+** Copyright (c) 2002  Hughes Technologies Pty Ltd.  All rights
+** reserved.
+**
+** Terms under which this software may be used or copied are
+** provided in the  specific license associated with this product.
+**
+** Hughes Technologies disclaims all warranties with regard to this
+** software, including all implied warranties of merchantability and
+** fitness, in no event shall Hughes Technologies be liable for any
+** special, indirect or consequential damages or any damages whatsoever
+** resulting from loss of use, data or profits, whether in an action of
+** contract, negligence or other tortious action, arising out of or in
+** connection with the use or performance of this software.
+**
+**
+** $Id$
+**
+*/
+
+/*
+**  Event driven connection handling.
+**
+**  httpdEventLoop() owns every client socket from accept() until
+**  close().  Sockets are non-blocking and watched with epoll, so a
+**  slow or idle client costs a request struct and nothing else.  Once
+**  the complete request head has been buffered the request is handed
+**  to the dispatch callback, which normally queues it for a worker
+**  thread.  The worker runs the usual httpdReadRequest() /
+**  httpdProcessRequest() / httpdEndRequest() sequence: reads are
+**  served from the buffered head, output is collected by
+**  _httpd_write() and httpdEndRequest() hands the request back to the
+**  loop, which flushes the response without blocking and closes the
+**  connection.
+*/
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#include <unistd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+
+#include "httpd.h"
+#include "httpd_priv.h"
+
+#ifdef HAVE_SYS_EPOLL_H
+
+#define HTTP_EVENT_MAX_EVENTS	64
+
+/*
+** Every connection on a timer list waits for the same timeout, so
+** appending at the tail keeps the list ordered by deadline.
+*/
+struct _httpd_timer {
+    request *head, *tail;
+    int timeout;
+};
+
+struct _httpd_event {
+    httpd *server;
+    int epollFd, wakeFd[2], acceptPaused;
+    void (*dispatch) (request *);
+    pthread_mutex_t doneMutex;
+    request *done;              /* Handed back by workers, linked by next */
+    struct _httpd_timer io;     /* Reading a request or writing a response */
+    struct _httpd_timer idle;   /* Waiting for the next request on a persistent connection */
+};
+
+/*
+** Markers stored in epoll_event.data to tell the listen socket and
+** the wake-up pipe apart from client connections.
+*/
+static char _httpd_listenMarker, _httpd_wakeMarker;
+
+static int
+_httpd_setNonBlocking(int fd)
+{
+    int flags;
+
+    flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0)
+        return (-1);
+    if (fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+        return (-1);
+    return (fcntl(fd, F_SETFD, FD_CLOEXEC));
+}
+
+static void
+_httpd_timerRemove(request * r)
+{
+    struct _httpd_timer *timer = r->timer;
+
+    if (timer == NULL)
+        return;
+    if (r->prev)
+        r->prev->next = r->next;
+    else
+        timer->head = r->next;
+    if (r->next)
+        r->next->prev = r->prev;
+    else
+        timer->tail = r->prev;
+    r->prev = r->next = NULL;
+    r->timer = NULL;
+}
+
+static void
+_httpd_timerAdd(struct _httpd_timer *timer, request * r)
+{
+    _httpd_timerRemove(r);
+    r->deadline = time(NULL) + timer->timeout;
+    r->timer = timer;
+    r->next = NULL;
+    r->prev = timer->tail;
+    if (timer->tail)
+        timer->tail->next = r;
+    else
+        timer->head = r;
+    timer->tail = r;
+}
+
+static int
+_httpd_poll(struct _httpd_event *ev, request * r, int events)
+{
+    struct epoll_event event;
+
+    memset(&event, 0, sizeof(event));
+    event.events = events;
+    event.data.ptr = r;
+    if (epoll_ctl(ev->epollFd, r->polled ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, r->clientSock, &event) < 0)
+        return (-1);
+    r->polled = 1;
+    return (0);
+}
+
+static void
+_httpd_unpoll(struct _httpd_event *ev, request * r)
+{
+    if (r->polled) {
+        epoll_ctl(ev->epollFd, EPOLL_CTL_DEL, r->clientSock, NULL);
+        r->polled = 0;
+    }
+}
+
+static void
+_httpd_resumeAccept(struct _httpd_event *ev)
+{
+    struct epoll_event event;
+
+    if (!ev->acceptPaused || ev->server->acceptState != HTTP_ACCEPT_ON)
+        return;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.ptr = &_httpd_listenMarker;
+    if (epoll_ctl(ev->epollFd, EPOLL_CTL_ADD, ev->server->serverSock, &event) == 0)
+        ev->acceptPaused = 0;
+}
+
+static void
+_httpd_closeConnection(struct _httpd_event *ev, request * r)
+{
+    _httpd_timerRemove(r);
+    _httpd_unpoll(ev, r);
+    shutdown(r->clientSock, 2);
+    close(r->clientSock);
+    _httpd_releaseRequest(r);
+    _httpd_resumeAccept(ev);
+}
+
+static void
+_httpd_eventDispatch(struct _httpd_event *ev, request * r)
+{
+    _httpd_timerRemove(r);
+    _httpd_unpoll(ev, r);
+    r->state = HTTP_STATE_PROCESSING;
+    (ev->dispatch) (r);
+}
+
+/*
+** Read what the client sent and parse it as it arrives.  The parser
+** always leaves room in the read buffer until the head is complete.
+*/
+static void
+_httpd_eventRead(struct _httpd_event *ev, request * r)
+{
+    int len;
+
+    while (1) {
+        len = read(r->clientSock, r->readBuf + r->readBufLen, HTTP_READ_BUF_LEN - r->readBufLen);
+        if (len > 0) {
+            /* The next request has started, it is no longer idle */
+            if (r->timer == &ev->idle)
+                _httpd_timerAdd(&ev->io, r);
+            r->readBufLen += len;
+            if (_httpd_parseHead(r, 0)) {
+                _httpd_eventDispatch(ev, r);
+                return;
+            }
+            continue;
+        }
+        if (len < 0 && errno == EINTR)
+            continue;
+        if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        /* EOF or error before a full request head */
+        _httpd_closeConnection(ev, r);
+        return;
+    }
+}
+
+/*
+** The response has been sent and the connection stays open.  Serve a
+** pipelined request right away, otherwise wait for the next one.
+*/
+static void
+_httpd_eventContinue(struct _httpd_event *ev, request * r)
+{
+    _httpd_nextRequest(r);
+    r->state = HTTP_STATE_READING;
+    if (r->readBufLen > 0 && _httpd_parseHead(r, 0)) {
+        _httpd_eventDispatch(ev, r);
+        return;
+    }
+    if (_httpd_poll(ev, r, EPOLLIN) < 0) {
+        _httpd_closeConnection(ev, r);
+        return;
+    }
+    _httpd_timerAdd(r->readBufLen > 0 ? &ev->io : &ev->idle, r);
+}
+
+static void
+_httpd_eventFlush(struct _httpd_event *ev, request * r)
+{
+    int len;
+
+    while (r->outSent < r->headLen + r->outLen) {
+        len = _httpd_sendResponse(r, MSG_DONTWAIT);
+        if (len > 0)
+            continue;
+        if (len < 0 && errno == EINTR)
+            continue;
+        if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if (!r->polled) {
+                if (_httpd_poll(ev, r, EPOLLOUT) < 0)
+                    break;
+                _httpd_timerAdd(&ev->io, r);
+            }
+            return;
+        }
+        r->keepAlive = 0;
+        break;
+    }
+    if (r->keepAlive)
+        _httpd_eventContinue(ev, r);
+    else
+        _httpd_closeConnection(ev, r);
+}
+
+static void
+_httpd_eventAccept(struct _httpd_event *ev)
+{
+    httpd *server = ev->server;
+    struct sockaddr_in addr;
+    socklen_t addrLen;
+    request *r;
+    int sock;
+
+    while (1) {
+        addrLen = sizeof(addr);
+        sock = accept(server->serverSock, (struct sockaddr *)&addr, &addrLen);
+        if (sock < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                server->acceptErrors++;
+            if (errno == EMFILE || errno == ENFILE) {
+                /*
+                 ** Out of descriptors.  Stop watching the listen
+                 ** socket until a connection is closed, it would
+                 ** otherwise wake us up in a tight loop.
+                 */
+                epoll_ctl(ev->epollFd, EPOLL_CTL_DEL, server->serverSock, NULL);
+                ev->acceptPaused = 1;
+            }
+            return;
+        }
+        server->accepted++;
+        if (_httpd_setNonBlocking(sock) < 0) {
+            close(sock);
+            continue;
+        }
+        r = _httpd_allocRequest();
+        if (r == NULL) {
+            close(sock);
+            continue;
+        }
+        r->clientSock = sock;
+        r->event = ev;
+        r->state = HTTP_STATE_READING;
+        if (inet_ntop(AF_INET, &addr.sin_addr, r->clientAddr, HTTP_IP_ADDR_LEN) == NULL)
+            *r->clientAddr = 0;
+        if (server->defaultAcl && httpdCheckAcl(server, r, server->defaultAcl) == HTTP_ACL_DENY) {
+            _httpd_closeConnection(ev, r);
+            continue;
+        }
+        if (_httpd_poll(ev, r, EPOLLIN) < 0) {
+            _httpd_closeConnection(ev, r);
+            continue;
+        }
+        _httpd_timerAdd(&ev->io, r);
+    }
+}
+
+static void
+_httpd_eventCollect(struct _httpd_event *ev)
+{
+    char buf[64];
+    request *r, *next;
+
+    while (read(ev->wakeFd[0], buf, sizeof(buf)) > 0) ;
+
+    pthread_mutex_lock(&ev->doneMutex);
+    r = ev->done;
+    ev->done = NULL;
+    pthread_mutex_unlock(&ev->doneMutex);
+
+    while (r) {
+        next = r->next;
+        r->next = NULL;
+        _httpd_finishResponse(r, _httpd_keepAlive(ev->server, r));
+        r->state = HTTP_STATE_WRITING;
+        _httpd_eventFlush(ev, r);
+        r = next;
+    }
+}
+
+/*
+** Connections that stalled past their deadline.  A client that sent
+** part of a request head and then went quiet still gets an answer to
+** what it sent, as it did with the blocking reader.
+*/
+static void
+_httpd_eventExpire(struct _httpd_event *ev)
+{
+    time_t now;
+    request *r;
+
+    now = time(NULL);
+    while ((r = ev->io.head) != NULL && r->deadline <= now) {
+        if (r->state == HTTP_STATE_READING && r->readBufLen > 0)
+            _httpd_eventDispatch(ev, r);
+        else
+            _httpd_closeConnection(ev, r);
+    }
+    while ((r = ev->idle.head) != NULL && r->deadline <= now)
+        _httpd_closeConnection(ev, r);
+}
+
+/*
+** Called by httpdEndRequest() for event mode connections, usually
+** from a worker thread.
+*/
+void
+_httpd_eventEndRequest(request * r)
+{
+    struct _httpd_event *ev = r->event;
+
+    pthread_mutex_lock(&ev->doneMutex);
+    r->next = ev->done;
+    ev->done = r;
+    pthread_mutex_unlock(&ev->doneMutex);
+    /* A full pipe already guarantees a wake-up */
+    write(ev->wakeFd[1], "", 1);
+}
+
+int
+httpdEventLoop(httpd * server, void (*dispatch) (request *))
+{
+    struct _httpd_event *ev;
+    struct epoll_event event, events[HTTP_EVENT_MAX_EVENTS];
+    request *r;
+    int count, i;
+
+    server->lastError = 0;
+    ev = malloc(sizeof(struct _httpd_event));
+    if (ev == NULL) {
+        server->lastError = -3;
+        return (-1);
+    }
+    memset(ev, 0, sizeof(struct _httpd_event));
+    ev->server = server;
+    ev->dispatch = dispatch;
+    ev->io.timeout = HTTP_IO_TIMEOUT;
+    ev->idle.timeout = server->keepAliveTimeout;
+    pthread_mutex_init(&ev->doneMutex, NULL);
+
+    ev->epollFd = epoll_create(HTTP_EVENT_MAX_EVENTS);
+    if (ev->epollFd < 0 || pipe(ev->wakeFd) < 0 ||
+        _httpd_setNonBlocking(ev->wakeFd[0]) < 0 || _httpd_setNonBlocking(ev->wakeFd[1]) < 0 ||
+        _httpd_setNonBlocking(server->serverSock) < 0) {
+        server->lastError = -4;
+        return (-1);
+    }
+    fcntl(ev->epollFd, F_SETFD, FD_CLOEXEC);
+
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.ptr = &_httpd_wakeMarker;
+    epoll_ctl(ev->epollFd, EPOLL_CTL_ADD, ev->wakeFd[0], &event);
+    event.data.ptr = &_httpd_listenMarker;
+    if (epoll_ctl(ev->epollFd, EPOLL_CTL_ADD, server->serverSock, &event) < 0) {
+        server->lastError = -4;
+        return (-1);
+    }
+
+    while (1) {
+        if (server->acceptState == HTTP_ACCEPT_STOPPING) {
+            /* Keep serving the connections we have, see httpdStopAccepting() */
+            if (!ev->acceptPaused)
+                epoll_ctl(ev->epollFd, EPOLL_CTL_DEL, server->serverSock, NULL);
+            ev->acceptPaused = 1;
+            server->acceptState = HTTP_ACCEPT_STOPPED;
+        }
+        count = epoll_wait(ev->epollFd, events, HTTP_EVENT_MAX_EVENTS, 1000);
+        if (count < 0) {
+            if (errno == EINTR)
+                continue;
+            server->lastError = -1;
+            return (-1);
+        }
+        for (i = 0; i < count; i++) {
+            if (events[i].data.ptr == &_httpd_listenMarker) {
+                _httpd_eventAccept(ev);
+                continue;
+            }
+            if (events[i].data.ptr == &_httpd_wakeMarker) {
+                _httpd_eventCollect(ev);
+                continue;
+            }
+            r = events[i].data.ptr;
+            if (r->state == HTTP_STATE_READING)
+                _httpd_eventRead(ev, r);
+            else if (r->state == HTTP_STATE_WRITING)
+                _httpd_eventFlush(ev, r);
+        }
+        _httpd_eventExpire(ev);
+    }
+    /* never reached */
+}
+
+#else                           /* HAVE_SYS_EPOLL_H */
+
+void
+_httpd_eventEndRequest(request * r)
+{
+}
+
+int
+httpdEventLoop(httpd * server, void (*dispatch) (request *))
+{
+    server->lastError = -4;
+    return (-1);
+}
+
+#endif                          /* HAVE_SYS_EPOLL_H */
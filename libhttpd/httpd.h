@@ -62,6 +62,7 @@ extern "C" {
 #define	HTTP_IP_ADDR_LEN	17
 #define	HTTP_TIME_STRING_LEN	40
 #define	HTTP_READ_BUF_LEN	4096
+#define	HTTP_IO_TIMEOUT		10
 #define	HTTP_ANY_ADDR		NULL
 
 #define	HTTP_GET		1
@@ -87,20 +88,36 @@ extern "C" {
 #define HTTP_ACL_PERMIT		1
 #define HTTP_ACL_DENY		2
 
+#define HTTP_STATE_READING	1
+#define HTTP_STATE_PROCESSING	2
+#define HTTP_STATE_WRITING	3
+
+#define HTTP_ACCEPT_ON		0
+#define HTTP_ACCEPT_STOPPING	1
+#define HTTP_ACCEPT_STOPPED	2
+
     extern char LIBHTTPD_VERSION[], LIBHTTPD_VENDOR[];
 
 /***********************************************************************
 ** Type Definitions
 */
 
+    /*
+     ** The string fields point into the request's read buffer (or into
+     ** authBuf for the decoded credentials) and are never NULL: fields
+     ** missing from the request point to an empty string.
+     */
     typedef struct {
         int method, contentLength, authLength;
-        char path[HTTP_MAX_URL], query[HTTP_MAX_URL], host[HTTP_MAX_URL],       /* acv@acv.ca/wifidog: Added decoding
-                                                                                   of host: header if present. */
-         ifModified[HTTP_MAX_URL];
-        char user_agent[HTTP_MAX_UA];
-        char authUser[HTTP_MAX_AUTH];
-        char authPassword[HTTP_MAX_AUTH];
+        int version, keepAlive; /* 10 or 11, and whether the client
+                                   asked for a persistent connection */
+        char *path, *query, *host,      /* acv@acv.ca/wifidog: Added decoding
+                                           of host: header if present. */
+        *ifModified;
+        char *user_agent;
+        char *authUser;
+        char *authPassword;
+        char authBuf[HTTP_MAX_AUTH];
     } httpReq;
 
     typedef struct _httpd_var {
@@ -118,7 +135,7 @@ extern "C" {
     } httpContent;
 
     typedef struct {
-        int responseLength;
+        int responseLength, modTime;
         httpContent *content;
         char headersSent, headers[HTTP_MAX_HEADERS], response[HTTP_MAX_URL], contentType[HTTP_MAX_URL];
     } httpRes;
@@ -129,33 +146,86 @@ extern "C" {
         struct _httpd_content *entries;
     } httpDir;
 
+    typedef struct _httpd_route {
+        char *key;
+        int keyLen, wildcard;
+        httpContent *entry;
+        struct _httpd_route *next;
+    } httpRoute;
+
     typedef struct ip_acl_s {
         int addr;
         char len, action;
         struct ip_acl_s *next;
     } httpAcl;
 
-    typedef struct {
+    typedef struct _httpd {
         int port, serverSock, startTime, lastError;
         char fileBasePath[HTTP_MAX_URL], *host;
         httpDir *content;
+        httpRoute **routes;     /* hash of content, see _httpd_buildRoutes() */
+        int routeMask;
         httpAcl *defaultAcl;
         FILE *accessLog, *errorLog;
         void (*errorFunction304) (), (*errorFunction403) (), (*errorFunction404) ();
+        int keepAliveTimeout, keepAliveMax;
+
+        /*
+         ** Extra SO_REUSEPORT listeners share the content and settings
+         ** of the server they were added to, see httpdAddListener()
+         */
+        struct _httpd *master;
+        unsigned long accepted, acceptErrors;
+
+        /*
+         ** HTTP_ACCEPT_* state, see httpdStopAccepting()
+         */
+        volatile int acceptState;
     } httpd;
 
-    typedef struct {
+    typedef struct _httpd_request {
         int clientSock, readBufRemain;
         httpReq request;
         httpRes response;
         httpVar *variables;
-        char readBuf[HTTP_READ_BUF_LEN + 1], *readBufPtr, clientAddr[HTTP_IP_ADDR_LEN];
+        char *readBufPtr, clientAddr[HTTP_IP_ADDR_LEN];
+
+        /*
+         ** Request head parser state, see _httpd_parseHead()
+         */
+        int readBufLen, headLines, headDone, parseOffset, keepOffset;
+
+        /*
+         ** Response buffering.  The body collects in outBuf, the head
+         ** is only rendered into headBuf once the body length is known.
+         */
+        char *headBuf, *outBuf;
+        int headLen, headSize, outLen, outSize, outSent;
+        int keepAlive, requests;
+
+        /*
+         ** Event mode (httpdEventLoop) connection state.  event is
+         ** NULL for connections returned by httpdGetConnection.
+         */
+        struct _httpd_event *event;
+        struct _httpd_timer *timer;
+        int state, polled;
+        time_t deadline;
+        struct _httpd_request *prev, *next;
+
+        /*
+         ** Must stay last: recycled requests are only cleared up to
+         ** here, see _httpd_allocRequest()
+         */
+        char readBuf[HTTP_READ_BUF_LEN + 1];
     } request;
 
 /***********************************************************************
 ** Function Prototypes
 */
 
+    struct iovec;
+
     int httpdAddCContent __ANSI_PROTO((httpd *, char *, char *, int, int (*)(), void (*)()));
     int httpdAddFileContent __ANSI_PROTO((httpd *, char *, char *, int, int (*)(), char *));
     int httpdAddStaticContent __ANSI_PROTO((httpd *, char *, char *, int, int (*)(), char *));
@@ -164,6 +234,8 @@ extern "C" {
     int httpdAddVariable __ANSI_PROTO((request *, const char *, const char *));
     int httpdSetVariableValue __ANSI_PROTO((request *, const char *, const char *));
     request *httpdGetConnection __ANSI_PROTO((httpd *, struct timeval *));
+    int httpdEventLoop __ANSI_PROTO((httpd *, void (*)(request *)));
+    void httpdStopAccepting __ANSI_PROTO((httpd *));
     int httpdReadRequest __ANSI_PROTO((httpd *, request *));
     int httpdCheckAcl __ANSI_PROTO((httpd *, request *, httpAcl *));
     int httpdAuthenticate __ANSI_PROTO((request *, const char *));
@@ -177,11 +249,18 @@ extern "C" {
     void httpdSetContentType __ANSI_PROTO((request *, const char *));
     void httpdSetResponse __ANSI_PROTO((request *, const char *));
     void httpdEndRequest __ANSI_PROTO((request *));
+    int httpdFinishRequest __ANSI_PROTO((httpd *, request *));
+    void httpdSetKeepAlive __ANSI_PROTO((httpd *, int, int));
 
     httpd *httpdCreate __ANSI_PROTO(());
+    httpd *httpdCreateReusePort __ANSI_PROTO((char *, int));
+    httpd *httpdAddListener __ANSI_PROTO((httpd *));
+    httpd *httpdCreateFromSocket __ANSI_PROTO((char *, int, int));
+    httpd *httpdAddListenerFromSocket __ANSI_PROTO((httpd *, int));
     void httpdFreeVariables __ANSI_PROTO((request *));
     void httpdDumpVariables __ANSI_PROTO((request *));
     void httpdOutput __ANSI_PROTO((request *, const char *));
+    int httpdWritev __ANSI_PROTO((request *, const struct iovec *, int));
     void httpdPrintf __ANSI_PROTO((request *, const char *, ...));
     void httpdProcessRequest __ANSI_PROTO((httpd *, request *));
     void httpdSendHeaders __ANSI_PROTO((request *));
@@ -68,13 +68,28 @@ extern "C" {
 
     int _httpd_net_read __ANSI_PROTO((int, char *, int));
     int _httpd_net_write __ANSI_PROTO((int, char *, int));
+    int _httpd_write __ANSI_PROTO((request *, const char *, int));
+    int _httpd_writev __ANSI_PROTO((request *, const struct iovec *, int, int));
+    int _httpd_net_readTimeout __ANSI_PROTO((int, char *, int, int));
+    int _httpd_keepAlive __ANSI_PROTO((httpd *, request *));
+    void _httpd_finishResponse __ANSI_PROTO((request *, int));
+    int _httpd_sendResponse __ANSI_PROTO((request *, int));
+    void _httpd_nextRequest __ANSI_PROTO((request *));
+    request *_httpd_allocRequest __ANSI_PROTO((void));
+    void _httpd_releaseRequest __ANSI_PROTO((request *));
+    httpVar *_httpd_allocVar __ANSI_PROTO((void));
+    void _httpd_releaseVar __ANSI_PROTO((httpVar *));
+    void _httpd_eventEndRequest __ANSI_PROTO((request *));
     int _httpd_readBuf __ANSI_PROTO((request *, char *, int));
     int _httpd_readChar __ANSI_PROTO((request *, char *));
-    int _httpd_readLine __ANSI_PROTO((request *, char *, int));
+    int _httpd_parseHead __ANSI_PROTO((request *, int));
+    void _httpd_initRequest __ANSI_PROTO((request *));
     int _httpd_checkLastModified __ANSI_PROTO((request *, int));
     int _httpd_sendDirectoryEntry __ANSI_PROTO((httpd *, request * r, httpContent *, char *));
 
-    httpContent *_httpd_findContentEntry __ANSI_PROTO((request *, httpDir *, char *));
+    httpContent *_httpd_findRoute __ANSI_PROTO((httpd *, request *, const char *, const char *));
+    void _httpd_buildRoutes __ANSI_PROTO((httpd *));
+    void _httpd_freeRoutes __ANSI_PROTO((httpd *));
     httpDir *_httpd_findContentDir __ANSI_PROTO((httpd *, char *, int));
 
 #ifdef __cplusplus
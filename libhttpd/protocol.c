@@ -30,6 +30,8 @@
 #else
 #include <unistd.h>
 #include <sys/file.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 #endif
 
 #include "config.h"
@@ -41,6 +43,12 @@ _httpd_net_read(sock, buf, len)
 int sock;
 char *buf;
 int len;
+{
+    return (_httpd_net_readTimeout(sock, buf, len, HTTP_IO_TIMEOUT));
+}
+
+int
+_httpd_net_readTimeout(int sock, char *buf, int len, int seconds)
 {
 #if defined(_WIN32)
     return (recv(sock, buf, len, 0));
@@ -54,7 +62,7 @@ int len;
 
     FD_ZERO(&readfds);
     FD_SET(sock, &readfds);
-    timeout.tv_sec = 10;
+    timeout.tv_sec = seconds;
     timeout.tv_usec = 0;
     nfds = sock + 1;
 
@@ -80,47 +88,292 @@ int len;
 #endif
 }
 
+/*
+** Queue response data for the client.  Everything is collected in the
+** request's output buffer so the response head can carry the exact
+** Content-Length.  The buffer is sent by httpdFinishRequest() or
+** httpdEndRequest(), or by the event loop for connections it owns.
+*/
+static int
+_httpd_growOutput(request * r, int len)
+{
+    char *newBuf;
+    int newSize;
+
+    if (r->outLen + len > r->outSize) {
+        newSize = r->outSize ? r->outSize : HTTP_READ_BUF_LEN;
+        while (newSize < r->outLen + len)
+            newSize *= 2;
+        newBuf = realloc(r->outBuf, newSize);
+        if (newBuf == NULL)
+            return (-1);
+        r->outBuf = newBuf;
+        r->outSize = newSize;
+    }
+    return (0);
+}
+
+int
+_httpd_write(request * r, const char *buf, int len)
+{
+    if (_httpd_growOutput(r, len) < 0)
+        return (-1);
+    memcpy(r->outBuf + r->outLen, buf, len);
+    r->outLen += len;
+    return (len);
+}
+
+/*
+** Queue several pieces at once, growing the output buffer only once
+*/
+int
+_httpd_writev(request * r, const struct iovec *iov, int iovcnt, int len)
+{
+    int count;
+
+    if (_httpd_growOutput(r, len) < 0)
+        return (-1);
+    for (count = 0; count < iovcnt; count++) {
+        memcpy(r->outBuf + r->outLen, iov[count].iov_base, iov[count].iov_len);
+        r->outLen += iov[count].iov_len;
+    }
+    return (len);
+}
+
 int
 _httpd_readChar(request * r, char *cp)
 {
+    int len;
+
     if (r->readBufRemain == 0) {
-        bzero(r->readBuf, HTTP_READ_BUF_LEN + 1);
-        r->readBufRemain = _httpd_net_read(r->clientSock, r->readBuf, HTTP_READ_BUF_LEN);
-        if (r->readBufRemain < 1)
+        /*
+         ** Event mode requests arrive with the whole head buffered.
+         ** Otherwise refill behind what was already read, the parsed
+         ** request fields still point into the start of the buffer.
+         */
+        if (r->event || r->readBufLen >= HTTP_READ_BUF_LEN)
+            return (0);
+        len = _httpd_net_read(r->clientSock, r->readBuf + r->readBufLen, HTTP_READ_BUF_LEN - r->readBufLen);
+        if (len < 1)
             return (0);
-        r->readBuf[r->readBufRemain] = 0;
-        r->readBufPtr = r->readBuf;
+        r->readBufPtr = r->readBuf + r->readBufLen;
+        r->readBufRemain = len;
+        r->readBufLen += len;
+        r->readBuf[r->readBufLen] = 0;
     }
     *cp = *r->readBufPtr++;
     r->readBufRemain--;
     return (1);
 }
 
-int
-_httpd_readLine(request * r, char *destBuf, int len)
+static char _httpd_noValue[] = "";
+
+/*
+** Reset the request fields before a new request head is parsed
+*/
+void
+_httpd_initRequest(request * r)
 {
-    char curChar, *dst;
-    int count;
+    r->request.method = 0;
+    r->request.contentLength = 0;
+    r->request.authLength = 0;
+    r->request.version = 10;
+    r->request.keepAlive = 0;
+    r->request.path = r->request.query = r->request.host = _httpd_noValue;
+    r->request.ifModified = r->request.user_agent = _httpd_noValue;
+    r->request.authUser = r->request.authPassword = _httpd_noValue;
+    r->readBufLen = r->headLines = r->headDone = 0;
+    r->parseOffset = r->keepOffset = 0;
+    r->readBufPtr = r->readBuf;
+    r->readBufRemain = 0;
+}
 
-    count = 0;
-    dst = destBuf;
-    while (count < len) {
-        if (_httpd_readChar(r, &curChar) < 1)
-            return (0);
-        // Fixed by Mina - if we read binary junk it's probably not a regular HTTP client
-        //if (curChar == '\n')
-        if (curChar == '\n' || !isascii(curChar)) {
-            *dst = 0;
-            return (1);
+/*
+** Match a header name, case insensitive, and return its value with
+** leading blanks skipped.  Only called once the first character has
+** matched, so most uninteresting headers never get here.
+*/
+static char *
+_httpd_headerValue(char *line, int lineLen, const char *name, int nameLen)
+{
+    char *cp;
+
+    if (lineLen < nameLen || strncasecmp(line, name, nameLen) != 0)
+        return (NULL);
+    cp = line + nameLen;
+    while (*cp == ' ' || *cp == '\t')
+        cp++;
+    return (cp);
+}
+
+static void
+_httpd_parseRequestLine(request * r, char *line)
+{
+    char *cp, *version;
+
+    cp = line;
+    while (isalpha((unsigned char)*cp))
+        cp++;
+    if (*cp)
+        *cp++ = 0;
+    if (strcasecmp(line, "GET") == 0)
+        r->request.method = HTTP_GET;
+    else if (strcasecmp(line, "POST") == 0)
+        r->request.method = HTTP_POST;
+    else
+        return;
+
+    while (*cp == ' ')
+        cp++;
+    r->request.path = cp;
+    while (*cp != ' ' && *cp != 0)
+        cp++;
+    version = *cp ? cp + 1 : cp;
+    *cp = 0;
+    _httpd_sanitiseUrl(r->request.path);
+
+    /*
+     ** HTTP/1.1 connections are persistent unless the client says
+     ** otherwise, HTTP/1.0 ones only if the client asks for it.
+     */
+    while (*version == ' ')
+        version++;
+    if (strncasecmp(version, "HTTP/1.", 7) == 0 && version[7] >= '1' && version[7] <= '9') {
+        r->request.version = 11;
+        r->request.keepAlive = 1;
+    }
+
+    cp = strchr(r->request.path, '?');
+    if (cp != NULL) {
+        *cp++ = 0;
+        r->request.query = cp;
+    }
+}
+
+static void
+_httpd_parseAuth(request * r, char *value)
+{
+    int _httpd_decode();
+    char *cp;
+
+    if (strncmp(value, "Basic ", 6) != 0)
+        return;                 /* Unknown auth method */
+    _httpd_decode(value + 6, r->request.authBuf, HTTP_MAX_AUTH - 1);
+    r->request.authLength = strlen(r->request.authBuf);
+    r->request.authUser = r->request.authBuf;
+    cp = strchr(r->request.authBuf, ':');
+    if (cp) {
+        *cp = 0;
+        r->request.authPassword = cp + 1;
+    }
+}
+
+/*
+** Parse the request head in place.  Lines are found with memchr()
+** and terminated where they are; the httpReq string fields end up
+** pointing straight into readBuf, nothing is copied.  Parsing is
+** incremental, it may be called every time more data has arrived.
+** With final set, whatever is left in the buffer is taken as the
+** last line.
+**
+** When the buffer fills up before the end of the head, the lines
+** parsed since the last header we kept are dropped to make room.  A
+** single line that does not fit at all ends the head.
+**
+** Returns 1 once the head is complete, 0 if more data is needed.
+*/
+int
+_httpd_parseHead(request * r, int final)
+{
+    char *line, *nl, *eol, *end, *value;
+    int lineLen, moved;
+
+    end = r->readBuf + r->readBufLen;
+    while (!r->headDone) {
+        line = r->readBuf + r->parseOffset;
+        nl = memchr(line, '\n', end - line);
+        if (nl == NULL) {
+            if (r->readBufLen < HTTP_READ_BUF_LEN && !final)
+                return (0);
+            moved = r->parseOffset - r->keepOffset;
+            if (moved > 0 && !final) {
+                memmove(r->readBuf + r->keepOffset, line, end - line);
+                r->readBufLen -= moved;
+                r->parseOffset = r->keepOffset;
+                return (0);
+            }
+            /* Last line, possibly truncated */
+            nl = end;
         }
-        if (curChar == '\r') {
-            continue;
+        eol = nl;
+        if (eol > line && eol[-1] == '\r')
+            eol--;
+        *eol = 0;
+        lineLen = eol - line;
+        r->parseOffset = nl < end ? nl + 1 - r->readBuf : r->readBufLen;
+
+        if (r->headLines++ == 0) {
+            _httpd_parseRequestLine(r, line);
+            r->keepOffset = r->parseOffset;
+        } else if (lineLen == 0) {
+            r->headDone = 1;
         } else {
-            *dst++ = curChar;
-            count++;
+            value = NULL;
+            switch (*line) {
+            case 'H':
+            case 'h':
+                /* Hosts longer than the old fixed buffers are refused */
+                if ((value = _httpd_headerValue(line, lineLen, "Host:", 5)) != NULL) {
+                    if (strlen(value) < HTTP_MAX_URL)
+                        r->request.host = value;
+                    else
+                        value = NULL;
+                }
+                break;
+            case 'U':
+            case 'u':
+                if ((value = _httpd_headerValue(line, lineLen, "User-Agent:", 11)) != NULL) {
+                    if (strlen(value) < HTTP_MAX_UA)
+                        r->request.user_agent = value;
+                    else
+                        value = NULL;
+                }
+                break;
+            case 'A':
+            case 'a':
+                if ((value = _httpd_headerValue(line, lineLen, "Authorization:", 14)) != NULL)
+                    _httpd_parseAuth(r, value);
+                break;
+            case 'C':
+            case 'c':
+                if ((value = _httpd_headerValue(line, lineLen, "Connection:", 11)) != NULL) {
+                    if (strncasecmp(value, "close", 5) == 0)
+                        r->request.keepAlive = 0;
+                    else if (strncasecmp(value, "keep-alive", 10) == 0)
+                        r->request.keepAlive = 1;
+                } else if ((value = _httpd_headerValue(line, lineLen, "Content-Length:", 15)) != NULL) {
+                    r->request.contentLength = atoi(value);
+                    if (r->request.contentLength < 0)
+                        r->request.contentLength = -1;
+                }
+                /* Nothing of these is kept */
+                value = NULL;
+                break;
+            case 'T':
+            case 't':
+                /* A chunked body cannot be skipped, never reuse the connection */
+                if (_httpd_headerValue(line, lineLen, "Transfer-Encoding:", 18) != NULL)
+                    r->request.contentLength = -1;
+                break;
+            }
+            if (value != NULL)
+                r->keepOffset = r->parseOffset;
         }
+        if (nl == end)
+            r->headDone = 1;
     }
-    *dst = 0;
+    r->readBufPtr = r->readBuf + r->parseOffset;
+    r->readBufRemain = r->readBufLen - r->parseOffset;
     return (1);
 }
 
@@ -308,66 +561,38 @@ httpVar *var;
         curVar = curVar->nextValue;
         free(lastVar->name);
         free(lastVar->value);
-        free(lastVar);
+        _httpd_releaseVar(lastVar);
     }
     return;
 }
 
+/*
+** Add the variables found in a query string.  The query itself is left
+** untouched, it usually points into the request's read buffer.
+*/
 void
 _httpd_storeData(request * r, char *query)
 {
-    char *cp, *cp2, *var, *val, *tmpVal;
+    char *buf, *var, *val, *next;
 
     if (!query)
         return;
 
-    var = (char *)malloc(strlen(query) + 1);
-
-    cp = query;
-    cp2 = var;
-    bzero(var, strlen(query) + 1);
-    val = NULL;
-    while (*cp) {
-        if (*cp == '=') {
-            cp++;
-            *cp2 = 0;
-            val = cp;
-            continue;
-        }
-        if (*cp == '&') {
-            *cp = 0;
-            tmpVal = _httpd_unescape(val);
-            httpdAddVariable(r, var, tmpVal);
-            cp++;
-            cp2 = var;
-            val = NULL;
+    buf = strdup(query);
+    if (buf == NULL)
+        return;
+
+    for (var = buf; var != NULL; var = next) {
+        next = strchr(var, '&');
+        if (next != NULL)
+            *next++ = 0;
+        val = strchr(var, '=');
+        if (val == NULL)
             continue;
-        }
-        if (val) {
-            cp++;
-        } else {
-            *cp2 = *cp++;
-            /*
-               if (*cp2 == '.')
-               {
-               strcpy(cp2,"_dot_");
-               cp2 += 5;
-               }
-               else
-               {
-             */
-            cp2++;
-            /*
-               }
-             */
-        }
+        *val++ = 0;
+        httpdAddVariable(r, var, _httpd_unescape(val));
     }
-    if (val != NULL) {
-        *cp = 0;
-        tmpVal = _httpd_unescape(val);
-        httpdAddVariable(r, var, tmpVal);
-    }
-    free(var);
+    free(buf);
 }
 
 void
@@ -381,41 +606,130 @@ _httpd_formatTimeString(char *ptr, int clock)
     strftime(ptr, HTTP_TIME_STRING_LEN, "%a, %d %b %Y %T GMT", timePtr);
 }
 
+/*
+** Headers are not written here any more, only committed to: the head
+** is rendered by _httpd_finishResponse() once the whole body is known.
+*/
 void
 _httpd_sendHeaders(request * r, int contentLength, int modTime)
 {
-    char tmpBuf[80], timeBuf[HTTP_TIME_STRING_LEN];
-
     if (r->response.headersSent)
         return;
 
     r->response.headersSent = 1;
-    _httpd_net_write(r->clientSock, "HTTP/1.0 ", 9);
-    _httpd_net_write(r->clientSock, r->response.response, strlen(r->response.response));
-    _httpd_net_write(r->clientSock, r->response.headers, strlen(r->response.headers));
+    if (contentLength > 0)
+        r->response.modTime = modTime;
+}
 
-    _httpd_formatTimeString(timeBuf, 0);
-    _httpd_net_write(r->clientSock, "Date: ", 6);
-    _httpd_net_write(r->clientSock, timeBuf, strlen(timeBuf));
-    _httpd_net_write(r->clientSock, "\n", 1);
+/*
+** Whether the connection may carry another request once this one has
+** been answered.  The request body, if any, must be in the read buffer
+** already so it can be skipped.
+*/
+int
+_httpd_keepAlive(httpd * server, request * r)
+{
+    if (server->keepAliveTimeout <= 0 || !r->request.keepAlive || !r->response.headersSent)
+        return (0);
+    if (server->keepAliveMax > 0 && r->requests + 1 >= server->keepAliveMax)
+        return (0);
+    if (r->request.contentLength < 0 || r->readBufLen - r->parseOffset < r->request.contentLength)
+        return (0);
+    return (1);
+}
 
-    _httpd_net_write(r->clientSock, "Connection: close\n", 18);
-    _httpd_net_write(r->clientSock, "Content-Type: ", 14);
-    _httpd_net_write(r->clientSock, r->response.contentType, strlen(r->response.contentType));
-    _httpd_net_write(r->clientSock, "\n", 1);
+void
+_httpd_finishResponse(request * r, int keepAlive)
+{
+    char timeBuf[HTTP_TIME_STRING_LEN], modBuf[HTTP_TIME_STRING_LEN];
+    int size;
 
-    if (contentLength > 0) {
-        _httpd_net_write(r->clientSock, "Content-Length: ", 16);
-        snprintf(tmpBuf, sizeof(tmpBuf), "%d", contentLength);
-        _httpd_net_write(r->clientSock, tmpBuf, strlen(tmpBuf));
-        _httpd_net_write(r->clientSock, "\n", 1);
+    r->keepAlive = keepAlive;
+    r->outSent = 0;
+    r->headLen = 0;
+    if (!r->response.headersSent)
+        return;
 
-        _httpd_formatTimeString(timeBuf, modTime);
-        _httpd_net_write(r->clientSock, "Last-Modified: ", 15);
-        _httpd_net_write(r->clientSock, timeBuf, strlen(timeBuf));
-        _httpd_net_write(r->clientSock, "\n", 1);
+    _httpd_formatTimeString(timeBuf, 0);
+    *modBuf = 0;
+    if (r->response.modTime)
+        _httpd_formatTimeString(modBuf, r->response.modTime);
+    size = strlen(r->response.response) + strlen(r->response.headers) + strlen(r->response.contentType) + 2 * HTTP_TIME_STRING_LEN + 128;
+    if (size > r->headSize) {
+        free(r->headBuf);
+        r->headBuf = malloc(size);
+        if (r->headBuf == NULL) {
+            r->headSize = 0;
+            r->keepAlive = 0;
+            return;
+        }
+        r->headSize = size;
     }
-    _httpd_net_write(r->clientSock, "\n", 1);
+    r->headLen = snprintf(r->headBuf, size,
+                          "HTTP/1.%d %s%sDate: %s\nConnection: %s\nContent-Type: %s\nContent-Length: %d\n%s%s%s\n",
+                          r->request.version == 11 ? 1 : 0, r->response.response, r->response.headers, timeBuf,
+                          keepAlive ? "keep-alive" : "close", r->response.contentType, r->outLen,
+                          *modBuf ? "Last-Modified: " : "", modBuf, *modBuf ? "\n" : "");
+    if (r->headLen >= size)
+        r->headLen = size - 1;
+}
+
+/*
+** Send as much of the rendered response as the socket takes in one
+** call, resuming at outSent.  Returns what sendmsg() returned.
+*/
+int
+_httpd_sendResponse(request * r, int flags)
+{
+    struct iovec iov[2];
+    struct msghdr msg;
+    int count, len;
+
+    count = 0;
+    if (r->outSent < r->headLen) {
+        iov[count].iov_base = r->headBuf + r->outSent;
+        iov[count].iov_len = r->headLen - r->outSent;
+        count++;
+        iov[count].iov_base = r->outBuf;
+        iov[count].iov_len = r->outLen;
+        count++;
+    } else {
+        iov[count].iov_base = r->outBuf + (r->outSent - r->headLen);
+        iov[count].iov_len = r->outLen - (r->outSent - r->headLen);
+        count++;
+    }
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = count;
+    len = sendmsg(r->clientSock, &msg, flags | MSG_NOSIGNAL);
+    if (len > 0)
+        r->outSent += len;
+    return (len);
+}
+
+/*
+** Get a persistent connection ready for its next request.  Bytes the
+** client already sent past this request (pipelined requests) move to
+** the start of the read buffer.
+*/
+void
+_httpd_nextRequest(request * r)
+{
+    int bodyEnd, left;
+
+    bodyEnd = r->parseOffset + r->request.contentLength;
+    left = r->readBufLen - bodyEnd;
+    if (left > 0)
+        memmove(r->readBuf, r->readBuf + bodyEnd, left);
+    else
+        left = 0;
+    _httpd_freeVariables(r->variables);
+    r->variables = NULL;
+    r->headLen = r->outLen = r->outSent = 0;
+    r->response.headersSent = 0;
+    r->requests++;
+    _httpd_initRequest(r);
+    r->readBufLen = left;
 }
 
 httpDir *
@@ -455,24 +769,186 @@ int createFlag;
     return (curItem);
 }
 
-httpContent *
-_httpd_findContentEntry(request * r, httpDir * dir, char *entryName)
+/*
+** Routing table.  Every registered entry is keyed by its directory
+** components and its name, joined with single slashes ("wifidog/about"),
+** and a directory holding a wildcard gets a fallback route keyed by the
+** directory alone ("wifidog/").  The table is rebuilt from the content
+** tree whenever content is added, in the order the tree would have
+** been searched, so a request costs one hash lookup plus one more when
+** it falls back to a wildcard.
+*/
+static unsigned int
+_httpd_routeHash(const char *key, int len)
 {
-    httpContent *curEntry;
+    unsigned int hash = 2166136261u;
 
-    curEntry = dir->entries;
-    while (curEntry) {
-        if (curEntry->type == HTTP_WILDCARD || curEntry->type == HTTP_C_WILDCARD)
-            break;
-        if (*entryName == 0 && curEntry->indexFlag)
+    while (len-- > 0) {
+        hash ^= (unsigned char)*key++;
+        hash *= 16777619u;
+    }
+    return (hash);
+}
+
+static httpRoute *
+_httpd_lookupRoute(httpd * server, const char *key, int len, int wildcard)
+{
+    httpRoute *route;
+
+    if (server->routes == NULL)
+        return (NULL);
+    route = server->routes[_httpd_routeHash(key, len) & server->routeMask];
+    while (route) {
+        if (route->wildcard == wildcard && route->keyLen == len && memcmp(route->key, key, len) == 0)
             break;
-        if (strcmp(curEntry->name, entryName) == 0)
+        route = route->next;
+    }
+    return (route);
+}
+
+static void
+_httpd_addRoute(httpd * server, const char *key, int len, int wildcard, httpContent * entry)
+{
+    httpRoute *route;
+    unsigned int bucket;
+
+    /* Earlier entries shadow later ones, as in a linear search */
+    if (_httpd_lookupRoute(server, key, len, wildcard))
+        return;
+    route = malloc(sizeof(httpRoute) + len + 1);
+    if (route == NULL)
+        return;
+    route->key = (char *)(route + 1);
+    memcpy(route->key, key, len);
+    route->key[len] = 0;
+    route->keyLen = len;
+    route->wildcard = wildcard;
+    route->entry = entry;
+    bucket = _httpd_routeHash(key, len) & server->routeMask;
+    route->next = server->routes[bucket];
+    server->routes[bucket] = route;
+}
+
+static int
+_httpd_countContent(httpDir * dir)
+{
+    httpContent *entry;
+    httpDir *child;
+    int count = 1;
+
+    for (entry = dir->entries; entry; entry = entry->next)
+        count += 2;
+    for (child = dir->children; child; child = child->next)
+        count += _httpd_countContent(child);
+    return (count);
+}
+
+static void
+_httpd_addDirRoutes(httpd * server, httpDir * dir, char *key, int len)
+{
+    httpContent *entry;
+    httpDir *child;
+    int nameLen;
+
+    for (entry = dir->entries; entry; entry = entry->next) {
+        if (entry->type == HTTP_WILDCARD || entry->type == HTTP_C_WILDCARD) {
+            _httpd_addRoute(server, key, len, 1, entry);
             break;
-        curEntry = curEntry->next;
+        }
+        if (entry->indexFlag)
+            _httpd_addRoute(server, key, len, 0, entry);
+        nameLen = strlen(entry->name);
+        if (len + nameLen >= HTTP_MAX_URL)
+            continue;
+        memcpy(key + len, entry->name, nameLen);
+        _httpd_addRoute(server, key, len + nameLen, 0, entry);
+    }
+    for (child = dir->children; child; child = child->next) {
+        nameLen = strlen(child->name);
+        if (len + nameLen + 1 >= HTTP_MAX_URL)
+            continue;
+        memcpy(key + len, child->name, nameLen);
+        key[len + nameLen] = '/';
+        _httpd_addDirRoutes(server, child, key, len + nameLen + 1);
+    }
+}
+
+void
+_httpd_freeRoutes(httpd * server)
+{
+    httpRoute *route, *next;
+    int count;
+
+    if (server->routes == NULL)
+        return;
+    for (count = 0; count <= server->routeMask; count++) {
+        for (route = server->routes[count]; route; route = next) {
+            next = route->next;
+            free(route);
+        }
+    }
+    free(server->routes);
+    server->routes = NULL;
+    server->routeMask = 0;
+}
+
+void
+_httpd_buildRoutes(httpd * server)
+{
+    char key[HTTP_MAX_URL];
+    int size, count;
+
+    _httpd_freeRoutes(server);
+    count = _httpd_countContent(server->content);
+    for (size = 16; size < count * 2; size *= 2) ;
+    server->routes = calloc(size, sizeof(httpRoute *));
+    if (server->routes == NULL)
+        return;
+    server->routeMask = size - 1;
+    _httpd_addDirRoutes(server, server->content, key, 0);
+}
+
+/*
+** Resolve a request path.  entryName points behind the last slash of
+** the path.  Paths without empty components are looked up in place,
+** others are first collapsed the way _httpd_findContentDir() would.
+*/
+httpContent *
+_httpd_findRoute(httpd * server, request * r, const char *path, const char *entryName)
+{
+    char buffer[HTTP_MAX_URL];
+    const char *key, *cp, *end;
+    httpRoute *route;
+    int len, dirLen;
+
+    if (server->master)
+        server = server->master;
+    if (*path == '/' && strstr(path, "//") == NULL) {
+        key = path + 1;
+        len = strlen(key);
+        dirLen = entryName - key;
+    } else {
+        len = 0;
+        end = entryName - 1;
+        for (cp = path; cp < end && len < HTTP_MAX_URL - 1; cp++) {
+            if (*cp == '/' && (len == 0 || buffer[len - 1] == '/'))
+                continue;
+            buffer[len++] = *cp;
+        }
+        if (len > 0 && buffer[len - 1] != '/' && len < HTTP_MAX_URL - 1)
+            buffer[len++] = '/';
+        dirLen = len;
+        while (*entryName && len < HTTP_MAX_URL - 1)
+            buffer[len++] = *entryName++;
+        key = buffer;
     }
-    if (curEntry)
-        r->response.content = curEntry;
-    return (curEntry);
+    route = _httpd_lookupRoute(server, key, len, 0);
+    if (route == NULL)
+        route = _httpd_lookupRoute(server, key, dirLen, 1);
+    if (route == NULL)
+        return (NULL);
+    r->response.content = route->entry;
+    return (route->entry);
 }
 
 void
@@ -537,7 +1013,7 @@ _httpd_catFile(request * r, const char *path)
     len = read(fd, buf, HTTP_MAX_LEN);
     while (len > 0) {
         r->response.responseLength += len;
-        _httpd_net_write(r->clientSock, buf, len);
+        _httpd_write(r, buf, len);
         len = read(fd, buf, HTTP_MAX_LEN);
     }
     close(fd);
@@ -549,7 +1025,7 @@ _httpd_sendStatic(httpd * server, request * r, char *data)
     if (_httpd_checkLastModified(r, server->startTime) == 0) {
         _httpd_send304(server, r);
     }
-    _httpd_sendHeaders(r, server->startTime, strlen(data));
+    _httpd_sendHeaders(r, strlen(data), server->startTime);
     httpdOutput(r, data);
 }
 
@@ -598,7 +1074,7 @@ void
 _httpd_sendText(request * r, char *msg)
 {
     r->response.responseLength += strlen(msg);
-    _httpd_net_write(r->clientSock, msg, strlen(msg));
+    _httpd_write(r, msg, strlen(msg));
 }
 
 int
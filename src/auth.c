@@ -83,23 +83,21 @@ thread_client_timeout_check(const void *arg)
 }
 
 /**
- * @brief Logout a client and report to auth server.
+ * @brief Reports the logout of a client to the auth server
  *
- * This function assumes it is being called with the client lock held! This
- * function remove the client from the client list and free its memory, so
- * client is no langer valid when this method returns.
+ * The request blocks until the auth server answers, so no client lock
+ * needs to be held: the client may already be off the list.
  *
- * @param client Points to the client to be logged out
+ * @param client Points to the client logged out
  */
 void
-logout_client(t_client * client)
+logout_client_report(t_client * client)
 {
     t_authresponse authresponse;
     const s_config *config = config_get_config();
-    fw_deny(client);
+    char ip[CLIENT_IP_TEXT_LEN], mac[CLIENT_MAC_TEXT_LEN];
     /* Advertise the logout if we have an auth server */
     if (config->auth_servers != NULL) {
-//        UNLOCK_CLIENT_LIST();
         char *token = NULL;
         int auth_type = client->auth_type;
         if (client->token == NULL) {
@@ -110,15 +108,31 @@ logout_client(t_client * client)
             debug(LOG_DEBUG, "logout_client %s %d", token, auth_type);
         }
         auth_server_request(&authresponse, REQUEST_TYPE_LOGOUT,
-                            client->ip, client->mac, auth_type, token, 
+                            client_ip_text(client, ip), client_mac_text(client, mac), auth_type, token, 
                             client->counters.incoming, client->counters.outgoing);
         debug(LOG_DEBUG, "logout_client auth_server_request");
         if (authresponse.authcode == AUTH_ERROR)
             debug(LOG_WARNING, "Auth server error when reporting logout");
         free(token);
         token = NULL;
-//        LOCK_CLIENT_LIST();
     }
+}
+
+/**
+ * @brief Logout a client and report to auth server.
+ *
+ * This function assumes it is being called with the lock of the client's
+ * shard, or the whole client list lock, held for writing! This
+ * function remove the client from the client list and free its memory, so
+ * client is no langer valid when this method returns.
+ *
+ * @param client Points to the client to be logged out
+ */
+void
+logout_client(t_client * client)
+{
+    fw_deny(client, NULL);
+    logout_client_report(client);
     client_list_remove(client);
     debug(LOG_DEBUG, "logout_client try client_list_remove");
     debug(LOG_DEBUG, "logout_client try client_free_node");
@@ -138,19 +152,25 @@ authenticate_client(request * r, int skip_get_protal)
     char *token;
     httpVar *var;
     char *urlFragment = NULL;
+    const char *redirect_text = NULL;
     s_config *config = NULL;
     t_auth_serv *auth_server = NULL;
+    char ip[CLIENT_IP_TEXT_LEN], mac[CLIENT_MAC_TEXT_LEN];
+    t_client_shard *shard = client_shard_by_ip(r->clientAddr);
+    t_fw_ticket ticket = 0;
 
-    LOCK_CLIENT_LIST();
+    RDLOCK_CLIENT_SHARD(shard);
 
     client = client_dup(client_list_find_by_ip(r->clientAddr));
 
-    UNLOCK_CLIENT_LIST();
+    UNLOCK_CLIENT_SHARD(shard);
 
     if (client == NULL) {
         debug(LOG_ERR, "authenticate_client(): Could not find client for %s", r->clientAddr);
         return;
     }
+    client_ip_text(client, ip);
+    client_mac_text(client, mac);
 
     /* Users could try to log in(so there is a valid token in
      * request) even after they have logged in, try to deal with
@@ -166,16 +186,16 @@ authenticate_client(request * r, int skip_get_protal)
      * take multiple seconds to do and the gateway would effectively be frozen if we
      * kept the lock.
      */
-    auth_server_request(&auth_response, REQUEST_TYPE_LOGIN, client->ip, client->mac, client->auth_type, token, 0, 0);
+    auth_server_request(&auth_response, REQUEST_TYPE_LOGIN, ip, mac, client->auth_type, token, 0, 0);
 
-    LOCK_CLIENT_LIST();
+    LOCK_CLIENT_SHARD(shard);
 
     /* can't trust the client to still exist after n seconds have passed */
     tmp = client_list_find_by_client(client);
 
     if (NULL == tmp) {
-        debug(LOG_ERR, "authenticate_client(): Could not find client node for %s (%s)", client->ip, client->mac);
-        UNLOCK_CLIENT_LIST();
+        debug(LOG_ERR, "authenticate_client(): Could not find client node for %s (%s)", ip, mac);
+        UNLOCK_CLIENT_SHARD(shard);
         client_list_destroy(client);    /* Free the cloned client */
         free(token);
         return;
@@ -184,11 +204,9 @@ authenticate_client(request * r, int skip_get_protal)
     client = tmp;
     if (strcmp(token, client->token) != 0) {
         /* If token changed, save it. */
-        free(client->token);
-        client->token = token;
-    } else {
-        free(token);
+        client_list_set_token(client, token);
     }
+    free(token);
     if (!skip_get_protal) {
         /* Prepare some variables we'll need below */
         config = config_get_config();
@@ -198,8 +216,8 @@ authenticate_client(request * r, int skip_get_protal)
 
         case AUTH_ERROR:
             /* Error talking to central server */
-            debug(LOG_ERR, "Got ERROR from central server authenticating token %s from %s at %s", client->token, client->ip,
-                  client->mac);
+            debug(LOG_ERR, "Got ERROR from central server authenticating token %s from %s at %s", client->token, ip,
+                  mac);
             send_http_page(r, "Error!", "Error: We did not get a valid answer from the central server");
             break;
 
@@ -207,60 +225,69 @@ authenticate_client(request * r, int skip_get_protal)
             /* Central server said invalid token */
             debug(LOG_INFO,
                   "Got DENIED from central server authenticating token %s from %s at %s - deleting from firewall and redirecting them to denied message",
-                  client->token, client->ip, client->mac);
-            fw_deny(client);
+                  client->token, ip, mac);
+            fw_deny(client, NULL);
             safe_asprintf(&urlFragment, "%smessage=%s",
                           auth_server->authserv_msg_script_path_fragment, GATEWAY_MESSAGE_DENIED);
-            http_send_redirect_to_auth(r, urlFragment, "Redirect to denied message");
-            free(urlFragment);
+            redirect_text = "Redirect to denied message";
             break;
 
         case AUTH_VALIDATION:
             /* They just got validated for X minutes to check their email */
             debug(LOG_INFO, "Got VALIDATION from central server authenticating token %s from %s at %s"
-                  "- adding to firewall and redirecting them to activate message", client->token, client->ip, client->mac);
-            fw_allow(client, FW_MARK_PROBATION);
+                  "- adding to firewall and redirecting them to activate message", client->token, ip, mac);
+            fw_allow(client, FW_MARK_PROBATION, &ticket);
             safe_asprintf(&urlFragment, "%smessage=%s",
                           auth_server->authserv_msg_script_path_fragment, GATEWAY_MESSAGE_ACTIVATE_ACCOUNT);
-            http_send_redirect_to_auth(r, urlFragment, "Redirect to activate message");
-            free(urlFragment);
+            redirect_text = "Redirect to activate message";
             break;
 
         case AUTH_ALLOWED:
             /* Logged in successfully as a regular account */
             debug(LOG_INFO, "Got ALLOWED from central server authenticating token %s from %s at %s - "
-                  "adding to firewall and redirecting them to portal", client->token, client->ip, client->mac);
-            fw_allow(client, FW_MARK_KNOWN);
+                  "adding to firewall and redirecting them to portal", client->token, ip, mac);
+            fw_allow(client, FW_MARK_KNOWN, &ticket);
             served_this_session++;
             safe_asprintf(&urlFragment, "%sgw_id=%s", auth_server->authserv_portal_script_path_fragment, config->gw_id);
-            http_send_redirect_to_auth(r, urlFragment, "Redirect to portal");
-            free(urlFragment);
+            redirect_text = "Redirect to portal";
             break;
 
         case AUTH_VALIDATION_FAILED:
             /* Client had X minutes to validate account by email and didn't = too late */
             debug(LOG_INFO, "Got VALIDATION_FAILED from central server authenticating token %s from %s at %s "
-                  "- redirecting them to failed_validation message", client->token, client->ip, client->mac);
+                  "- redirecting them to failed_validation message", client->token, ip, mac);
             safe_asprintf(&urlFragment, "%smessage=%s",
                           auth_server->authserv_msg_script_path_fragment, GATEWAY_MESSAGE_ACCOUNT_VALIDATION_FAILED);
-            http_send_redirect_to_auth(r, urlFragment, "Redirect to failed validation message");
-            free(urlFragment);
+            redirect_text = "Redirect to failed validation message";
             break;
 
         default:
             debug(LOG_WARNING,
                   "I don't know what the validation code %d means for token %s from %s at %s - sending error message",
-                  auth_response.authcode, client->token, client->ip, client->mac);
+                  auth_response.authcode, client->token, ip, mac);
             send_http_page(r, "Internal Error", "We can not validate your request at this time");
             break;
 
         }
     } else {
         if (auth_response.authcode == AUTH_ALLOWED) {
-            fw_allow(client, FW_MARK_KNOWN);
+            fw_allow(client, FW_MARK_KNOWN, &ticket);
             served_this_session++;
         }
     }
-    UNLOCK_CLIENT_LIST();
+    UNLOCK_CLIENT_SHARD(shard);
+
+    /* The client must get through before it follows the redirect */
+    if (fw_wait(ticket) != 0) {
+        debug(LOG_ERR, "Could not let %s (%s) through the firewall", ip, mac);
+        if (urlFragment != NULL)
+            send_http_page(r, "Error!", "Error: We could not let you through, please try again");
+        free(urlFragment);
+        return AUTH_ERROR;
+    }
+    if (urlFragment != NULL) {
+        http_send_redirect_to_auth(r, urlFragment, redirect_text);
+        free(urlFragment);
+    }
     return auth_response.authcode;
 }
@@ -56,6 +56,9 @@ typedef struct _t_authresponse {
 /** @brief Logout a client and report to auth server. */
 void logout_client(t_client *);
 
+/** @brief Report the logout of a client to the auth server */
+void logout_client_report(t_client *);
+
 /** @brief Authenticate a single client against the central server */
 int authenticate_client(request *, int skip_get_protal);
 
@@ -36,16 +36,13 @@
 #include <sys/unistd.h>
 
 #include <string.h>
+#include <arpa/inet.h>
 
 #include "safe.h"
 #include "debug.h"
 #include "conf.h"
 #include "client_list.h"
-
-/** @internal
- * Holds a pointer to the first element of the list 
- */
-static t_client *firstclient = NULL;
+#include "session_store.h"
 
 /** @internal
  * Client ID
@@ -57,8 +54,235 @@ static volatile unsigned long long client_id = 1;
  */
 static pthread_mutex_t client_id_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-/** Global mutex to protect access to the client list */
-pthread_mutex_t client_list_mutex = PTHREAD_MUTEX_INITIALIZER;
+/** The client table.  A client lives in the shard picked by its IP
+ * address, see client_shard_by_ip().  Each shard has its own list, its
+ * own lock and its own hash indexes by IP, MAC, token and id.  An index
+ * is an array of chains linked through t_client.hash_next.  Chains keep
+ * the order of the shard's list, so a lookup returns the same client a
+ * linear search of the list would.
+ */
+t_client_shard client_shards[CLIENT_SHARDS];
+
+#define CLIENT_INDEX_MIN_BUCKETS 64
+
+static unsigned int
+client_hash_bytes(const unsigned char *p, size_t len)
+{
+    unsigned int hash = 2166136261u;
+
+    while (len--) {
+        hash ^= *p++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static unsigned int
+client_hash_string(const char *s)
+{
+    return client_hash_bytes((const unsigned char *)s, strlen(s));
+}
+
+static unsigned int
+client_hash(const t_client * client, int index)
+{
+    switch (index) {
+    case CLIENT_INDEX_IP:
+        return client_hash_bytes((const unsigned char *)&client->ip, sizeof(client->ip));
+    case CLIENT_INDEX_MAC:
+        return client_hash_bytes(client->mac, sizeof(client->mac));
+    case CLIENT_INDEX_TOKEN:
+        return client_hash_string(client->token);
+    default:
+        return (unsigned int)(client->id ^ (client->id >> 32)) * 2654435761u;
+    }
+}
+
+/** @internal
+ * Shard of an IP address in network byte order.  It uses the top bits
+ * of the hash, the indexes inside the shard use the bottom ones.
+ */
+static t_client_shard *
+client_shard_by_addr(uint32_t addr)
+{
+    unsigned int hash = client_hash_bytes((const unsigned char *)&addr, sizeof(addr));
+
+    return &client_shards[hash >> (32 - CLIENT_SHARD_BITS)];
+}
+
+/** Shard that holds, or would hold, the client with this IP address.
+ * An IP address that does not parse maps to the same shard as 0.0.0.0,
+ * client_list_add() refuses such an address.
+ */
+t_client_shard *
+client_shard_by_ip(const char *ip)
+{
+    uint32_t addr = 0;
+
+    client_parse_ip(ip, &addr);
+    return client_shard_by_addr(addr);
+}
+
+/** Shard that holds, or would hold, a client.  Works on copies too. */
+t_client_shard *
+client_shard_of(const t_client * client)
+{
+    return client_shard_by_addr(client->ip);
+}
+
+/** @internal
+ * Builds the indexes of a shard from scratch with room for at least
+ * count clients
+ */
+static void
+client_index_rebuild(t_client_shard * shard, unsigned int count)
+{
+    t_client **tails, *client;
+    unsigned int size, bucket;
+    int index;
+
+    for (size = CLIENT_INDEX_MIN_BUCKETS; size < count; size *= 2) ;
+    tails = safe_malloc(size * sizeof(t_client *));
+    for (index = 0; index < CLIENT_INDEX_COUNT; index++) {
+        free(shard->index[index]);
+        shard->index[index] = safe_malloc(size * sizeof(t_client *));
+        memset(shard->index[index], 0, size * sizeof(t_client *));
+        memset(tails, 0, size * sizeof(t_client *));
+        for (client = shard->first; client != NULL; client = client->next) {
+            bucket = client_hash(client, index) & (size - 1);
+            client->hash_next[index] = NULL;
+            if (tails[bucket])
+                tails[bucket]->hash_next[index] = client;
+            else
+                shard->index[index][bucket] = client;
+            tails[bucket] = client;
+        }
+    }
+    free(tails);
+    shard->mask = size - 1;
+}
+
+/** @internal
+ * Adds a client that is already on its shard's list.  It goes to the
+ * head of its chains, which keeps them in list order for a client that
+ * was just inserted at the head of the list.
+ */
+static void
+client_index_add(t_client_shard * shard, t_client * client)
+{
+    unsigned int bucket;
+    int index;
+
+    if (shard->count >= shard->mask + 1 || shard->index[0] == NULL) {
+        /* The list already holds the new client */
+        client_index_rebuild(shard, 2 * (shard->count + 1));
+        return;
+    }
+    for (index = 0; index < CLIENT_INDEX_COUNT; index++) {
+        bucket = client_hash(client, index) & shard->mask;
+        client->hash_next[index] = shard->index[index][bucket];
+        shard->index[index][bucket] = client;
+    }
+}
+
+static void
+client_index_remove(t_client_shard * shard, t_client * client)
+{
+    t_client **link;
+    int index;
+
+    for (index = 0; index < CLIENT_INDEX_COUNT; index++) {
+        link = &shard->index[index][client_hash(client, index) & shard->mask];
+        while (*link != NULL && *link != client)
+            link = &(*link)->hash_next[index];
+        if (*link != NULL)
+            *link = client->hash_next[index];
+        client->hash_next[index] = NULL;
+    }
+}
+
+/** @internal
+ * Moves a client to the chain of its current key in one index.  It goes
+ * after the closest client before it on the list that shares the chain,
+ * so the chain stays in list order.
+ */
+static void
+client_index_relink(t_client_shard * shard, t_client * client, int index, unsigned int old_hash)
+{
+    t_client **link, *prev;
+    unsigned int bucket;
+
+    link = &shard->index[index][old_hash & shard->mask];
+    while (*link != NULL && *link != client)
+        link = &(*link)->hash_next[index];
+    if (*link != NULL)
+        *link = client->hash_next[index];
+
+    bucket = client_hash(client, index) & shard->mask;
+    for (prev = client->prev; prev != NULL; prev = prev->prev)
+        if ((client_hash(prev, index) & shard->mask) == bucket)
+            break;
+    link = prev ? &prev->hash_next[index] : &shard->index[index][bucket];
+    client->hash_next[index] = *link;
+    *link = client;
+}
+
+/** @internal
+ * First client on the chain of a key in a shard
+ */
+static t_client *
+client_index_first(const t_client_shard * shard, int index, unsigned int hash)
+{
+    if (shard->index[index] == NULL)
+        return NULL;
+    return shard->index[index][hash & shard->mask];
+}
+
+/** @internal
+ * Each shard also keeps its clients on a list ordered by
+ * counters.last_updated, least recent first.  Activity is always "now",
+ * so a touched client moves to the tail in constant time.  The clients
+ * due to time out are the ones at the head.
+ */
+static void
+client_expiry_unlink(t_client_shard * shard, t_client * client)
+{
+    if (client->expiry_prev)
+        client->expiry_prev->expiry_next = client->expiry_next;
+    else
+        shard->expiry_first = client->expiry_next;
+    if (client->expiry_next)
+        client->expiry_next->expiry_prev = client->expiry_prev;
+    else
+        shard->expiry_last = client->expiry_prev;
+    client->expiry_prev = client->expiry_next = NULL;
+}
+
+/** @internal
+ * Links a client into the expiry order.  The search starts from the
+ * tail, so a client active now is placed in constant time; only clients
+ * inherited from a restarted parent may land further in.
+ */
+static void
+client_expiry_link(t_client_shard * shard, t_client * client)
+{
+    t_client *after = shard->expiry_last;
+
+    while (after != NULL && after->counters.last_updated > client->counters.last_updated)
+        after = after->expiry_prev;
+    client->expiry_prev = after;
+    if (after) {
+        client->expiry_next = after->expiry_next;
+        after->expiry_next = client;
+    } else {
+        client->expiry_next = shard->expiry_first;
+        shard->expiry_first = client;
+    }
+    if (client->expiry_next)
+        client->expiry_next->expiry_prev = client;
+    else
+        shard->expiry_last = client;
+}
 
 /** Get a new client struct, not added to the list yet
  * @return Pointer to newly created client object not on the list yet.
@@ -68,9 +292,92 @@ client_get_new(void)
 {
     t_client *client;
     client = safe_malloc(sizeof(t_client));
+    memset(client, 0, sizeof(t_client));
+    client->token = client->token_buf;
+    client->store_slot = -1;
     return client;
 }
 
+/** Text form of a client's IP address, for logs, commands and requests
+ * @param client The client
+ * @param buf At least CLIENT_IP_TEXT_LEN bytes
+ * @return buf
+ */
+const char *
+client_ip_text(const t_client * client, char *buf)
+{
+    if (inet_ntop(AF_INET, &client->ip, buf, CLIENT_IP_TEXT_LEN) == NULL)
+        *buf = 0;
+    return buf;
+}
+
+/** Text form of a client's MAC address, lower case and colon separated
+ * @param client The client
+ * @param buf At least CLIENT_MAC_TEXT_LEN bytes
+ * @return buf
+ */
+const char *
+client_mac_text(const t_client * client, char *buf)
+{
+    snprintf(buf, CLIENT_MAC_TEXT_LEN, "%02x:%02x:%02x:%02x:%02x:%02x",
+             client->mac[0], client->mac[1], client->mac[2], client->mac[3], client->mac[4], client->mac[5]);
+    return buf;
+}
+
+/** Parses a dotted quad IPv4 address
+ * @return 1 on success, 0 if ip is not an IPv4 address
+ */
+int
+client_parse_ip(const char *ip, uint32_t * addr)
+{
+    struct in_addr in;
+
+    if (ip == NULL || inet_pton(AF_INET, ip, &in) != 1)
+        return 0;
+    *addr = in.s_addr;
+    return 1;
+}
+
+/** Parses a colon separated MAC address, in either case
+ * @return 1 on success, 0 if mac is not a MAC address
+ */
+int
+client_parse_mac(const char *mac, unsigned char *addr)
+{
+    unsigned int b[6];
+    char end;
+    int i;
+
+    if (mac == NULL || sscanf(mac, "%x:%x:%x:%x:%x:%x%c", &b[0], &b[1], &b[2], &b[3], &b[4], &b[5], &end) != 6)
+        return 0;
+    for (i = 0; i < 6; i++) {
+        if (b[i] > 0xff)
+            return 0;
+        addr[i] = (unsigned char)b[i];
+    }
+    return 1;
+}
+
+/** Sets the token of a client that is not on the list.  Short tokens
+ * are kept in the client record, longer ones on the heap.
+ * @param client The client
+ * @param token The token, copied
+ */
+void
+client_set_token(t_client * client, const char *token)
+{
+    size_t len = strlen(token);
+
+    if (client->token != client->token_buf)
+        free(client->token);
+    if (len < sizeof(client->token_buf)) {
+        client->token = client->token_buf;
+        memcpy(client->token_buf, token, len + 1);
+    } else {
+        client->token = safe_strdup(token);
+    }
+}
+
 void showDebugInfo(const char* tag, const t_client * src) {
     t_client* t = src;
     // debug(LOG_INFO, "showDebugInfo tag:%s id:%d ip:%s mac:%s token:%s authtype:%d", 
@@ -83,58 +390,137 @@ void showDebugInfo(const char* tag, const t_client * src) {
     //     );
 }
 
-/** Get the first element of the list of connected clients
+/**
+ * Initializes the list of connected clients (client)
  */
-t_client *
-client_get_first_client(void)
+void
+client_list_init(void)
 {
-    return firstclient;
+    int i;
+
+    for (i = 0; i < CLIENT_SHARDS; i++) {
+        pthread_rwlock_init(&client_shards[i].lock, NULL);
+        client_shards[i].first = NULL;
+        client_shards[i].count = 0;
+        client_shards[i].expiry_first = client_shards[i].expiry_last = NULL;
+        client_index_rebuild(&client_shards[i], 0);
+    }
 }
 
-/**
- * Initializes the list of connected clients (client)
+/** Locks every shard, always in the same order.  This is the whole
+ * table lock behind LOCK_CLIENT_LIST() and RDLOCK_CLIENT_LIST().  Never
+ * take it while holding the lock of a single shard.
+ * @param exclusive Non-zero to lock for writing
  */
 void
-client_list_init(void)
+client_list_lock_all(int exclusive)
 {
-    firstclient = NULL;
+    int i;
+
+    for (i = 0; i < CLIENT_SHARDS; i++) {
+        if (exclusive)
+            pthread_rwlock_wrlock(&client_shards[i].lock);
+        else
+            pthread_rwlock_rdlock(&client_shards[i].lock);
+    }
 }
 
-/** Insert client at head of list. Lock should be held when calling this!
+/** Releases the locks taken by client_list_lock_all() */
+void
+client_list_unlock_all(void)
+{
+    int i;
+
+    for (i = CLIENT_SHARDS - 1; i >= 0; i--)
+        pthread_rwlock_unlock(&client_shards[i].lock);
+}
+
+/** Visits every client, one shard at a time.  Each shard is locked
+ * while it is visited and released before the next one, so the walk
+ * never stops the whole table.  It is not a snapshot: a client can
+ * arrive in, or leave, a shard that was already visited.  Hold no
+ * client lock when calling this.
+ * @param visit Called for each client with the shard locked.  With
+ * exclusive set it may remove and free the client it is given.
+ * @param arg Passed through to visit
+ * @param exclusive Non-zero to lock the shards for writing
+ * @return Number of clients visited
+ */
+int
+client_list_foreach(t_client_visitor visit, void *arg, int exclusive)
+{
+    t_client_shard *shard;
+    t_client *client, *next;
+    int visited = 0;
+
+    for (shard = client_shards; shard < client_shards + CLIENT_SHARDS; shard++) {
+        if (exclusive)
+            LOCK_CLIENT_SHARD(shard);
+        else
+            RDLOCK_CLIENT_SHARD(shard);
+        for (client = shard->first; client != NULL; client = next) {
+            next = client->next;
+            visit(client, arg);
+            visited++;
+        }
+        UNLOCK_CLIENT_SHARD(shard);
+    }
+    return visited;
+}
+
+/** Insert client at head of its shard's list.  The shard lock, or the
+ * whole table lock, must be held for writing when calling this!
  * @param Pointer to t_client object.
  */
 void
 client_list_insert_client(t_client * client)
 {
-    t_client *prev_head;
+    t_client_shard *shard = client_shard_of(client);
 
     pthread_mutex_lock(&client_id_mutex);
     client->id = client_id++;
     pthread_mutex_unlock(&client_id_mutex);
-    prev_head = firstclient;
-    client->next = prev_head;
-    firstclient = client;
+    client->next = shard->first;
+    client->prev = NULL;
+    if (shard->first)
+        shard->first->prev = client;
+    shard->first = client;
+    shard->count++;
+    client_index_add(shard, client);
+    client_expiry_link(shard, client);
+    session_store_add(client);
 }
 
 /** Based on the parameters it receives, this function creates a new entry
  * in the connections list. All the memory allocation is done here.
- * Client is inserted at the head of the list.
+ * Client is inserted at the head of its shard's list, the lock of
+ * client_shard_by_ip(ip) must be held for writing.
  * @param ip IP address
  * @param mac MAC address
  * @param token Token
- * @return Pointer to the client we just created
+ * @return Pointer to the client we just created, NULL if ip or mac does
+ * not parse
  */
 t_client *
 client_list_add(const char *ip, const char *mac, const char *token, const int auth_type)
 {
     t_client *curclient;
+    uint32_t addr;
+    unsigned char hwaddr[6];
+
+    if (!client_parse_ip(ip, &addr)) {
+        debug(LOG_WARNING, "Client IP address %s is not an IPv4 address", ip);
+        return NULL;
+    }
+    if (!client_parse_mac(mac, hwaddr)) {
+        debug(LOG_WARNING, "Client MAC address %s is not a MAC address", mac);
+        return NULL;
+    }
 
     curclient = client_get_new();
-    curclient->ip = safe_strdup(ip);
-    curclient->mac = safe_strdup(mac);
-    curclient->token = safe_strdup(token);
-    curclient->counters.incoming = curclient->counters.incoming_history = curclient->counters.outgoing =
-    curclient->counters.outgoing_history = 0;
+    curclient->ip = addr;
+    memcpy(curclient->mac, hwaddr, sizeof(curclient->mac));
+    client_set_token(curclient, token);
     curclient->counters.last_updated = time(NULL);
     curclient->auth_type = auth_type;
     client_list_insert_client(curclient);
@@ -144,40 +530,31 @@ client_list_add(const char *ip, const char *mac, const char *token, const int au
     return curclient;
 }
 
-/** Duplicate the whole client list to process in a thread safe way
- * MUTEX MUST BE HELD.
+/** @internal
+ * Visitor of client_list_dup(), appends a copy to the list being built
+ */
+static void
+client_list_dup_one(t_client * client, void *arg)
+{
+    t_client ***tail = arg;
+
+    **tail = client_dup(client);
+    *tail = &(**tail)->next;
+}
+
+/** Duplicate the whole client list to process in a thread safe way.
+ * The shards are copied one at a time with client_list_foreach(), so
+ * NO LOCK MAY BE HELD.
  * @param dest pointer TO A POINTER to a t_client (i.e.: t_client **ptr)
  * @return int Number of clients copied
  */
 int
 client_list_dup(t_client ** dest)
 {
-    t_client *new, *cur, *top, *prev;
-    int copied = 0;
-
-    cur = firstclient;
-    new = top = prev = NULL;
-
-    if (NULL == cur) {
-        *dest = new;            /* NULL */
-        return copied;
-    }
-
-    while (NULL != cur) {
-        new = client_dup(cur);
-        if (NULL == top) {
-            /* first item */
-            top = new;
-        } else {
-            prev->next = new;
-        }
-        prev = new;
-        copied++;
-        cur = cur->next;
-    }
+    t_client **tail = dest;
 
-    *dest = top;
-    return copied;
+    *dest = NULL;
+    return client_list_foreach(client_list_dup_one, &tail, 0);
 }
 
 /** Create a duplicate of a client.
@@ -194,43 +571,40 @@ client_dup(const t_client * src)
     }
     
     new = client_get_new();
-
-    new->id = src->id;
-    new->ip = safe_strdup(src->ip);
-    new->mac = safe_strdup(src->mac);
-    new->token = safe_strdup(src->token);
-    new->counters.incoming = src->counters.incoming;
-    new->counters.incoming_history = src->counters.incoming_history;
-    new->counters.outgoing = src->counters.outgoing;
-    new->counters.outgoing_history = src->counters.outgoing_history;
-    new->counters.last_updated = src->counters.last_updated;
-    new->auth_type = src->auth_type;
-    new->next = NULL;
+    memcpy(new, src, sizeof(t_client));
+    new->token = new->token_buf;
+    if (src->token != src->token_buf)
+        new->token = safe_strdup(src->token);
+    new->next = new->prev = NULL;
+    new->expiry_prev = new->expiry_next = NULL;
+    new->store_slot = -1;
+    memset(new->hash_next, 0, sizeof(new->hash_next));
 
     return new;
 }
 
 /** Find a client in the list from a client struct, matching operates by id.
- * This is useful from a copy of client to find the original.
+ * This is useful from a copy of client to find the original.  Only the
+ * client's shard is searched, its lock must be held.
  * @param client Client to find
  * @return pointer to the client in the list.
  */
 t_client *
 client_list_find_by_client(t_client * client)
 {
-    t_client *c = firstclient;
+    t_client *c;
 
-    while (NULL != c) {
+    for (c = client_index_first(client_shard_of(client), CLIENT_INDEX_ID, client_hash(client, CLIENT_INDEX_ID));
+         c != NULL; c = c->hash_next[CLIENT_INDEX_ID]) {
         if (c->id == client->id) {
             return c;
         }
-        c = c->next;
     }
     return NULL;
 }
 
 /** Finds a  client by its IP and MAC, returns NULL if the client could not
- * be found
+ * be found.  The lock of client_shard_by_ip(ip) must be held.
  * @param ip IP we are looking for in the linked list
  * @param mac MAC we are looking for in the linked list
  * @return Pointer to the client, or NULL if not found
@@ -239,12 +613,16 @@ t_client *
 client_list_find(const char *ip, const char *mac)
 {
     t_client *ptr;
+    uint32_t addr;
+    unsigned char hwaddr[6];
 
-    ptr = firstclient;
-    while (NULL != ptr) {
-        if (0 == strcmp(ptr->ip, ip) && 0 == strcmp(ptr->mac, mac))
+    if (!client_parse_ip(ip, &addr) || !client_parse_mac(mac, hwaddr))
+        return NULL;
+    for (ptr = client_index_first(client_shard_by_addr(addr), CLIENT_INDEX_IP,
+                                  client_hash_bytes((unsigned char *)&addr, sizeof(addr)));
+         ptr != NULL; ptr = ptr->hash_next[CLIENT_INDEX_IP]) {
+        if (ptr->ip == addr && 0 == memcmp(ptr->mac, hwaddr, sizeof(hwaddr)))
             return ptr;
-        ptr = ptr->next;
     }
 
     return NULL;
@@ -252,7 +630,7 @@ client_list_find(const char *ip, const char *mac)
 
 /**
  * Finds a  client by its IP, returns NULL if the client could not
- * be found
+ * be found.  The lock of client_shard_by_ip(ip) must be held.
  * @param ip IP we are looking for in the linked list
  * @return Pointer to the client, or NULL if not found
  */
@@ -260,12 +638,15 @@ t_client *
 client_list_find_by_ip(const char *ip)
 {
     t_client *ptr;
+    uint32_t addr;
 
-    ptr = firstclient;
-    while (NULL != ptr) {
-        if (0 == strcmp(ptr->ip, ip))
+    if (!client_parse_ip(ip, &addr))
+        return NULL;
+    for (ptr = client_index_first(client_shard_by_addr(addr), CLIENT_INDEX_IP,
+                                  client_hash_bytes((unsigned char *)&addr, sizeof(addr)));
+         ptr != NULL; ptr = ptr->hash_next[CLIENT_INDEX_IP]) {
+        if (ptr->ip == addr)
             return ptr;
-        ptr = ptr->next;
     }
 
     return NULL;
@@ -273,7 +654,7 @@ client_list_find_by_ip(const char *ip)
 
 /**
  * Finds a  client by its Mac, returns NULL if the client could not
- * be found
+ * be found.  Every shard is searched, the whole table lock must be held.
  * @param mac Mac we are looking for in the linked list
  * @return Pointer to the client, or NULL if not found
  */
@@ -281,18 +662,26 @@ t_client *
 client_list_find_by_mac(const char *mac)
 {
     t_client *ptr;
+    unsigned char hwaddr[6];
+    unsigned int hash;
+    int i;
 
-    ptr = firstclient;
-    while (NULL != ptr) {
-        if (0 == strcmp(ptr->mac, mac))
-            return ptr;
-        ptr = ptr->next;
+    if (!client_parse_mac(mac, hwaddr))
+        return NULL;
+    hash = client_hash_bytes(hwaddr, sizeof(hwaddr));
+    for (i = 0; i < CLIENT_SHARDS; i++) {
+        for (ptr = client_index_first(&client_shards[i], CLIENT_INDEX_MAC, hash); ptr != NULL;
+             ptr = ptr->hash_next[CLIENT_INDEX_MAC]) {
+            if (0 == memcmp(ptr->mac, hwaddr, sizeof(hwaddr)))
+                return ptr;
+        }
     }
 
     return NULL;
 }
 
-/** Finds a client by its token
+/** Finds a client by its token.  Every shard is searched, the whole
+ * table lock must be held.
  * @param token Token we are looking for in the linked list
  * @return Pointer to the client, or NULL if not found
  */
@@ -300,12 +689,15 @@ t_client *
 client_list_find_by_token(const char *token)
 {
     t_client *ptr;
-
-    ptr = firstclient;
-    while (NULL != ptr) {
-        if (0 == strcmp(ptr->token, token))
-            return ptr;
-        ptr = ptr->next;
+    unsigned int hash = client_hash_string(token);
+    int i;
+
+    for (i = 0; i < CLIENT_SHARDS; i++) {
+        for (ptr = client_index_first(&client_shards[i], CLIENT_INDEX_TOKEN, hash); ptr != NULL;
+             ptr = ptr->hash_next[CLIENT_INDEX_TOKEN]) {
+            if (0 == strcmp(ptr->token, token))
+                return ptr;
+        }
     }
 
     return NULL;
@@ -336,14 +728,7 @@ client_list_destroy(t_client * list)
 void
 client_free_node(t_client * client)
 {
-
-    if (client->mac != NULL)
-        free(client->mac);
-
-    if (client->ip != NULL)
-        free(client->ip);
-
-    if (client->token != NULL)
+    if (client->token != client->token_buf)
         free(client->token);
 
     free(client);
@@ -371,24 +756,91 @@ client_list_delete(t_client * client)
 void
 client_list_remove(t_client * client)
 {
-    t_client *ptr;
+    t_client_shard *shard = client_shard_of(client);
 
-    ptr = firstclient;
+    if (client_list_find_by_client(client) != client) {
+        debug(LOG_ERR, "Node to delete could not be found.");
+        return;
+    }
+    client_index_remove(shard, client);
+    client_expiry_unlink(shard, client);
+    if (client->prev)
+        client->prev->next = client->next;
+    else
+        shard->first = client->next;
+    if (client->next)
+        client->next->prev = client->prev;
+    client->prev = NULL;
+    shard->count--;
+    session_store_remove(client);
+}
 
-    if (ptr == NULL) {
-        debug(LOG_ERR, "Node list empty!");
-    } else if (ptr == client) {
-        firstclient = ptr->next;
-    } else {
-        /* Loop forward until we reach our point in the list. */
-        while (ptr->next != NULL && ptr->next != client) {
-            ptr = ptr->next;
-        }
-        /* If we reach the end before finding out element, complain. */
-        if (ptr->next == NULL) {
-            debug(LOG_ERR, "Node to delete could not be found.");
-        } else {
-            ptr->next = client->next;
+/**
+ * @brief Changes the token of a client on the list
+ *
+ * The token is indexed, so it must not be assigned directly.
+ * @param client Points to the client
+ * @param token The new token, copied
+ */
+void
+client_list_set_token(t_client * client, const char *token)
+{
+    t_client_shard *shard = client_shard_of(client);
+    unsigned int old_hash = client_hash(client, CLIENT_INDEX_TOKEN);
+
+    client_set_token(client, token);
+    client_index_relink(shard, client, CLIENT_INDEX_TOKEN, old_hash);
+    session_store_update(client);
+}
+
+/**
+ * @brief Records activity of a client on the list
+ *
+ * counters.last_updated is kept in order, so it must not be assigned
+ * directly once the client is on the list.  The lock of the client's
+ * shard must be held for writing.
+ * @param client Points to the client
+ * @param when Time of the activity
+ */
+void
+client_list_touch(t_client * client, time_t when)
+{
+    t_client_shard *shard = client_shard_of(client);
+
+    client->counters.last_updated = when;
+    client_expiry_unlink(shard, client);
+    client_expiry_link(shard, client);
+    session_store_update(client);
+}
+
+/**
+ * @brief Visits the clients idle since a given time
+ *
+ * Only the clients due to expire are touched, the walk of each shard
+ * stops at the first client active after before.  Shards are locked for
+ * writing one at a time, like client_list_foreach().
+ * @param before Clients whose counters.last_updated is not after this
+ * are visited
+ * @param visit Called for each idle client with its shard locked, may
+ * remove and free the client
+ * @param arg Passed through to visit
+ * @return Number of clients visited
+ */
+int
+client_list_expire(time_t before, t_client_visitor visit, void *arg)
+{
+    t_client_shard *shard;
+    t_client *client, *next;
+    int visited = 0;
+
+    for (shard = client_shards; shard < client_shards + CLIENT_SHARDS; shard++) {
+        LOCK_CLIENT_SHARD(shard);
+        for (client = shard->expiry_first; client != NULL && client->counters.last_updated <= before; client = next) {
+            next = client->expiry_next;
+            visit(client, arg);
+            visited++;
         }
+        UNLOCK_CLIENT_SHARD(shard);
     }
+    return visited;
 }
@@ -28,8 +28,7 @@
 #ifndef _CLIENT_LIST_H_
 #define _CLIENT_LIST_H_
 
-/** Global mutex to protect access to the client list */
-extern pthread_mutex_t client_list_mutex;
+#include <stdint.h>
 
 enum e_auth_type{normal_auth_type = 0, wx_temp_auth_type = 1, wx_auth_type = 2};
 
@@ -43,14 +42,39 @@ typedef struct _t_counters {
     time_t last_updated;        /**< @brief Last update of the counters */
 } t_counters;
 
+/** Buffer sizes for client_ip_text() and client_mac_text() */
+#define CLIENT_IP_TEXT_LEN 16
+#define CLIENT_MAC_TEXT_LEN 18
+
+/** Tokens shorter than this are stored inside the client record */
+#define CLIENT_TOKEN_INLINE_LEN 48
+
+/** Hash indexes kept over the client list, see client_list.c */
+enum {
+    CLIENT_INDEX_IP,
+    CLIENT_INDEX_MAC,
+    CLIENT_INDEX_TOKEN,
+    CLIENT_INDEX_ID,
+    CLIENT_INDEX_COUNT
+};
+
 /** Client node for the connected client linked list.
  */
 typedef struct _t_client {
     struct _t_client *next;             /**< @brief Pointer to the next client */
+    struct _t_client *prev;             /**< @brief Pointer to the previous client,
+					     valid only for clients on the list */
+    struct _t_client *hash_next[CLIENT_INDEX_COUNT]; /**< @brief Hash chains of the
+					     indexes, valid only for clients on the list */
+    struct _t_client *expiry_prev;      /**< @brief Expiry order of the shard, */
+    struct _t_client *expiry_next;      /**< @brief valid only for clients on the list */
     unsigned long long id;           /**< @brief Unique ID per client */
-    char *ip;                           /**< @brief Client Ip address */
-    char *mac;                          /**< @brief Client Mac address */
-    char *token;                        /**< @brief Client token */
+    uint32_t ip;                        /**< @brief Client IPv4 address, network
+					     byte order, see client_ip_text() */
+    unsigned char mac[6];               /**< @brief Client MAC address, see
+					     client_mac_text() */
+    char *token;                        /**< @brief Client token, points to
+					     token_buf unless it is too long */
     int fw_connection_state;     /**< @brief Connection state in the
 						     firewall */
     int auth_type;
@@ -59,19 +83,75 @@ typedef struct _t_client {
 					     _http_* function is called */
     t_counters counters;                /**< @brief Counters for input/output of
 					     the client. */
+    int store_slot;                     /**< @brief Record in the session store,
+					     or -1 */
+    char token_buf[CLIENT_TOKEN_INLINE_LEN];
 } t_client;
 
+/** The client table is split into CLIENT_SHARDS shards by a hash of
+ * the client IP address.  Each shard is a list with its own indexes and
+ * its own lock.  Lookups by IP, or by a client copy, only need the lock
+ * of one shard, see client_shard_by_ip() and client_shard_of().  Lookups
+ * by MAC or token, and walks over the whole table, need every shard
+ * locked with LOCK_CLIENT_LIST() or RDLOCK_CLIENT_LIST(), or go through
+ * client_list_foreach().  Read-only work takes the locks shared. */
+#define CLIENT_SHARD_BITS 4
+#define CLIENT_SHARDS (1 << CLIENT_SHARD_BITS)
+
+typedef struct _t_client_shard {
+    pthread_rwlock_t lock;              /**< @brief Protects everything below
+					     and the clients on the shard */
+    t_client *first;                    /**< @brief Head of the shard's list */
+    t_client **index[CLIENT_INDEX_COUNT]; /**< @brief Hash indexes */
+    unsigned int mask;                  /**< @brief Buckets per index - 1 */
+    unsigned int count;                 /**< @brief Clients on the shard */
+    t_client *expiry_first;             /**< @brief Least recently active client */
+    t_client *expiry_last;              /**< @brief Most recently active client */
+} t_client_shard;
+
+extern t_client_shard client_shards[CLIENT_SHARDS];
+
+/** Callback of client_list_foreach() */
+typedef void (*t_client_visitor) (t_client *, void *);
+
 void showDebugInfo(const char* tag, const t_client * src);
 
 /** @brief Get a new client struct, not added to the list yet */
 t_client *client_get_new(void);
 
-/** @brief Get the first element of the list of connected clients */
-t_client *client_get_first_client(void);
+/** @brief Text form of a client's IP address */
+const char *client_ip_text(const t_client *, char *);
+
+/** @brief Text form of a client's MAC address */
+const char *client_mac_text(const t_client *, char *);
+
+/** @brief Parses a dotted quad IPv4 address */
+int client_parse_ip(const char *, uint32_t *);
+
+/** @brief Parses a colon separated MAC address */
+int client_parse_mac(const char *, unsigned char *);
+
+/** @brief Sets the token of a client that is not on the list */
+void client_set_token(t_client *, const char *);
 
 /** @brief Initializes the client list */
 void client_list_init(void);
 
+/** @brief Shard that holds the client with this IP address */
+t_client_shard *client_shard_by_ip(const char *);
+
+/** @brief Shard that holds a client */
+t_client_shard *client_shard_of(const t_client *);
+
+/** @brief Locks every shard, see LOCK_CLIENT_LIST() */
+void client_list_lock_all(int);
+
+/** @brief Unlocks every shard */
+void client_list_unlock_all(void);
+
+/** @brief Visits every client, one shard at a time */
+int client_list_foreach(t_client_visitor, void *, int);
+
 /** @brief Insert client at head of list */
 void client_list_insert_client(t_client *);
 
@@ -103,6 +183,15 @@ t_client *client_list_find_by_mac(const char *);        /* needed by wdctl_threa
 /** @brief Finds a client by its token */
 t_client *client_list_find_by_token(const char *);
 
+/** @brief Changes the token of a client on the list */
+void client_list_set_token(t_client *, const char *);
+
+/** @brief Records activity of a client on the list */
+void client_list_touch(t_client *, time_t);
+
+/** @brief Visits the clients idle since a given time */
+int client_list_expire(time_t, t_client_visitor, void *);
+
 /** @brief Deletes a client from the connections list and frees its memory*/
 void client_list_delete(t_client *);
 
@@ -114,14 +203,35 @@ void client_free_node(t_client *);
 
 #define LOCK_CLIENT_LIST() do { \
 	debug(LOG_DEBUG, "Locking client list"); \
-	pthread_mutex_lock(&client_list_mutex); \
+	client_list_lock_all(1); \
 	debug(LOG_DEBUG, "Client list locked"); \
 } while (0)
 
+#define RDLOCK_CLIENT_LIST() do { \
+	debug(LOG_DEBUG, "Locking client list for reading"); \
+	client_list_lock_all(0); \
+	debug(LOG_DEBUG, "Client list locked for reading"); \
+} while (0)
+
 #define UNLOCK_CLIENT_LIST() do { \
 	debug(LOG_DEBUG, "Unlocking client list"); \
-	pthread_mutex_unlock(&client_list_mutex); \
+	client_list_unlock_all(); \
 	debug(LOG_DEBUG, "Client list unlocked"); \
 } while (0)
 
+#define LOCK_CLIENT_SHARD(shard) do { \
+	debug(LOG_DEBUG, "Locking client shard %d", (int)((shard) - client_shards)); \
+	pthread_rwlock_wrlock(&(shard)->lock); \
+} while (0)
+
+#define RDLOCK_CLIENT_SHARD(shard) do { \
+	debug(LOG_DEBUG, "Locking client shard %d for reading", (int)((shard) - client_shards)); \
+	pthread_rwlock_rdlock(&(shard)->lock); \
+} while (0)
+
+#define UNLOCK_CLIENT_SHARD(shard) do { \
+	debug(LOG_DEBUG, "Unlocking client shard %d", (int)((shard) - client_shards)); \
+	pthread_rwlock_unlock(&(shard)->lock); \
+} while (0)
+
 #endif                          /* _CLIENT_LIST_H_ */
@@ -36,6 +36,7 @@
 
 #include <string.h>
 #include <ctype.h>
+#include <sys/socket.h>
 
 #include "common.h"
 #include "safe.h"
@@ -85,16 +86,28 @@ typedef enum {
     oAuthServPingScriptPathFragment,
     oAuthServAuthScriptPathFragment,
     oHTTPDMaxConn,
+    oHTTPDThreads,
+    oHTTPDQueueSize,
+    oHTTPDOverloadPolicy,
+    oHTTPDEventLoop,
+    oHTTPDAcceptors,
+    oHTTPDKeepAlive,
+    oHTTPDKeepAliveMax,
     oHTTPDName,
     oHTTPDRealm,
     oHTTPDUsername,
     oHTTPDPassword,
     oClientTimeout,
     oCheckInterval,
+    oSessionStore,
     oWdctlSocket,
     oSyslogFacility,
     oFirewallRule,
     oFirewallRuleSet,
+    oFirewallIpset,
+    oFirewallDriver,
+    oConntrackCounters,
+    oFirewallHelper,
     oTrustedMACList,
     oHtmlMessageFile,
     oProxyPort,
@@ -119,12 +132,20 @@ static const struct {
     "gatewayport", oGatewayPort}, {
     "authserver", oAuthServer}, {
     "httpdmaxconn", oHTTPDMaxConn}, {
+    "httpdthreads", oHTTPDThreads}, {
+    "httpdqueuesize", oHTTPDQueueSize}, {
+    "httpdoverloadpolicy", oHTTPDOverloadPolicy}, {
+    "httpdeventloop", oHTTPDEventLoop}, {
+    "httpdacceptors", oHTTPDAcceptors}, {
+    "httpdkeepalive", oHTTPDKeepAlive}, {
+    "httpdkeepalivemax", oHTTPDKeepAliveMax}, {
     "httpdname", oHTTPDName}, {
     "httpdrealm", oHTTPDRealm}, {
     "httpdusername", oHTTPDUsername}, {
     "httpdpassword", oHTTPDPassword}, {
     "clienttimeout", oClientTimeout}, {
     "checkinterval", oCheckInterval}, {
+    "sessionstore", oSessionStore}, {
     "syslogfacility", oSyslogFacility}, {
     "wdctlsocket", oWdctlSocket}, {
     "hostname", oAuthServHostname}, {
@@ -139,6 +160,10 @@ static const struct {
     "authscriptpathfragment", oAuthServAuthScriptPathFragment}, {
     "firewallruleset", oFirewallRuleSet}, {
     "firewallrule", oFirewallRule}, {
+    "firewallipset", oFirewallIpset}, {
+    "firewalldriver", oFirewallDriver}, {
+    "conntrackcounters", oConntrackCounters}, {
+    "firewallhelper", oFirewallHelper}, {
     "trustedmaclist", oTrustedMACList}, {
     "htmlmessagefile", oHtmlMessageFile}, {
     "proxyport", oProxyPort}, {
@@ -172,6 +197,13 @@ config_init(void)
     config.configfile = safe_strdup(DEFAULT_CONFIGFILE);
     config.htmlmsgfile = safe_strdup(DEFAULT_HTMLMSGFILE);
     config.httpdmaxconn = DEFAULT_HTTPDMAXCONN;
+    config.httpdthreads = DEFAULT_HTTPDTHREADS;
+    config.httpdqueuesize = DEFAULT_HTTPDQUEUESIZE;
+    config.httpdoverloadpolicy = DEFAULT_HTTPDOVERLOADPOLICY;
+    config.httpdeventloop = DEFAULT_HTTPDEVENTLOOP;
+    config.httpdacceptors = DEFAULT_HTTPDACCEPTORS;
+    config.httpdkeepalive = DEFAULT_HTTPDKEEPALIVE;
+    config.httpdkeepalivemax = DEFAULT_HTTPDKEEPALIVEMAX;
     config.external_interface = NULL;
     config.gw_id = DEFAULT_GATEWAYID;
     config.gw_mac = NULL;
@@ -190,11 +222,16 @@ config_init(void)
     config.internal_sock = safe_strdup(DEFAULT_INTERNAL_SOCK);
     config.rulesets = NULL;
     config.trustedmaclist = NULL;
+    config.fw_ipset = DEFAULT_FIREWALLIPSET;
+    config.fw_driver = safe_strdup(DEFAULT_FIREWALLDRIVER);
+    config.conntrack_counters = DEFAULT_CONNTRACKCOUNTERS;
+    config.fw_helper = DEFAULT_FIREWALLHELPER;
     config.proxy_port = 0;
     config.ssl_certs = safe_strdup(DEFAULT_AUTHSERVSSLCERTPATH);
     config.ssl_verify = DEFAULT_AUTHSERVSSLPEERVER;
     config.ssl_cipher_list = NULL;
     config.arp_table_path = safe_strdup(DEFAULT_ARPTABLE);
+    config.session_store = NULL;
 
     debugconf.log_stderr = 1;
     debugconf.debuglevel = DEFAULT_DEBUGLEVEL;
@@ -716,6 +753,45 @@ config_read(const char *filename)
                 case oFirewallRuleSet:
                     parse_firewall_ruleset(p1, fd, filename, &linenum);
                     break;
+                case oFirewallIpset:
+                    config.fw_ipset = parse_boolean_value(p1);
+                    if (config.fw_ipset < 0) {
+                        debug(LOG_WARNING, "Bad syntax for Parameter: FirewallIpset on line %d " "in %s."
+                            "The syntax is yes or no." , linenum, filename);
+                        exit(-1);
+                    }
+                    break;
+                case oFirewallDriver:
+                    if (fw_driver_find(p1) == NULL) {
+                        debug(LOG_ERR, "Unknown FirewallDriver '%s' on line %d in %s", p1, linenum, filename);
+                        debug(LOG_ERR, "Exiting...");
+                        exit(-1);
+                    }
+                    free(config.fw_driver);
+                    config.fw_driver = safe_strdup(p1);
+                    break;
+                case oConntrackCounters:
+                    config.conntrack_counters = parse_boolean_value(p1);
+                    if (config.conntrack_counters < 0) {
+                        debug(LOG_WARNING, "Bad syntax for Parameter: ConntrackCounters on line %d " "in %s."
+                            "The syntax is yes or no." , linenum, filename);
+                        exit(-1);
+                    }
+#ifndef HAVE_LINUX_NETFILTER_NFNETLINK_CONNTRACK_H
+                    if (config.conntrack_counters) {
+                        debug(LOG_WARNING, "ConntrackCounters is set but ctnetlink is not available. Ignoring!");
+                        config.conntrack_counters = 0;
+                    }
+#endif
+                    break;
+                case oFirewallHelper:
+                    config.fw_helper = parse_boolean_value(p1);
+                    if (config.fw_helper < 0) {
+                        debug(LOG_WARNING, "Bad syntax for Parameter: FirewallHelper on line %d " "in %s."
+                            "The syntax is yes or no." , linenum, filename);
+                        exit(-1);
+                    }
+                    break;
                 case oTrustedMACList:
                     parse_trusted_mac_list(p1);
                     break;
@@ -725,6 +801,54 @@ config_read(const char *filename)
                 case oHTTPDMaxConn:
                     sscanf(p1, "%d", &config.httpdmaxconn);
                     break;
+                case oHTTPDThreads:
+                    sscanf(p1, "%d", &config.httpdthreads);
+                    break;
+                case oHTTPDQueueSize:
+                    sscanf(p1, "%d", &config.httpdqueuesize);
+                    break;
+                case oHTTPDOverloadPolicy:
+                    if (strcasecmp(p1, "reject") == 0) {
+                        config.httpdoverloadpolicy = HTTPD_OVERLOAD_REJECT;
+                    } else if (strcasecmp(p1, "dropoldest") == 0) {
+                        config.httpdoverloadpolicy = HTTPD_OVERLOAD_DROP_OLDEST;
+                    } else {
+                        debug(LOG_ERR, "Bad HTTPDOverloadPolicy '%s' on line %d in %s", p1, linenum, filename);
+                        debug(LOG_ERR, "Exiting...");
+                        exit(-1);
+                    }
+                    break;
+                case oHTTPDEventLoop:
+                    config.httpdeventloop = parse_boolean_value(p1);
+                    if (config.httpdeventloop < 0) {
+                        debug(LOG_WARNING, "Bad syntax for Parameter: HTTPDEventLoop on line %d " "in %s."
+                            "The syntax is yes or no." , linenum, filename);
+                        exit(-1);
+                    }
+#ifndef HAVE_SYS_EPOLL_H
+                    debug(LOG_WARNING, "HTTPDEventLoop is set but epoll is not available. Ignoring!");
+#endif
+                    break;
+                case oHTTPDAcceptors:
+                    sscanf(p1, "%d", &config.httpdacceptors);
+                    if (config.httpdacceptors < 1) {
+                        debug(LOG_WARNING, "HTTPDAcceptors must be at least 1 on line %d in %s. Using 1.",
+                              linenum, filename);
+                        config.httpdacceptors = 1;
+                    }
+#ifndef SO_REUSEPORT
+                    if (config.httpdacceptors > 1) {
+                        debug(LOG_WARNING, "HTTPDAcceptors is set but SO_REUSEPORT is not available. Ignoring!");
+                        config.httpdacceptors = 1;
+                    }
+#endif
+                    break;
+                case oHTTPDKeepAlive:
+                    sscanf(p1, "%d", &config.httpdkeepalive);
+                    break;
+                case oHTTPDKeepAliveMax:
+                    sscanf(p1, "%d", &config.httpdkeepalivemax);
+                    break;
                 case oHTTPDRealm:
                     config.httpdrealm = safe_strdup(p1);
                     break;
@@ -744,6 +868,10 @@ config_read(const char *filename)
                 case oClientTimeout:
                     sscanf(p1, "%d", &config.clienttimeout);
                     break;
+                case oSessionStore:
+                    free(config.session_store);
+                    config.session_store = safe_strdup(p1);
+                    break;
                 case oSyslogFacility:
                     sscanf(p1, "%d", &debugconf.syslog_facility);
                     break;
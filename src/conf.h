@@ -42,11 +42,22 @@
 #define DEFAULT_DAEMON 1
 #define DEFAULT_DEBUGLEVEL LOG_INFO
 #define DEFAULT_HTTPDMAXCONN 10
+#define DEFAULT_HTTPDTHREADS 8
+#define DEFAULT_HTTPDQUEUESIZE 64
+#define DEFAULT_HTTPDOVERLOADPOLICY HTTPD_OVERLOAD_REJECT
+#define DEFAULT_HTTPDEVENTLOOP 1
+#define DEFAULT_HTTPDACCEPTORS 1
+#define DEFAULT_HTTPDKEEPALIVE 5
+#define DEFAULT_HTTPDKEEPALIVEMAX 20
 #define DEFAULT_GATEWAYID NULL
 #define DEFAULT_GATEWAYPORT 2060
 #define DEFAULT_HTTPDNAME "WiFiDog"
 #define DEFAULT_CLIENTTIMEOUT 5
 #define DEFAULT_CHECKINTERVAL 60
+#define DEFAULT_FIREWALLIPSET 0
+#define DEFAULT_FIREWALLDRIVER "iptables"
+#define DEFAULT_CONNTRACKCOUNTERS 0
+#define DEFAULT_FIREWALLHELPER 0
 #define DEFAULT_LOG_SYSLOG 0
 #define DEFAULT_SYSLOG_FACILITY LOG_DAEMON
 #define DEFAULT_WDCTL_SOCK "/tmp/wdctl.sock"
@@ -68,6 +79,12 @@
 #define DEFAULT_ARPTABLE "/proc/net/arp"
 /*@}*/
 
+/** What the web server does with a new connection when its accept queue is full */
+typedef enum {
+    HTTPD_OVERLOAD_REJECT,      /**< @brief Answer the new connection with a 503 */
+    HTTPD_OVERLOAD_DROP_OLDEST  /**< @brief Answer the oldest queued connection with a 503 */
+} t_httpd_overload;
+
 /*@{*/
 /** Defines for firewall rule sets. */
 #define FWRULESET_GLOBAL "global"
@@ -169,6 +186,19 @@ typedef struct {
 				     replying to a request */
     int httpdmaxconn;           /**< @brief Used by libhttpd, not sure what it
 				     does */
+    int httpdthreads;           /**< @brief Number of httpd worker threads */
+    int httpdqueuesize;         /**< @brief Accepted connections that may wait
+				     for a worker */
+    t_httpd_overload httpdoverloadpolicy; /**< @brief What to do when the
+				     accept queue is full */
+    int httpdeventloop;         /**< @brief boolean, whether connections are
+				     read and written by the epoll event loop */
+    int httpdacceptors;         /**< @brief Number of SO_REUSEPORT listen sockets,
+				     each served by its own thread */
+    int httpdkeepalive;         /**< @brief Seconds an idle persistent connection
+				     is kept open, 0 to close after every request */
+    int httpdkeepalivemax;      /**< @brief Requests served on one connection
+				     before it is closed, 0 for no limit */
     char *httpdrealm;           /**< @brief HTTP Authentication realm */
     char *httpdusername;        /**< @brief Username for HTTP authentication */
     char *httpdpassword;        /**< @brief Password for HTTP authentication */
@@ -176,6 +206,8 @@ typedef struct {
 				     must be re-authenticated */
     int checkinterval;          /**< @brief Frequency the the client timeout check
 				     thread will run. */
+    char *session_store;        /**< @brief File the client sessions are kept in
+				     across crashes and reboots, NULL for none */
     int proxy_port;             /**< @brief Transparent proxy port (0 to disable) */
     char *ssl_certs;            /**< @brief Path to SSL certs for auth server
 		verification */
@@ -183,6 +215,15 @@ typedef struct {
 		auth server certificate verification */
     char *ssl_cipher_list;  /**< @brief List of SSL ciphers allowed. Optional. */
     t_firewall_ruleset *rulesets;       /**< @brief firewall rules */
+    int fw_ipset;               /**< @brief boolean, whether authenticated clients
+				     are kept in ipsets rather than in rules */
+    char *fw_driver;            /**< @brief Name of the firewall driver, see
+				     fw_driver_find() */
+    int conntrack_counters;     /**< @brief boolean, whether client traffic is
+				     read from conntrack rather than from rules */
+    int fw_helper;              /**< @brief boolean, whether firewall commands
+				     are run by a helper process, see
+				     subprocess_helper_start() */
     t_trusted_mac *trustedmaclist; /**< @brief list of trusted macs */
     char *arp_table_path; /**< @brief Path to custom ARP table, formatted
         like /proc/net/arp */
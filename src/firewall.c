@@ -58,8 +58,338 @@
 #include "centralserver.h"
 #include "client_list.h"
 #include "commandline.h"
+#include "restart.h"
+#include "session_store.h"
+#include "fw_mock.h"
 
-static int _fw_deny_raw(const char *, const char *, const int);
+static int _fw_deny_raw(const char *, const char *, const int, t_fw_ticket *);
+static int fw_access(fw_access_t, const char *, const char *, int, t_fw_ticket *);
+
+/** @internal
+ * The firewall drivers FirewallDriver can name
+ */
+static const t_fw_driver *fw_drivers[] = { &iptables_fw_driver, &mock_fw_driver, NULL };
+
+/** Finds a firewall driver by name
+ * @param name Name of the driver, case insensitive
+ * @return The driver, NULL if there is none by that name
+ */
+const t_fw_driver *
+fw_driver_find(const char *name)
+{
+    int i;
+
+    for (i = 0; fw_drivers[i] != NULL; i++) {
+        if (strcasecmp(fw_drivers[i]->name, name) == 0)
+            return fw_drivers[i];
+    }
+    return NULL;
+}
+
+/** The firewall driver selected by FirewallDriver, iptables by default.
+ * The configuration is checked when read, so this always finds one.
+ */
+const t_fw_driver *
+fw_get_driver(void)
+{
+    static const t_fw_driver *driver = NULL;
+
+    if (driver == NULL) {
+        driver = fw_driver_find(config_get_config()->fw_driver);
+        if (driver == NULL)
+            driver = fw_drivers[0];
+    }
+    return driver;
+}
+
+/** @internal
+ * A client access change waiting for the firewall worker
+ */
+typedef struct _t_fw_pending {
+    struct _t_fw_pending *next;
+    t_fw_ticket ticket;
+    int waited;                 /**< @brief fw_wait() will ask for the result */
+    t_fw_access_op op;
+} t_fw_pending;
+
+/** @internal
+ * Protects the queue below.  Client access changes are queued by
+ * fw_access() and applied in order, in batches, by thread_fw_queue(),
+ * so that callers holding client locks do not wait for the firewall.
+ */
+static pthread_mutex_t fw_queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t fw_queue_cond = PTHREAD_COND_INITIALIZER;        /**< @brief Work queued */
+static pthread_cond_t fw_queue_done_cond = PTHREAD_COND_INITIALIZER;   /**< @brief Batch applied */
+static t_fw_pending *fw_queue_first = NULL;
+static t_fw_pending *fw_queue_last = NULL;
+static int fw_queue_running = 0;
+static int fw_queue_busy = 0;
+static pthread_t fw_queue_tid;
+static unsigned long fw_queue_seq = 0;  /**< @brief Changes queued so far */
+static unsigned long fw_queue_done = 0; /**< @brief Changes applied or cancelled so far */
+static t_fw_pending *fw_queue_failed = NULL;   /**< @brief Failed changes fw_wait() has yet to collect */
+
+/** @internal
+ * Set by fw_release(), the rules belong to another process from then on
+ */
+static int fw_released = 0;
+
+/** @internal
+ * Applies the queued access changes in batches until the queue is stopped
+ */
+static void
+thread_fw_queue(void *arg)
+{
+    t_fw_pending *batch, *p, **pending;
+    t_fw_access_op *ops;
+    const t_fw_driver *driver = fw_get_driver();
+    unsigned long seq;
+    int count, i, failed;
+
+    pthread_mutex_lock(&fw_queue_mutex);
+    while (fw_queue_running) {
+        if (fw_queue_first == NULL) {
+            pthread_cond_wait(&fw_queue_cond, &fw_queue_mutex);
+            continue;
+        }
+        batch = fw_queue_first;
+        fw_queue_first = fw_queue_last = NULL;
+        seq = fw_queue_seq;
+        fw_queue_busy = 1;
+        pthread_mutex_unlock(&fw_queue_mutex);
+
+        for (count = 0, p = batch; p != NULL; p = p->next)
+            count++;
+        ops = safe_malloc(count * sizeof(t_fw_access_op));
+        pending = safe_malloc(count * sizeof(t_fw_pending *));
+        for (i = 0; batch != NULL; i++) {
+            pending[i] = batch;
+            batch = batch->next;
+            ops[i] = pending[i]->op;
+        }
+
+        debug(LOG_DEBUG, "Applying %d queued firewall changes", count);
+        if (driver->access_many) {
+            driver->access_many(ops, count);
+        } else {
+            for (i = 0; i < count; i++)
+                ops[i].result = driver->access(ops[i].type, ops[i].ip, ops[i].mac, ops[i].tag);
+        }
+
+        pthread_mutex_lock(&fw_queue_mutex);
+        /* Failures are kept until their waiter collects them */
+        for (failed = 0, i = 0; i < count; i++) {
+            p = pending[i];
+            if (ops[i].result != 0)
+                failed++;
+            if (ops[i].result != 0 && p->waited) {
+                p->op.result = ops[i].result;
+                p->next = fw_queue_failed;
+                fw_queue_failed = p;
+            } else {
+                free(p);
+            }
+        }
+        fw_queue_busy = 0;
+        /* Whatever was cancelled meanwhile is done too if nothing is left */
+        fw_queue_done = fw_queue_first ? seq : fw_queue_seq;
+        pthread_cond_broadcast(&fw_queue_done_cond);
+
+        if (failed) {
+            pthread_mutex_unlock(&fw_queue_mutex);
+            for (i = 0; i < count; i++)
+                if (ops[i].result != 0)
+                    debug(LOG_ERR, "Could not %s %s %s with fw_connection_state %d in the firewall (%d)",
+                          ops[i].type == FW_ACCESS_ALLOW ? "allow" : "deny", ops[i].ip, ops[i].mac, ops[i].tag,
+                          ops[i].result);
+            pthread_mutex_lock(&fw_queue_mutex);
+        }
+        free(ops);
+        free(pending);
+    }
+    pthread_mutex_unlock(&fw_queue_mutex);
+}
+
+/** Starts the firewall worker.  Until then, and after fw_destroy(),
+ * client access changes are applied by the caller.
+ * @return 0 on success
+ */
+int
+fw_queue_start(void)
+{
+    int result;
+
+    pthread_mutex_lock(&fw_queue_mutex);
+    fw_queue_running = 1;
+    result = pthread_create(&fw_queue_tid, NULL, (void *)thread_fw_queue, NULL);
+    if (result != 0)
+        fw_queue_running = 0;
+    else
+        pthread_detach(fw_queue_tid);
+    pthread_mutex_unlock(&fw_queue_mutex);
+
+    return result;
+}
+
+/** @internal
+ * Stops the firewall worker, dropping what it has not started on, and
+ * waits a little for the batch it is applying.  Called on the way out,
+ * possibly from a signal handler, so it never blocks for long.
+ */
+static void
+fw_queue_stop(void)
+{
+    struct timespec deadline;
+    t_fw_pending *p;
+
+    if (pthread_mutex_trylock(&fw_queue_mutex) != 0)
+        return;
+    if (fw_queue_running) {
+        fw_queue_running = 0;
+        while ((p = fw_queue_first) != NULL) {
+            fw_queue_first = p->next;
+            free(p);
+        }
+        fw_queue_last = NULL;
+        pthread_cond_broadcast(&fw_queue_cond);
+        deadline.tv_sec = time(NULL) + 2;
+        deadline.tv_nsec = 0;
+        while (fw_queue_busy && !pthread_equal(pthread_self(), fw_queue_tid) &&
+               pthread_cond_timedwait(&fw_queue_done_cond, &fw_queue_mutex, &deadline) == 0) ;
+        fw_queue_done = fw_queue_seq;
+        pthread_cond_broadcast(&fw_queue_done_cond);
+    }
+    pthread_mutex_unlock(&fw_queue_mutex);
+}
+
+/** Waits until every client access change made before the call is in
+ * the firewall, for instance before handing the firewall over to a
+ * restarted wifidog.
+ */
+void
+fw_flush(void)
+{
+    unsigned long seq;
+
+    pthread_mutex_lock(&fw_queue_mutex);
+    seq = fw_queue_seq;
+    while (fw_queue_running && fw_queue_done < seq)
+        pthread_cond_wait(&fw_queue_done_cond, &fw_queue_mutex);
+    pthread_mutex_unlock(&fw_queue_mutex);
+}
+
+/** Waits until a client access change is in the firewall, or failed.
+ * A failure is kept until collected here, so each ticket handed out
+ * must be waited for once.
+ * @param ticket Set by fw_allow() or fw_deny(), 0 returns at once
+ * @return 0 once applied, or cancelled by an opposite change, -1 if it
+ * failed
+ */
+int
+fw_wait(t_fw_ticket ticket)
+{
+    t_fw_pending **link, *p;
+    int result = 0;
+
+    if (ticket == 0)
+        return 0;
+    pthread_mutex_lock(&fw_queue_mutex);
+    while (fw_queue_running && fw_queue_done < ticket)
+        pthread_cond_wait(&fw_queue_done_cond, &fw_queue_mutex);
+    for (link = &fw_queue_failed; (p = *link) != NULL; link = &p->next) {
+        if (p->ticket == ticket) {
+            *link = p->next;
+            free(p);
+            result = -1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&fw_queue_mutex);
+
+    return result;
+}
+
+/** Leaves the firewall rules to a restarted wifidog.  Every change
+ * queued so far is applied, later ones are ignored, and so are changes
+ * to the host, auth server and passthrough rules.
+ */
+void
+fw_release(void)
+{
+    fw_flush();
+    pthread_mutex_lock(&fw_queue_mutex);
+    fw_released = 1;
+    pthread_mutex_unlock(&fw_queue_mutex);
+    fw_queue_stop();
+    debug(LOG_INFO, "Firewall rules left to the new process");
+}
+
+/** @internal
+ * Grants or revokes the access of a client through the firewall worker.
+ * A pending change is cancelled by its opposite instead of being
+ * followed by it, so a client allowed then denied before the worker got
+ * to it costs nothing.
+ * @param ticket Set to what fw_wait() takes, 0 if there is nothing to
+ * wait for; NULL if not needed.  Otherwise fw_wait() must be called.
+ * @return 0 once queued, or the driver's result without the worker
+ */
+static int
+fw_access(fw_access_t type, const char *ip, const char *mac, int tag, t_fw_ticket * ticket)
+{
+    t_fw_pending **link, *p, *prev = NULL;
+
+    if (ticket)
+        *ticket = 0;
+    pthread_mutex_lock(&fw_queue_mutex);
+    if (fw_released) {
+        pthread_mutex_unlock(&fw_queue_mutex);
+        return 0;
+    }
+    if (!fw_queue_running) {
+        pthread_mutex_unlock(&fw_queue_mutex);
+        return fw_get_driver()->access(type, ip, mac, tag);
+    }
+
+    fw_queue_seq++;
+    if (ticket)
+        *ticket = fw_queue_seq;
+    for (link = &fw_queue_first; (p = *link) != NULL; prev = p, link = &p->next) {
+        if (p->op.type != type && p->op.tag == tag && strcmp(p->op.ip, ip) == 0 && strcmp(p->op.mac, mac) == 0) {
+            debug(LOG_DEBUG, "Firewall change for %s %s cancels out a queued one", ip, mac);
+            *link = p->next;
+            if (fw_queue_last == p)
+                fw_queue_last = prev;
+            free(p);
+            if (fw_queue_first == NULL && !fw_queue_busy) {
+                fw_queue_done = fw_queue_seq;
+                pthread_cond_broadcast(&fw_queue_done_cond);
+            }
+            pthread_mutex_unlock(&fw_queue_mutex);
+            return 0;
+        }
+    }
+
+    p = safe_malloc(sizeof(t_fw_pending));
+    p->next = NULL;
+    p->ticket = fw_queue_seq;
+    p->waited = ticket != NULL;
+    p->op.type = type;
+    strncpy(p->op.ip, ip, sizeof(p->op.ip) - 1);
+    p->op.ip[sizeof(p->op.ip) - 1] = '\0';
+    strncpy(p->op.mac, mac, sizeof(p->op.mac) - 1);
+    p->op.mac[sizeof(p->op.mac) - 1] = '\0';
+    p->op.tag = tag;
+    p->op.result = 0;
+    if (fw_queue_last)
+        fw_queue_last->next = p;
+    else
+        fw_queue_first = p;
+    fw_queue_last = p;
+    pthread_cond_signal(&fw_queue_cond);
+    pthread_mutex_unlock(&fw_queue_mutex);
+
+    return 0;
+}
 
 /**
  * Allow a client access through the firewall by adding a rule in the firewall to MARK the user's packets with the proper
@@ -67,25 +397,32 @@ static int _fw_deny_raw(const char *, const char *, const int);
  * @param ip IP address to allow
  * @param mac MAC address to allow
  * @param fw_connection_state fw_connection_state Tag
- * @return Return code of the command
+ * @param ticket Where to put what fw_wait() takes to wait for the
+ * grant, or NULL
+ * @return 0 once queued, see fw_wait(), or the return code of the command
  */
 int
-fw_allow(t_client * client, int new_fw_connection_state)
+fw_allow(t_client * client, int new_fw_connection_state, t_fw_ticket * ticket)
 {
     int result;
     int old_state = client->fw_connection_state;
+    char ip[CLIENT_IP_TEXT_LEN], mac[CLIENT_MAC_TEXT_LEN];
+
+    client_ip_text(client, ip);
+    client_mac_text(client, mac);
 
-    debug(LOG_DEBUG, "Allowing %s %s with fw_connection_state %d", client->ip, client->mac, new_fw_connection_state);
+    debug(LOG_DEBUG, "Allowing %s %s with fw_connection_state %d", ip, mac, new_fw_connection_state);
     client->fw_connection_state = new_fw_connection_state;
 
     /* Grant first */
-    result = iptables_fw_access(FW_ACCESS_ALLOW, client->ip, client->mac, new_fw_connection_state);
+    result = fw_access(FW_ACCESS_ALLOW, ip, mac, new_fw_connection_state, ticket);
 
     /* Deny after if needed. */
     if (old_state != FW_MARK_NONE) {
         debug(LOG_DEBUG, "Clearing previous fw_connection_state %d", old_state);
-        _fw_deny_raw(client->ip, client->mac, old_state);
+        _fw_deny_raw(ip, mac, old_state, NULL);
     }
+    session_store_update(client);
 
     return result;
 }
@@ -99,8 +436,10 @@ int
 fw_allow_host(const char *host)
 {
     debug(LOG_DEBUG, "Allowing %s", host);
+    if (fw_released)
+        return 0;
 
-    return iptables_fw_access_host(FW_ACCESS_ALLOW, host);
+    return fw_get_driver()->access_host(FW_ACCESS_ALLOW, host);
 }
 
 /**
@@ -108,16 +447,22 @@ fw_allow_host(const char *host)
  * @param ip IP address to deny
  * @param mac MAC address to deny
  * @param fw_connection_state fw_connection_state Tag
- * @return Return code of the command
+ * @param ticket Where to put what fw_wait() takes, or NULL
+ * @return 0 once queued, see fw_wait(), or the return code of the command
  */
 int
-fw_deny(t_client * client)
+fw_deny(t_client * client, t_fw_ticket * ticket)
 {
     int fw_connection_state = client->fw_connection_state;
-    debug(LOG_DEBUG, "Denying %s %s with fw_connection_state %d", client->ip, client->mac, client->fw_connection_state);
+    char ip[CLIENT_IP_TEXT_LEN], mac[CLIENT_MAC_TEXT_LEN];
+
+    client_ip_text(client, ip);
+    client_mac_text(client, mac);
+    debug(LOG_DEBUG, "Denying %s %s with fw_connection_state %d", ip, mac, client->fw_connection_state);
 
     client->fw_connection_state = FW_MARK_NONE; /* Clear */
-    return _fw_deny_raw(client->ip, client->mac, fw_connection_state);
+    session_store_update(client);
+    return _fw_deny_raw(ip, mac, fw_connection_state, ticket);
 }
 
 /** @internal
@@ -125,12 +470,13 @@ fw_deny(t_client * client)
  * @param ip IP address to deny
  * @param mac MAC address to deny
  * @param mark fw_connection_state Tag
+ * @param ticket See fw_access()
  * @return Return code of the command
  */
 static int
-_fw_deny_raw(const char *ip, const char *mac, const int mark)
+_fw_deny_raw(const char *ip, const char *mac, const int mark, t_fw_ticket * ticket)
 {
-    return iptables_fw_access(FW_ACCESS_DENY, ip, mac, mark);
+    return fw_access(FW_ACCESS_DENY, ip, mac, mark, ticket);
 }
 
 /** Passthrough for clients when auth server is down */
@@ -138,8 +484,10 @@ int
 fw_set_authdown(void)
 {
     debug(LOG_DEBUG, "Marking auth server down");
+    if (fw_released)
+        return 0;
 
-    return iptables_fw_auth_unreachable(FW_MARK_AUTH_IS_DOWN);
+    return fw_get_driver()->auth_unreachable(FW_MARK_AUTH_IS_DOWN);
 }
 
 /** Remove passthrough for clients when auth server is up */
@@ -147,8 +495,10 @@ int
 fw_set_authup(void)
 {
     debug(LOG_DEBUG, "Marking auth server up again");
+    if (fw_released)
+        return 0;
 
-    return iptables_fw_auth_reachable();
+    return fw_get_driver()->auth_reachable();
 }
 
 /* XXX DCY */
@@ -188,35 +538,58 @@ arp_get(const char *req_ip)
     return reply;
 }
 
-/** Initialize the firewall rules
+/** @internal
+ * Restores the rules of one client inherited from the parent or from
+ * the session store.  Its new rules count from zero.
+ */
+static void
+fw_restore_client(t_client * client, void *arg)
+{
+    int new_fw_state = client->fw_connection_state;
+
+    client->counters.incoming_history = client->counters.incoming;
+    client->counters.outgoing_history = client->counters.outgoing;
+
+    client->fw_connection_state = FW_MARK_NONE;
+    fw_allow(client, new_fw_state, NULL);
+}
+
+/** Initialize the firewall rules.  Rules left in place by a crashed
+ * wifidog are brought up to date with the clients on the list when the
+ * driver can reconcile them, else they are destroyed and set up again.
  */
 int
 fw_init(void)
 {
-    int result = 0;
-    int new_fw_state;
-    t_client *client = NULL;
+    int result = 0, restored;
 
     if (!init_icmp_socket()) {
         return 0;
     }
 
-    debug(LOG_INFO, "Initializing Firewall");
-    result = iptables_fw_init();
-
-    if (restart_orig_pid) {
-        debug(LOG_INFO, "Restoring firewall rules for clients inherited from parent");
-        LOCK_CLIENT_LIST();
-        client = client_get_first_client();
-        while (client) {
-            new_fw_state = client->fw_connection_state;
-            client->fw_connection_state = FW_MARK_NONE;
-            fw_allow(client, new_fw_state);
-            client = client->next;
-        }
-        UNLOCK_CLIENT_LIST();
+    if (restart_fw_kept) {
+        /* The rules of the parent, its clients' included, are still in place */
+        debug(LOG_INFO, "Keeping the firewall rules of the parent");
+        return 1;
+    }
+
+    if (fw_get_driver()->reconcile) {
+        debug(LOG_INFO, "Reconciling the firewall with the %s driver", fw_get_driver()->name);
+        if (fw_get_driver()->reconcile())
+            return 1;
+        debug(LOG_WARNING, "Could not reconcile the firewall, setting it up again");
     }
 
+    /* Reset the firewall (if WiFiDog crashed) */
+    fw_get_driver()->destroy();
+
+    debug(LOG_INFO, "Initializing Firewall with the %s driver", fw_get_driver()->name);
+    result = fw_get_driver()->init();
+
+    restored = client_list_foreach(fw_restore_client, NULL, 1);
+    if (restored)
+        debug(LOG_INFO, "Restored firewall rules for %d clients", restored);
+
     return result;
 }
 
@@ -226,7 +599,8 @@ void
 fw_clear_authservers(void)
 {
     debug(LOG_INFO, "Clearing the authservers list");
-    iptables_fw_clear_authservers();
+    if (!fw_released)
+        fw_get_driver()->clear_authservers();
 }
 
 /** Add the necessary firewall rules to whitelist the authservers
@@ -235,7 +609,8 @@ void
 fw_set_authservers(void)
 {
     debug(LOG_INFO, "Setting the authservers list");
-    iptables_fw_set_authservers();
+    if (!fw_released)
+        fw_get_driver()->set_authservers();
 }
 
 /** Remove the firewall rules
@@ -246,8 +621,26 @@ int
 fw_destroy(void)
 {
     close_icmp_socket();
+    fw_queue_stop();
     debug(LOG_INFO, "Removing Firewall rules");
-    return iptables_fw_destroy();
+    return fw_get_driver()->destroy();
+}
+
+/** @internal
+ * Takes a client found idle by client_list_expire() off the list
+ *
+ * The client is denied and moved to the list at arg, its logout is
+ * reported once the shard lock is released.
+ */
+static void
+fw_timeout_client(t_client * client, void *arg)
+{
+    t_client **expired = arg;
+
+    fw_deny(client, NULL);
+    client_list_remove(client);
+    client->next = *expired;
+    *expired = client;
 }
 
 /**Probably a misnomer, this function actually refreshes the entire client list's traffic counter, re-authenticates every client with the central server and update's the central servers traffic counters and notifies it if a client has logged-out.
@@ -257,15 +650,30 @@ void
 fw_sync_with_authserver(void)
 {
     t_authresponse authresponse;
-    t_client *p1, *p2, *worklist, *tmp;
+    t_client *p1, *p2, *worklist, *tmp, *expired;
+    t_client_shard *shard;
     s_config *config = config_get_config();
+    char ip[CLIENT_IP_TEXT_LEN], mac[CLIENT_MAC_TEXT_LEN];
+    long timeout;
 
-    if (-1 == iptables_fw_counters_update()) {
+    if (-1 == fw_get_driver()->counters_update()) {
         debug(LOG_ERR, "Could not get counters from firewall!");
         return;
     }
 
-    LOCK_CLIENT_LIST();
+    /* Time out idle clients first.  Only the clients due to expire are
+     * visited, active ones cost nothing here.  They are taken off the list
+     * under the shard locks, the auth server hears of them afterwards. */
+    timeout = config->checkinterval * config->clienttimeout;
+    expired = NULL;
+    client_list_expire(time(NULL) - timeout, fw_timeout_client, &expired);
+    for (p1 = expired; NULL != p1; p1 = p2) {
+        p2 = p1->next;
+        debug(LOG_INFO, "%s - Inactive for more than %ld seconds, removing client and denying in firewall",
+              client_ip_text(p1, ip), timeout);
+        logout_client_report(p1);
+        client_free_node(p1);
+    }
 
     /* XXX Ideally, from a thread safety PoV, this function should build a list of client pointers,
      * iterate over the list and have an explicit "client still valid" check while list is locked.
@@ -273,112 +681,96 @@ fw_sync_with_authserver(void)
      * a SIGSEGV.
      */
     client_list_dup(&worklist);
-    UNLOCK_CLIENT_LIST();
 
     for (p1 = p2 = worklist; NULL != p1; p1 = p2) {
         p2 = p1->next;
+        client_ip_text(p1, ip);
+        client_mac_text(p1, mac);
 
         /* Ping the client, if he responds it'll keep activity on the link.
          * However, if the firewall blocks it, it will not help.  The suggested
          * way to deal witht his is to keep the DHCP lease time extremely
          * short:  Shorter than config->checkinterval * config->clienttimeout */
-        icmp_ping(p1->ip);
+        icmp_ping(ip);
         /* Update the counters on the remote server only if we have an auth server */
         if (config->auth_servers != NULL) {
-            auth_server_request(&authresponse, REQUEST_TYPE_COUNTERS, p1->ip, p1->mac, p1->auth_type, p1->token, p1->counters.incoming,
+            auth_server_request(&authresponse, REQUEST_TYPE_COUNTERS, ip, mac, p1->auth_type, p1->token, p1->counters.incoming,
                                 p1->counters.outgoing);
         }
 
-        time_t current_time = time(NULL);
-        debug(LOG_INFO,
-              "Checking client %s for timeout:  Last updated %ld (%ld seconds ago), timeout delay %ld seconds, current time %ld, ",
-              p1->ip, p1->counters.last_updated, current_time - p1->counters.last_updated,
-              config->checkinterval * config->clienttimeout, current_time);
-        if (p1->counters.last_updated + (config->checkinterval * config->clienttimeout) <= current_time) {
-            /* Timing out user */
-            debug(LOG_INFO, "%s - Inactive for more than %ld seconds, removing client and denying in firewall",
-                  p1->ip, config->checkinterval * config->clienttimeout);
-            LOCK_CLIENT_LIST();
-            tmp = client_list_find_by_client(p1);
-            if (NULL != tmp) {
-                logout_client(tmp);
-            } else {
-                debug(LOG_NOTICE, "Client was already removed. Not logging out.");
-            }
-            UNLOCK_CLIENT_LIST();
-        } else {
-            /*
-             * This handles any change in
-             * the status this allows us
-             * to change the status of a
-             * user while he's connected
-             *
-             * Only run if we have an auth server
-             * configured!
-             */
-            LOCK_CLIENT_LIST();
-            tmp = client_list_find_by_client(p1);
-            if (NULL == tmp) {
-                UNLOCK_CLIENT_LIST();
-                debug(LOG_NOTICE, "Client was already removed. Skipping auth processing");
-                continue;       /* Next client please */
-            }
+        /*
+         * This handles any change in
+         * the status this allows us
+         * to change the status of a
+         * user while he's connected
+         *
+         * Only run if we have an auth server
+         * configured!
+         */
+        shard = client_shard_of(p1);
+        LOCK_CLIENT_SHARD(shard);
+        tmp = client_list_find_by_client(p1);
+        if (NULL == tmp) {
+            UNLOCK_CLIENT_SHARD(shard);
+            debug(LOG_NOTICE, "Client was already removed. Skipping auth processing");
+            continue;       /* Next client please */
+        }
 
-            if (config->auth_servers != NULL) {
-                switch (authresponse.authcode) {
-                case AUTH_DENIED:
-                    debug(LOG_NOTICE, "%s - Denied. Removing client and firewall rules", tmp->ip);
-                    fw_deny(tmp);
-                    client_list_delete(tmp);
-                    break;
-
-                case AUTH_VALIDATION_FAILED:
-                    debug(LOG_NOTICE, "%s - Validation timeout, now denied. Removing client and firewall rules",
-                          tmp->ip);
-                    fw_deny(tmp);
-                    client_list_delete(tmp);
-                    break;
-
-                case AUTH_ALLOWED:
-                    if (tmp->fw_connection_state != FW_MARK_KNOWN) {
-                        debug(LOG_INFO, "%s - Access has changed to allowed, refreshing firewall and clearing counters",
-                              tmp->ip);
-                        //WHY did we deny, then allow!?!? benoitg 2007-06-21
-                        //fw_deny(tmp->ip, tmp->mac, tmp->fw_connection_state); /* XXX this was possibly to avoid dupes. */
-
-                        if (tmp->fw_connection_state != FW_MARK_PROBATION) {
-                            tmp->counters.incoming = tmp->counters.outgoing = 0;
-                        } else {
-                            //We don't want to clear counters if the user was in validation, it probably already transmitted data..
-                            debug(LOG_INFO,
-                                  "%s - Skipped clearing counters after all, the user was previously in validation",
-                                  tmp->ip);
-                        }
-                        fw_allow(tmp, FW_MARK_KNOWN);
+        if (config->auth_servers != NULL) {
+            switch (authresponse.authcode) {
+            case AUTH_DENIED:
+                debug(LOG_NOTICE, "%s - Denied. Removing client and firewall rules", ip);
+                fw_deny(tmp, NULL);
+                client_list_delete(tmp);
+                break;
+
+            case AUTH_VALIDATION_FAILED:
+                debug(LOG_NOTICE, "%s - Validation timeout, now denied. Removing client and firewall rules",
+                      ip);
+                fw_deny(tmp, NULL);
+                client_list_delete(tmp);
+                break;
+
+            case AUTH_ALLOWED:
+                if (tmp->fw_connection_state != FW_MARK_KNOWN) {
+                    debug(LOG_INFO, "%s - Access has changed to allowed, refreshing firewall and clearing counters",
+                          ip);
+                    //WHY did we deny, then allow!?!? benoitg 2007-06-21
+                    //fw_deny(tmp->ip, tmp->mac, tmp->fw_connection_state); /* XXX this was possibly to avoid dupes. */
+
+                    if (tmp->fw_connection_state != FW_MARK_PROBATION) {
+                        tmp->counters.incoming = tmp->counters.outgoing = 0;
+                    } else {
+                        //We don't want to clear counters if the user was in validation, it probably already transmitted data..
+                        debug(LOG_INFO,
+                              "%s - Skipped clearing counters after all, the user was previously in validation",
+                              ip);
                     }
-                    break;
-
-                case AUTH_VALIDATION:
-                    /*
-                     * Do nothing, user
-                     * is in validation
-                     * period
-                     */
-                    debug(LOG_INFO, "%s - User in validation period", tmp->ip);
-                    break;
-
-                case AUTH_ERROR:
-                    debug(LOG_WARNING, "Error communicating with auth server - leaving %s as-is for now", tmp->ip);
-                    break;
-
-                default:
-                    debug(LOG_ERR, "I do not know about authentication code %d", authresponse.authcode);
-                    break;
+                    fw_allow(tmp, FW_MARK_KNOWN, NULL);
                 }
+                break;
+
+            case AUTH_VALIDATION:
+                /*
+                 * Do nothing, user
+                 * is in validation
+                 * period
+                 */
+                debug(LOG_INFO, "%s - User in validation period", ip);
+                break;
+
+            case AUTH_ERROR:
+                debug(LOG_WARNING, "Error communicating with auth server - leaving %s as-is for now", ip);
+                break;
+
+            default:
+                debug(LOG_ERR, "I do not know about authentication code %d", authresponse.authcode);
+                break;
             }
-            UNLOCK_CLIENT_LIST();
         }
+        UNLOCK_CLIENT_SHARD(shard);
     }
 
     client_list_destroy(worklist);
+    session_store_sync();
 }
@@ -40,9 +40,72 @@ typedef enum _t_fw_marks {
     FW_MARK_LOCKED = 254 /**< @brief The client has been locked out */
 } t_fw_marks;
 
+/** Used by fw_allow() and fw_deny() to select if the client should be granted of denied access */
+typedef enum fw_access_t_ {
+    FW_ACCESS_ALLOW,
+    FW_ACCESS_DENY
+} fw_access_t;
+
+/** A grant or revoke of the access of a client with a mark */
+typedef struct _t_fw_access_op {
+    fw_access_t type;
+    char ip[CLIENT_IP_TEXT_LEN];
+    char mac[CLIENT_MAC_TEXT_LEN];
+    int tag;
+    int result;                 /**< @brief Set by access_many, 0 once done */
+} t_fw_access_op;
+
+/** Queued client access change, see fw_wait().  0 is never queued. */
+typedef unsigned long t_fw_ticket;
+
+/** Firewall backend, selected with FirewallDriver.  The fw_* functions
+ * do their work through the driver's operations. */
+typedef struct _t_fw_driver {
+    const char *name;           /**< @brief Name in the configuration */
+    int (*init) (void);         /**< @brief Sets up the firewall, 0 on error */
+    int (*destroy) (void);      /**< @brief Removes everything init set up */
+    int (*reconcile) (void);    /**< @brief Brings what is in place up to
+				     date with the configuration and the client
+				     list, 0 to have it destroyed and set up
+				     again instead; NULL if not supported */
+    void (*clear_authservers) (void);
+    void (*set_authservers) (void);
+    int (*access) (fw_access_t, const char *ip, const char *mac, int tag); /**< @brief Grants or
+				     revokes the access of a client with a mark */
+    int (*access_many) (t_fw_access_op *, int); /**< @brief Applies
+				     several access operations in order at once
+				     and sets their results, nonzero if one
+				     failed; NULL to apply them one by one */
+    int (*access_host) (fw_access_t, const char *host);
+    int (*auth_unreachable) (int tag);
+    int (*auth_reachable) (void);
+    int (*counters_update) (void); /**< @brief Refreshes the counters of
+				     the clients on the list, -1 on error */
+    char *(*status) (void);     /**< @brief Text for wdctl status, NULL if
+				     the driver has nothing to report */
+} t_fw_driver;
+
+/** @brief Finds a firewall driver by name */
+const t_fw_driver *fw_driver_find(const char *);
+
+/** @brief The firewall driver in use */
+const t_fw_driver *fw_get_driver(void);
+
 /** @brief Initialize the firewall */
 int fw_init(void);
 
+/** @brief Starts applying client access changes in the background */
+int fw_queue_start(void);
+
+/** @brief Waits until the access changes made so far are applied */
+void fw_flush(void);
+
+/** @brief Waits until an access change is applied */
+int fw_wait(t_fw_ticket);
+
+/** @brief Leaves the firewall rules to a restarted wifidog */
+void fw_release(void);
+
 /** @brief Clears the authservers list */
 void fw_clear_authservers(void);
 
@@ -53,13 +116,13 @@ void fw_set_authservers(void);
 int fw_destroy(void);
 
 /** @brief Allow a user through the firewall*/
-int fw_allow(t_client *, int);
+int fw_allow(t_client *, int, t_fw_ticket *);
 
 /** @brief Allow a host through the firewall*/
 int fw_allow_host(const char *);
 
 /** @brief Deny a client access through the firewall*/
-int fw_deny(t_client *);
+int fw_deny(t_client *, t_fw_ticket *);
 
 /** @brief Passthrough for clients when auth server is down */
 int fw_set_authdown(void);
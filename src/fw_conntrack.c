@@ -0,0 +1,340 @@
+/* vim: set et sw=4 ts=4 sts=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/* $Id$ */
+/** @file fw_conntrack.c
+    @brief Client traffic counters from conntrack accounting
+
+    Used instead of the per client iptables rule counters when
+    ConntrackCounters is set.  The whole conntrack table is dumped over
+    ctnetlink in one go, the byte counts of each connection are compared
+    with the previous dump, and the differences are summed by the
+    connection's original source, that is by client.  The sums are then
+    applied to the client table in a single pass.
+
+    Bytes a connection moves between its last dump and its end are not
+    seen, and neither are connections opened towards a client.  The
+    kernel only counts when net.netfilter.nf_conntrack_acct is 1.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <endian.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include "../config.h"
+
+#ifdef HAVE_LINUX_NETFILTER_NFNETLINK_CONNTRACK_H
+#include <linux/netlink.h>
+#include <linux/netfilter/nfnetlink.h>
+#include <linux/netfilter/nfnetlink_conntrack.h>
+#endif
+
+#include "safe.h"
+#include "debug.h"
+#include "client_list.h"
+#include "fw_conntrack.h"
+
+#ifdef HAVE_LINUX_NETFILTER_NFNETLINK_CONNTRACK_H
+
+#define CONNTRACK_RECV_BUF 65536
+
+/** @internal
+ * One connection, or once summed, the traffic of one source
+ */
+typedef struct _t_conntrack_entry {
+    uint32_t id;
+    uint32_t src;               /**< @brief Original source, network byte order */
+    unsigned long long orig_bytes;      /**< @brief Sent by the source */
+    unsigned long long reply_bytes;     /**< @brief Sent to the source */
+} t_conntrack_entry;
+
+typedef struct _t_conntrack_table {
+    t_conntrack_entry *entries;
+    unsigned int count;
+    unsigned int size;
+} t_conntrack_table;
+
+/** @internal
+ * Protects the previous dump, sorted by connection id
+ */
+static pthread_mutex_t conntrack_mutex = PTHREAD_MUTEX_INITIALIZER;
+static t_conntrack_table conntrack_last = { NULL, 0, 0 };
+static int conntrack_primed = 0;
+
+/** @internal
+ * Finds an attribute among len bytes of attributes
+ */
+static const struct nlattr *
+conntrack_attr(const void *data, int len, int type)
+{
+    const struct nlattr *attr = data;
+
+    while (len >= (int)sizeof(*attr) && attr->nla_len >= sizeof(*attr) && attr->nla_len <= len) {
+        if ((attr->nla_type & NLA_TYPE_MASK) == type)
+            return attr;
+        len -= NLA_ALIGN(attr->nla_len);
+        attr = (const struct nlattr *)((const char *)attr + NLA_ALIGN(attr->nla_len));
+    }
+    return NULL;
+}
+
+/** @internal
+ * Finds an attribute nested in another, which may be NULL
+ */
+static const struct nlattr *
+conntrack_nested(const struct nlattr *parent, int type)
+{
+    if (parent == NULL)
+        return NULL;
+    return conntrack_attr((const char *)parent + NLA_HDRLEN, parent->nla_len - NLA_HDRLEN, type);
+}
+
+static unsigned long long
+conntrack_bytes(const struct nlattr *counters)
+{
+    const struct nlattr *bytes = conntrack_nested(counters, CTA_COUNTERS_BYTES);
+    uint64_t value;
+
+    if (bytes == NULL || bytes->nla_len < NLA_HDRLEN + sizeof(value))
+        return 0;
+    memcpy(&value, (const char *)bytes + NLA_HDRLEN, sizeof(value));
+    return be64toh(value);
+}
+
+/** @internal
+ * Adds the connection described by a ctnetlink message to a table
+ */
+static void
+conntrack_parse(t_conntrack_table * table, const struct nlmsghdr *nlh)
+{
+    const char *data = (const char *)NLMSG_DATA(nlh) + NLMSG_ALIGN(sizeof(struct nfgenmsg));
+    int len = nlh->nlmsg_len - NLMSG_HDRLEN - NLMSG_ALIGN(sizeof(struct nfgenmsg));
+    const struct nlattr *src, *id;
+    t_conntrack_entry *entry;
+    uint32_t value;
+
+    src = conntrack_nested(conntrack_nested(conntrack_attr(data, len, CTA_TUPLE_ORIG), CTA_TUPLE_IP), CTA_IP_V4_SRC);
+    if (src == NULL || src->nla_len < NLA_HDRLEN + sizeof(uint32_t))
+        return;
+
+    if (table->count == table->size) {
+        table->size = table->size ? 2 * table->size : 1024;
+        table->entries = safe_realloc(table->entries, table->size * sizeof(t_conntrack_entry));
+    }
+    entry = &table->entries[table->count++];
+    memcpy(&entry->src, (const char *)src + NLA_HDRLEN, sizeof(entry->src));
+    entry->id = 0;
+    if ((id = conntrack_attr(data, len, CTA_ID)) != NULL && id->nla_len >= NLA_HDRLEN + sizeof(value)) {
+        memcpy(&value, (const char *)id + NLA_HDRLEN, sizeof(value));
+        entry->id = ntohl(value);
+    }
+    entry->orig_bytes = conntrack_bytes(conntrack_attr(data, len, CTA_COUNTERS_ORIG));
+    entry->reply_bytes = conntrack_bytes(conntrack_attr(data, len, CTA_COUNTERS_REPLY));
+}
+
+/** @internal
+ * Reads the IPv4 conntrack table
+ * @return 0 on success, -1 on error
+ */
+static int
+conntrack_dump(t_conntrack_table * table)
+{
+    struct {
+        struct nlmsghdr nlh;
+        struct nfgenmsg nfmsg;
+    } req;
+    struct sockaddr_nl kernel;
+    struct nlmsghdr *nlh;
+    char *buf;
+    int sock, len, done = 0, rc = -1;
+
+    if ((sock = socket(AF_NETLINK, SOCK_RAW, NETLINK_NETFILTER)) < 0) {
+        debug(LOG_ERR, "Could not open ctnetlink socket: %s", strerror(errno));
+        return -1;
+    }
+
+    memset(&kernel, 0, sizeof(kernel));
+    kernel.nl_family = AF_NETLINK;
+    memset(&req, 0, sizeof(req));
+    req.nlh.nlmsg_len = NLMSG_LENGTH(sizeof(struct nfgenmsg));
+    req.nlh.nlmsg_type = (NFNL_SUBSYS_CTNETLINK << 8) | IPCTNL_MSG_CT_GET;
+    req.nlh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+    req.nlh.nlmsg_seq = time(NULL);
+    req.nfmsg.nfgen_family = AF_INET;
+    req.nfmsg.version = NFNETLINK_V0;
+
+    if (sendto(sock, &req, req.nlh.nlmsg_len, 0, (struct sockaddr *)&kernel, sizeof(kernel)) < 0) {
+        debug(LOG_ERR, "Could not request the conntrack table: %s", strerror(errno));
+        close(sock);
+        return -1;
+    }
+
+    buf = safe_malloc(CONNTRACK_RECV_BUF);
+    while (!done) {
+        len = recv(sock, buf, CONNTRACK_RECV_BUF, 0);
+        if (len < 0) {
+            if (errno == EINTR)
+                continue;
+            debug(LOG_ERR, "Could not read the conntrack table: %s", strerror(errno));
+            break;
+        }
+        if (len == 0)
+            break;
+        for (nlh = (struct nlmsghdr *)buf; NLMSG_OK(nlh, len); nlh = NLMSG_NEXT(nlh, len)) {
+            if (nlh->nlmsg_type == NLMSG_DONE) {
+                rc = 0;
+                done = 1;
+                break;
+            }
+            if (nlh->nlmsg_type == NLMSG_ERROR) {
+                debug(LOG_ERR, "Kernel refused the conntrack dump: %s",
+                      strerror(-((struct nlmsgerr *)NLMSG_DATA(nlh))->error));
+                done = 1;
+                break;
+            }
+            conntrack_parse(table, nlh);
+        }
+    }
+
+    free(buf);
+    close(sock);
+    return rc;
+}
+
+static int
+conntrack_cmp_id(const void *a, const void *b)
+{
+    uint32_t x = ((const t_conntrack_entry *)a)->id, y = ((const t_conntrack_entry *)b)->id;
+
+    return x < y ? -1 : x > y;
+}
+
+static int
+conntrack_cmp_src(const void *a, const void *b)
+{
+    uint32_t x = ((const t_conntrack_entry *)a)->src, y = ((const t_conntrack_entry *)b)->src;
+
+    return x < y ? -1 : x > y;
+}
+
+/** @internal
+ * client_list_foreach() visitor adding the traffic summed for a client
+ */
+static void
+conntrack_apply_client(t_client * client, void *arg)
+{
+    t_conntrack_table *sums = arg;
+    t_conntrack_entry key, *sum;
+
+    key.src = client->ip;
+    sum = bsearch(&key, sums->entries, sums->count, sizeof(t_conntrack_entry), conntrack_cmp_src);
+    if (sum == NULL)
+        return;
+    client->counters.incoming += sum->reply_bytes;
+    if (sum->orig_bytes > 0) {
+        client->counters.outgoing += sum->orig_bytes;
+        client_list_touch(client, time(NULL));
+    }
+}
+
+/** Refreshes the counters of the clients on the list from the traffic
+ * their connections moved since the previous call.  The first call
+ * only takes a reference.
+ * @return 1 on success, -1 on error
+ */
+int
+conntrack_counters_update(void)
+{
+    t_conntrack_table now = { NULL, 0, 0 }, sums = { NULL, 0, 0 };
+    t_conntrack_entry *cur, *last, *sum;
+    unsigned int i, j;
+
+    if (conntrack_dump(&now) != 0) {
+        free(now.entries);
+        return -1;
+    }
+    qsort(now.entries, now.count, sizeof(t_conntrack_entry), conntrack_cmp_id);
+
+    pthread_mutex_lock(&conntrack_mutex);
+
+    /* What each connection moved since the previous dump, both sorted by id */
+    sums.entries = safe_malloc((now.count + 1) * sizeof(t_conntrack_entry));
+    for (i = j = 0; i < now.count; i++) {
+        cur = &now.entries[i];
+        while (j < conntrack_last.count && conntrack_last.entries[j].id < cur->id)
+            j++;
+        sum = &sums.entries[sums.count++];
+        *sum = *cur;
+        last = j < conntrack_last.count ? &conntrack_last.entries[j] : NULL;
+        if (last && last->id == cur->id && last->src == cur->src &&
+            last->orig_bytes <= cur->orig_bytes && last->reply_bytes <= cur->reply_bytes) {
+            sum->orig_bytes -= last->orig_bytes;
+            sum->reply_bytes -= last->reply_bytes;
+        }
+    }
+
+    free(conntrack_last.entries);
+    conntrack_last = now;
+
+    if (conntrack_primed) {
+        /* Summed by source */
+        qsort(sums.entries, sums.count, sizeof(t_conntrack_entry), conntrack_cmp_src);
+        for (i = 0, j = 0; i < sums.count; i++) {
+            if (j > 0 && sums.entries[j - 1].src == sums.entries[i].src) {
+                sums.entries[j - 1].orig_bytes += sums.entries[i].orig_bytes;
+                sums.entries[j - 1].reply_bytes += sums.entries[i].reply_bytes;
+            } else {
+                sums.entries[j++] = sums.entries[i];
+            }
+        }
+        sums.count = j;
+        debug(LOG_DEBUG, "Read %u connections from %u sources", now.count, sums.count);
+        client_list_foreach(conntrack_apply_client, &sums, 1);
+    }
+    conntrack_primed = 1;
+
+    pthread_mutex_unlock(&conntrack_mutex);
+
+    free(sums.entries);
+    return 1;
+}
+
+#else                           /* HAVE_LINUX_NETFILTER_NFNETLINK_CONNTRACK_H */
+
+int
+conntrack_counters_update(void)
+{
+    debug(LOG_ERR, "ConntrackCounters is set but wifidog was built without ctnetlink support");
+    return -1;
+}
+
+#endif                          /* HAVE_LINUX_NETFILTER_NFNETLINK_CONNTRACK_H */
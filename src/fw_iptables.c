@@ -48,15 +48,79 @@
 #include "debug.h"
 #include "util.h"
 #include "client_list.h"
+#include "pstring.h"
+#include "fw_conntrack.h"
+#include "session_store.h"
+#include "subprocess.h"
+
+/** @internal
+ * What an iptables_batch holds for one table
+ */
+typedef struct _t_iptables_batch_table {
+    const char *name;
+    pstr_t *chains;             /**< @brief Chain declarations */
+    pstr_t *rules;              /**< @brief Commands, in iptables-restore form */
+    pstr_t *commands;           /**< @brief The same as iptables arguments,
+				     for when iptables-restore fails */
+} t_iptables_batch_table;
+
+#define IPTABLES_BATCH_TABLES 3
+
+/** @internal
+ * Commands collected to be applied with one iptables-restore run per
+ * table, instead of one iptables run per command.  Each table is
+ * applied atomically.
+ */
+typedef struct _t_iptables_batch {
+    t_iptables_batch_table tables[IPTABLES_BATCH_TABLES];
+    int replay;                 /**< @brief Whether the commands of a table
+				     iptables-restore failed on are run one
+				     by one, the default */
+} t_iptables_batch;
+
+/** @internal
+ * A client rule, or ipset entry, that iptables_fw_reconcile() wants
+ */
+typedef struct _t_iptables_wanted {
+    char key[96];               /**< @brief Compared with what the kernel
+				     shows, see iptables_wanted_client() */
+    char ip[CLIENT_IP_TEXT_LEN];
+    char mac[CLIENT_MAC_TEXT_LEN];
+    int tag;
+    int incoming;               /**< @brief Counts the client's incoming traffic */
+    int found;                  /**< @brief Already in place */
+} t_iptables_wanted;
+
+/** @internal
+ * Everything iptables_fw_reconcile() wants for the clients
+ */
+typedef struct _t_iptables_wanted_list {
+    t_iptables_wanted *items;
+    int count;
+    int size;
+} t_iptables_wanted_list;
 
 static int iptables_do_command(const char *format, ...);
+static int ipset_do_commands(const char *format, ...);
+static void iptables_batch_init(t_iptables_batch *);
+static void iptables_batch_chain(t_iptables_batch *, const char *, const char *);
+static void iptables_batch_add(t_iptables_batch *, const char *, const char *, ...);
+static int iptables_batch_commit(t_iptables_batch *);
 static char *iptables_compile(const char *, const char *, const t_firewall_rule *);
-static void iptables_load_ruleset(const char *, const char *, const char *);
+static void iptables_load_ruleset(t_iptables_batch *, const char *, const char *, const char *);
+static void iptables_batch_authservers(t_iptables_batch *);
 
 /**
 Used to supress the error output of the firewall during destruction */
 static int fw_quiet = 0;
 
+/** @internal
+ * Marks that clients can be given, each with its pair of ipsets
+ */
+static const int ipset_tags[] = { FW_MARK_PROBATION, FW_MARK_KNOWN, FW_MARK_LOCKED };
+
+#define IPSET_TAGS (sizeof(ipset_tags) / sizeof(ipset_tags[0]))
+
 /** @internal
  * @brief Insert $ID$ with the gateway's id in a string.
  *
@@ -107,7 +171,7 @@ iptables_do_command(const char *format, ...)
 
     debug(LOG_DEBUG, "Executing command: %s", cmd);
 
-    rc = execute(cmd, fw_quiet);
+    rc = subprocess_command(cmd, NULL, NULL, fw_quiet);
 
     if (rc != 0) {
         // If quiet, do not display the error
@@ -122,10 +186,239 @@ iptables_do_command(const char *format, ...)
     return rc;
 }
 
+/** @internal
+ * Runs ipset commands, one per line, with a single ipset restore.
+ * Adding an entry already there, or deleting a missing one, is not an
+ * error.
+ */
+static int
+ipset_do_commands(const char *format, ...)
+{
+    va_list vlist;
+    char *cmds;
+    int rc;
+
+    va_start(vlist, format);
+    safe_vasprintf(&cmds, format, vlist);
+    va_end(vlist);
+
+    iptables_insert_gateway_id(&cmds);
+
+    debug(LOG_DEBUG, "Executing ipset commands: %s", cmds);
+
+    rc = subprocess_command("ipset -exist restore", cmds, NULL, fw_quiet);
+
+    if (rc != 0) {
+        if (fw_quiet == 0)
+            debug(LOG_ERR, "ipset commands failed(%d): %s", rc, cmds);
+        else if (fw_quiet == 1)
+            debug(LOG_DEBUG, "ipset commands failed(%d): %s", rc, cmds);
+    }
+
+    free(cmds);
+
+    return rc;
+}
+
+/** @internal
+ * Runs a command and opens what it wrote for reading, like popen()
+ * without a shell. Close it with iptables_close_output().
+ * @param output Set to the buffer behind the stream
+ */
+static FILE *
+iptables_open_output(const char *cmd, char **output)
+{
+    FILE *stream;
+
+    if (subprocess_command(cmd, NULL, output, 0) == -1 || *output == NULL) {
+        debug(LOG_ERR, "Could not run %s", cmd);
+        free(*output);
+        return NULL;
+    }
+    /* An empty buffer can not be opened, a blank line reads the same */
+    if (**output == '\0') {
+        free(*output);
+        *output = safe_strdup("\n");
+    }
+    if ((stream = fmemopen(*output, strlen(*output), "r")) == NULL) {
+        debug(LOG_ERR, "fmemopen(): %s", strerror(errno));
+        free(*output);
+    }
+    return stream;
+}
+
+/** @internal
+ * Closes a stream from iptables_open_output()
+ */
+static void
+iptables_close_output(FILE * stream, char *output)
+{
+    fclose(stream);
+    free(output);
+}
+
+/** @internal
+ * Whether a mark has its pair of ipsets
+ */
+static int
+ipset_tag_known(int tag)
+{
+    unsigned int i;
+
+    for (i = 0; i < IPSET_TAGS; i++) {
+        if (ipset_tags[i] == tag)
+            return 1;
+    }
+    return 0;
+}
+
+/** @internal
+ * Starts an empty batch
+ */
+static void
+iptables_batch_init(t_iptables_batch * batch)
+{
+    static const char *names[IPTABLES_BATCH_TABLES] = { "mangle", "nat", "filter" };
+    int i;
+
+    for (i = 0; i < IPTABLES_BATCH_TABLES; i++) {
+        batch->tables[i].name = names[i];
+        batch->tables[i].chains = pstr_new();
+        batch->tables[i].rules = pstr_new();
+        batch->tables[i].commands = pstr_new();
+    }
+    batch->replay = 1;
+}
+
+/** @internal
+ * Finds the part of a batch for a table
+ */
+static t_iptables_batch_table *
+iptables_batch_table(t_iptables_batch * batch, const char *table)
+{
+    int i;
+
+    for (i = 0; i < IPTABLES_BATCH_TABLES; i++) {
+        if (strcmp(batch->tables[i].name, table) == 0)
+            return &batch->tables[i];
+    }
+    debug(LOG_ERR, "No iptables table %s in batch", table);
+    return NULL;
+}
+
+/** @internal
+ * Adds a chain to a batch.  The chain is created if missing and
+ * flushed otherwise, before any command of its table runs.
+ * @arg table Table containing the chain.
+ * @arg chain Name of the chain, $ID$ is replaced.
+ */
+static void
+iptables_batch_chain(t_iptables_batch * batch, const char *table, const char *chain)
+{
+    t_iptables_batch_table *t = iptables_batch_table(batch, table);
+    char *name;
+
+    if (t == NULL)
+        return;
+    name = safe_strdup(chain);
+    iptables_insert_gateway_id(&name);
+    pstr_append_sprintf(t->chains, ":%s - [0:0]\n", name);
+    pstr_append_sprintf(t->commands, "-t %s -N %s\n-t %s -F %s\n", table, name, table, name);
+    free(name);
+}
+
+/** @internal
+ * Adds a command to a batch.
+ * @arg table Table of the command.
+ * @arg format Arguments of iptables without the table, $ID$ is replaced.
+ */
+static void
+iptables_batch_add(t_iptables_batch * batch, const char *table, const char *format, ...)
+{
+    t_iptables_batch_table *t = iptables_batch_table(batch, table);
+    va_list vlist;
+    char *cmd;
+
+    if (t == NULL)
+        return;
+
+    va_start(vlist, format);
+    safe_vasprintf(&cmd, format, vlist);
+    va_end(vlist);
+    iptables_insert_gateway_id(&cmd);
+
+    pstr_append_sprintf(t->rules, "%s\n", cmd);
+    pstr_append_sprintf(t->commands, "-t %s %s\n", table, cmd);
+    free(cmd);
+}
+
+/** @internal
+ * Applies a batch and frees it.  Each table is loaded with one run of
+ * iptables-restore.  If that fails, for a bad rule in a user ruleset or
+ * a missing iptables-restore, nothing of the table was applied and its
+ * commands are run one by one, so only the bad ones are lost.  Unless
+ * iptables-restore really exited with an error they are not: if it was
+ * killed or its exit code was lost the table may be in place, and the
+ * rules inserted again would be there twice.
+ * @return 0 if every table was applied at once, SUBPROCESS_NO_STATUS
+ * if a table may or may not be in place, 1 otherwise
+ */
+static int
+iptables_batch_commit(t_iptables_batch * batch)
+{
+    t_iptables_batch_table *t;
+    char *payload, *commands, *cmd, *next;
+    int i, rc, failed = 0;
+
+    for (i = 0; i < IPTABLES_BATCH_TABLES; i++) {
+        t = &batch->tables[i];
+        if (t->chains->len == 0 && t->rules->len == 0) {
+            free(pstr_to_string(t->chains));
+            free(pstr_to_string(t->rules));
+            free(pstr_to_string(t->commands));
+            continue;
+        }
+
+        payload = pstr_to_string(t->chains);
+        cmd = pstr_to_string(t->rules);
+        safe_asprintf(&next, "*%s\n%s%sCOMMIT\n", t->name, payload, cmd);
+        free(payload);
+        free(cmd);
+        payload = next;
+        commands = pstr_to_string(t->commands);
+
+        debug(LOG_DEBUG, "Loading table %s with iptables-restore:\n%s", t->name, payload);
+        rc = subprocess_command("iptables-restore --noflush", payload, NULL, fw_quiet);
+        if (rc == SUBPROCESS_NO_STATUS) {
+            debug(LOG_ERR, "Do not know whether iptables-restore loaded table %s, leaving it as it is", t->name);
+            failed = SUBPROCESS_NO_STATUS;
+        } else if (rc != 0 && !batch->replay) {
+            if (fw_quiet == 0)
+                debug(LOG_WARNING, "iptables-restore failed for table %s", t->name);
+            if (failed == 0)
+                failed = 1;
+        } else if (rc != 0) {
+            if (fw_quiet == 0)
+                debug(LOG_WARNING, "iptables-restore failed for table %s, running its commands one by one", t->name);
+            if (failed == 0)
+                failed = 1;
+            for (cmd = commands; (next = strchr(cmd, '\n')) != NULL; cmd = next + 1) {
+                *next = '\0';
+                iptables_do_command("%s", cmd);
+            }
+        }
+
+        free(payload);
+        free(commands);
+    }
+
+    return failed;
+}
+
 /**
  * @internal
  * Compiles a struct definition of a firewall rule into a valid iptables
- * command.
+ * command, without the table.
  * @arg table Table containing the chain.
  * @arg chain Chain that the command will be (-A)ppended to.
  * @arg rule Definition of a rule into a struct, from conf.c.
@@ -164,7 +457,7 @@ iptables_compile(const char *table, const char *chain, const t_firewall_rule * r
         break;
     }
 
-    snprintf(command, sizeof(command), "-t %s -A %s ", table, chain);
+    snprintf(command, sizeof(command), "-A %s ", chain);
     if (rule->mask != NULL) {
         if (rule->mask_is_ipset) {
             snprintf((command + strlen(command)), (sizeof(command) -
@@ -191,12 +484,13 @@ iptables_compile(const char *table, const char *chain, const t_firewall_rule * r
 /**
  * @internal
  * Load all the rules in a rule set.
+ * @arg batch Batch the rules are added to
  * @arg ruleset Name of the ruleset
  * @arg table Table containing the chain.
  * @arg chain IPTables chain the rules go into
  */
 static void
-iptables_load_ruleset(const char *table, const char *ruleset, const char *chain)
+iptables_load_ruleset(t_iptables_batch * batch, const char *table, const char *ruleset, const char *chain)
 {
     t_firewall_rule *rule;
     char *cmd;
@@ -207,7 +501,7 @@ iptables_load_ruleset(const char *table, const char *ruleset, const char *chain)
         cmd = iptables_compile(table, chain, rule);
         if (cmd != NULL) {
             debug(LOG_DEBUG, "Loading rule \"%s\" into table %s, chain %s", cmd, table, chain);
-            iptables_do_command(cmd);
+            iptables_batch_add(batch, table, "%s", cmd);
         }
         free(cmd);
     }
@@ -218,12 +512,19 @@ iptables_load_ruleset(const char *table, const char *ruleset, const char *chain)
 void
 iptables_fw_clear_authservers(void)
 {
-    iptables_do_command("-t filter -F " CHAIN_AUTHSERVERS);
-    iptables_do_command("-t nat -F " CHAIN_AUTHSERVERS);
+    t_iptables_batch batch;
+
+    iptables_batch_init(&batch);
+    iptables_batch_chain(&batch, "filter", CHAIN_AUTHSERVERS);
+    iptables_batch_chain(&batch, "nat", CHAIN_AUTHSERVERS);
+    iptables_batch_commit(&batch);
 }
 
-void
-iptables_fw_set_authservers(void)
+/** @internal
+ * Adds the rules whitelisting the authservers to a batch
+ */
+static void
+iptables_batch_authservers(t_iptables_batch * batch)
 {
     const s_config *config;
     t_auth_serv *auth_server;
@@ -232,40 +533,55 @@ iptables_fw_set_authservers(void)
 
     for (auth_server = config->auth_servers; auth_server != NULL; auth_server = auth_server->next) {
         if (auth_server->last_ip && strcmp(auth_server->last_ip, "0.0.0.0") != 0) {
-            iptables_do_command("-t filter -A " CHAIN_AUTHSERVERS " -d %s -j ACCEPT", auth_server->last_ip);
-            iptables_do_command("-t nat -A " CHAIN_AUTHSERVERS " -d %s -j ACCEPT", auth_server->last_ip);
+            iptables_batch_add(batch, "filter", "-A " CHAIN_AUTHSERVERS " -d %s -j ACCEPT", auth_server->last_ip);
+            iptables_batch_add(batch, "nat", "-A " CHAIN_AUTHSERVERS " -d %s -j ACCEPT", auth_server->last_ip);
         }
     }
+}
+
+void
+iptables_fw_set_authservers(void)
+{
+    t_iptables_batch batch;
 
+    iptables_batch_init(&batch);
+    iptables_batch_authservers(&batch);
+    iptables_batch_commit(&batch);
 }
 
-/** Initialize the firewall rules
-*/
-int
-iptables_fw_init(void)
+/** @internal
+ * Finds the external interface, to be freed, or NULL
+ */
+static char *
+iptables_ext_interface(void)
 {
-    const s_config *config;
-    char *ext_interface = NULL;
-    int gw_port = 0;
+    const s_config *config = config_get_config();
+
+    if (config->external_interface)
+        return safe_strdup(config->external_interface);
+    return get_ext_iface();
+}
+
+/** @internal
+ * Adds the chains and rules of the firewall, those of the clients
+ * aside, to a batch.  Called with the config locked.
+ * @arg reconcile Set by iptables_fw_reconcile(), which brings the
+ * clients up to date itself: the ipsets are not flushed, and neither
+ * are the mangle chains of the clients when they are not in ipsets.
+ */
+static void
+iptables_batch_setup(t_iptables_batch * batch, const char *ext_interface, int reconcile)
+{
+    const s_config *config = config_get_config();
+    int gw_port = config->gw_port;
     t_trusted_mac *p;
     int proxy_port;
-    fw_quiet = 0;
+    pstr_t *sets;
+    char *cmds;
+    unsigned int i;
     int got_authdown_ruleset = NULL == get_ruleset(FWRULESET_AUTH_IS_DOWN) ? 0 : 1;
+    int keep_clients = reconcile && !config->fw_ipset;
 
-    LOCK_CONFIG();
-    config = config_get_config();
-    gw_port = config->gw_port;
-    if (config->external_interface) {
-        ext_interface = safe_strdup(config->external_interface);
-    } else {
-        ext_interface = get_ext_iface();
-    }
-
-    if (ext_interface == NULL) {
-        UNLOCK_CONFIG();
-        debug(LOG_ERR, "FATAL: no external interface");
-        return 0;
-    }
     /*
      *
      * Everything in the MANGLE table
@@ -273,22 +589,43 @@ iptables_fw_init(void)
      */
 
     /* Create new chains */
-    iptables_do_command("-t mangle -N " CHAIN_TRUSTED);
-    iptables_do_command("-t mangle -N " CHAIN_OUTGOING);
-    iptables_do_command("-t mangle -N " CHAIN_INCOMING);
+    iptables_batch_chain(batch, "mangle", CHAIN_TRUSTED);
+    if (!keep_clients) {
+        iptables_batch_chain(batch, "mangle", CHAIN_OUTGOING);
+        iptables_batch_chain(batch, "mangle", CHAIN_INCOMING);
+    }
     if (got_authdown_ruleset)
-        iptables_do_command("-t mangle -N " CHAIN_AUTH_IS_DOWN);
+        iptables_batch_chain(batch, "mangle", CHAIN_AUTH_IS_DOWN);
 
     /* Assign links and rules to these new chains */
-    iptables_do_command("-t mangle -I PREROUTING 1 -i %s -j " CHAIN_OUTGOING, config->gw_interface);
-    iptables_do_command("-t mangle -I PREROUTING 1 -i %s -j " CHAIN_TRUSTED, config->gw_interface);     //this rule will be inserted before the prior one
+    iptables_batch_add(batch, "mangle", "-I PREROUTING 1 -i %s -j " CHAIN_OUTGOING, config->gw_interface);
+    iptables_batch_add(batch, "mangle", "-I PREROUTING 1 -i %s -j " CHAIN_TRUSTED, config->gw_interface);     //this rule will be inserted before the prior one
     if (got_authdown_ruleset)
-        iptables_do_command("-t mangle -I PREROUTING 1 -i %s -j " CHAIN_AUTH_IS_DOWN, config->gw_interface);    //this rule must be last in the chain
-    iptables_do_command("-t mangle -I POSTROUTING 1 -o %s -j " CHAIN_INCOMING, config->gw_interface);
+        iptables_batch_add(batch, "mangle", "-I PREROUTING 1 -i %s -j " CHAIN_AUTH_IS_DOWN, config->gw_interface);    //this rule must be last in the chain
+    iptables_batch_add(batch, "mangle", "-I POSTROUTING 1 -o %s -j " CHAIN_INCOMING, config->gw_interface);
 
     for (p = config->trustedmaclist; p != NULL; p = p->next)
-        iptables_do_command("-t mangle -A " CHAIN_TRUSTED " -m mac --mac-source %s -j MARK --set-mark %d", p->mac,
-                            FW_MARK_KNOWN);
+        iptables_batch_add(batch, "mangle", "-A " CHAIN_TRUSTED " -m mac --mac-source %s -j MARK --set-mark %d",
+                           p->mac, FW_MARK_KNOWN);
+
+    if (config->fw_ipset) {
+        /* Authenticated clients are in the sets of their mark, see iptables_fw_access() */
+        sets = pstr_new();
+        for (i = 0; i < IPSET_TAGS; i++) {
+            pstr_append_sprintf(sets, "create " IPSET_OUTGOING " hash:ip,mac counters\n", ipset_tags[i]);
+            pstr_append_sprintf(sets, "create " IPSET_INCOMING " hash:ip counters\n", ipset_tags[i]);
+            if (!reconcile)
+                pstr_append_sprintf(sets, "flush " IPSET_OUTGOING "\nflush " IPSET_INCOMING "\n", ipset_tags[i],
+                                    ipset_tags[i]);
+            iptables_batch_add(batch, "mangle", "-A " CHAIN_OUTGOING " -m set --match-set " IPSET_OUTGOING
+                               " src,src -j MARK --set-mark %d", ipset_tags[i], ipset_tags[i]);
+            iptables_batch_add(batch, "mangle", "-A " CHAIN_INCOMING " -m set --match-set " IPSET_INCOMING
+                               " dst -j ACCEPT", ipset_tags[i]);
+        }
+        cmds = pstr_to_string(sets);
+        ipset_do_commands("%s", cmds);
+        free(cmds);
+    }
 
     /*
      *
@@ -297,44 +634,44 @@ iptables_fw_init(void)
      */
 
     /* Create new chains */
-    iptables_do_command("-t nat -N " CHAIN_OUTGOING);
-    iptables_do_command("-t nat -N " CHAIN_TO_ROUTER);
-    iptables_do_command("-t nat -N " CHAIN_TO_INTERNET);
-    iptables_do_command("-t nat -N " CHAIN_GLOBAL);
-    iptables_do_command("-t nat -N " CHAIN_UNKNOWN);
-    iptables_do_command("-t nat -N " CHAIN_AUTHSERVERS);
+    iptables_batch_chain(batch, "nat", CHAIN_OUTGOING);
+    iptables_batch_chain(batch, "nat", CHAIN_TO_ROUTER);
+    iptables_batch_chain(batch, "nat", CHAIN_TO_INTERNET);
+    iptables_batch_chain(batch, "nat", CHAIN_GLOBAL);
+    iptables_batch_chain(batch, "nat", CHAIN_UNKNOWN);
+    iptables_batch_chain(batch, "nat", CHAIN_AUTHSERVERS);
     if (got_authdown_ruleset)
-        iptables_do_command("-t nat -N " CHAIN_AUTH_IS_DOWN);
+        iptables_batch_chain(batch, "nat", CHAIN_AUTH_IS_DOWN);
 
     /* Assign links and rules to these new chains */
-    iptables_do_command("-t nat -A PREROUTING -i %s -j " CHAIN_OUTGOING, config->gw_interface);
+    iptables_batch_add(batch, "nat", "-A PREROUTING -i %s -j " CHAIN_OUTGOING, config->gw_interface);
 
-    iptables_do_command("-t nat -A " CHAIN_OUTGOING " -d %s -j " CHAIN_TO_ROUTER, config->gw_address);
-    iptables_do_command("-t nat -A " CHAIN_TO_ROUTER " -j ACCEPT");
+    iptables_batch_add(batch, "nat", "-A " CHAIN_OUTGOING " -d %s -j " CHAIN_TO_ROUTER, config->gw_address);
+    iptables_batch_add(batch, "nat", "-A " CHAIN_TO_ROUTER " -j ACCEPT");
 
-    iptables_do_command("-t nat -A " CHAIN_OUTGOING " -j " CHAIN_TO_INTERNET);
+    iptables_batch_add(batch, "nat", "-A " CHAIN_OUTGOING " -j " CHAIN_TO_INTERNET);
 
     if ((proxy_port = config_get_config()->proxy_port) != 0) {
         debug(LOG_DEBUG, "Proxy port set, setting proxy rule");
-        iptables_do_command("-t nat -A " CHAIN_TO_INTERNET
-                            " -p tcp --dport 80 -m mark --mark 0x%u -j REDIRECT --to-port %u", FW_MARK_KNOWN,
-                            proxy_port);
-        iptables_do_command("-t nat -A " CHAIN_TO_INTERNET
-                            " -p tcp --dport 80 -m mark --mark 0x%u -j REDIRECT --to-port %u", FW_MARK_PROBATION,
-                            proxy_port);
+        iptables_batch_add(batch, "nat", "-A " CHAIN_TO_INTERNET
+                           " -p tcp --dport 80 -m mark --mark 0x%u -j REDIRECT --to-port %u", FW_MARK_KNOWN,
+                           proxy_port);
+        iptables_batch_add(batch, "nat", "-A " CHAIN_TO_INTERNET
+                           " -p tcp --dport 80 -m mark --mark 0x%u -j REDIRECT --to-port %u", FW_MARK_PROBATION,
+                           proxy_port);
     }
 
-    iptables_do_command("-t nat -A " CHAIN_TO_INTERNET " -m mark --mark 0x%u -j ACCEPT", FW_MARK_KNOWN);
-    iptables_do_command("-t nat -A " CHAIN_TO_INTERNET " -m mark --mark 0x%u -j ACCEPT", FW_MARK_PROBATION);
-    iptables_do_command("-t nat -A " CHAIN_TO_INTERNET " -j " CHAIN_UNKNOWN);
+    iptables_batch_add(batch, "nat", "-A " CHAIN_TO_INTERNET " -m mark --mark 0x%u -j ACCEPT", FW_MARK_KNOWN);
+    iptables_batch_add(batch, "nat", "-A " CHAIN_TO_INTERNET " -m mark --mark 0x%u -j ACCEPT", FW_MARK_PROBATION);
+    iptables_batch_add(batch, "nat", "-A " CHAIN_TO_INTERNET " -j " CHAIN_UNKNOWN);
 
-    iptables_do_command("-t nat -A " CHAIN_UNKNOWN " -j " CHAIN_AUTHSERVERS);
-    iptables_do_command("-t nat -A " CHAIN_UNKNOWN " -j " CHAIN_GLOBAL);
+    iptables_batch_add(batch, "nat", "-A " CHAIN_UNKNOWN " -j " CHAIN_AUTHSERVERS);
+    iptables_batch_add(batch, "nat", "-A " CHAIN_UNKNOWN " -j " CHAIN_GLOBAL);
     if (got_authdown_ruleset) {
-        iptables_do_command("-t nat -A " CHAIN_UNKNOWN " -j " CHAIN_AUTH_IS_DOWN);
-        iptables_do_command("-t nat -A " CHAIN_AUTH_IS_DOWN " -m mark --mark 0x%u -j ACCEPT", FW_MARK_AUTH_IS_DOWN);
+        iptables_batch_add(batch, "nat", "-A " CHAIN_UNKNOWN " -j " CHAIN_AUTH_IS_DOWN);
+        iptables_batch_add(batch, "nat", "-A " CHAIN_AUTH_IS_DOWN " -m mark --mark 0x%u -j ACCEPT", FW_MARK_AUTH_IS_DOWN);
     }
-    iptables_do_command("-t nat -A " CHAIN_UNKNOWN " -p tcp --dport 80 -j REDIRECT --to-ports %d", gw_port);
+    iptables_batch_add(batch, "nat", "-A " CHAIN_UNKNOWN " -p tcp --dport 80 -j REDIRECT --to-ports %d", gw_port);
 
     /*
      *
@@ -343,22 +680,22 @@ iptables_fw_init(void)
      */
 
     /* Create new chains */
-    iptables_do_command("-t filter -N " CHAIN_TO_INTERNET);
-    iptables_do_command("-t filter -N " CHAIN_AUTHSERVERS);
-    iptables_do_command("-t filter -N " CHAIN_LOCKED);
-    iptables_do_command("-t filter -N " CHAIN_GLOBAL);
-    iptables_do_command("-t filter -N " CHAIN_VALIDATE);
-    iptables_do_command("-t filter -N " CHAIN_KNOWN);
-    iptables_do_command("-t filter -N " CHAIN_UNKNOWN);
+    iptables_batch_chain(batch, "filter", CHAIN_TO_INTERNET);
+    iptables_batch_chain(batch, "filter", CHAIN_AUTHSERVERS);
+    iptables_batch_chain(batch, "filter", CHAIN_LOCKED);
+    iptables_batch_chain(batch, "filter", CHAIN_GLOBAL);
+    iptables_batch_chain(batch, "filter", CHAIN_VALIDATE);
+    iptables_batch_chain(batch, "filter", CHAIN_KNOWN);
+    iptables_batch_chain(batch, "filter", CHAIN_UNKNOWN);
     if (got_authdown_ruleset)
-        iptables_do_command("-t filter -N " CHAIN_AUTH_IS_DOWN);
+        iptables_batch_chain(batch, "filter", CHAIN_AUTH_IS_DOWN);
 
     /* Assign links and rules to these new chains */
 
     /* Insert at the beginning */
-    iptables_do_command("-t filter -I FORWARD -i %s -j " CHAIN_TO_INTERNET, config->gw_interface);
+    iptables_batch_add(batch, "filter", "-I FORWARD -i %s -j " CHAIN_TO_INTERNET, config->gw_interface);
 
-    iptables_do_command("-t filter -A " CHAIN_TO_INTERNET " -m state --state INVALID -j DROP");
+    iptables_batch_add(batch, "filter", "-A " CHAIN_TO_INTERNET " -m state --state INVALID -j DROP");
 
     /* XXX: Why this? it means that connections setup after authentication
        stay open even after the connection is done... 
@@ -368,34 +705,58 @@ iptables_fw_init(void)
     //iptables_do_command("-t filter -A " CHAIN_TO_INTERNET " -i %s -m state --state NEW -j DROP", ext_interface);
 
     /* TCPMSS rule for PPPoE */
-    iptables_do_command("-t filter -A " CHAIN_TO_INTERNET
-                        " -o %s -p tcp --tcp-flags SYN,RST SYN -j TCPMSS --clamp-mss-to-pmtu", ext_interface);
+    iptables_batch_add(batch, "filter", "-A " CHAIN_TO_INTERNET
+                       " -o %s -p tcp --tcp-flags SYN,RST SYN -j TCPMSS --clamp-mss-to-pmtu", ext_interface);
 
-    iptables_do_command("-t filter -A " CHAIN_TO_INTERNET " -j " CHAIN_AUTHSERVERS);
-    iptables_fw_set_authservers();
+    iptables_batch_add(batch, "filter", "-A " CHAIN_TO_INTERNET " -j " CHAIN_AUTHSERVERS);
+    iptables_batch_authservers(batch);
 
-    iptables_do_command("-t filter -A " CHAIN_TO_INTERNET " -m mark --mark 0x%u -j " CHAIN_LOCKED, FW_MARK_LOCKED);
-    iptables_load_ruleset("filter", FWRULESET_LOCKED_USERS, CHAIN_LOCKED);
+    iptables_batch_add(batch, "filter", "-A " CHAIN_TO_INTERNET " -m mark --mark 0x%u -j " CHAIN_LOCKED, FW_MARK_LOCKED);
+    iptables_load_ruleset(batch, "filter", FWRULESET_LOCKED_USERS, CHAIN_LOCKED);
 
-    iptables_do_command("-t filter -A " CHAIN_TO_INTERNET " -j " CHAIN_GLOBAL);
-    iptables_load_ruleset("filter", FWRULESET_GLOBAL, CHAIN_GLOBAL);
-    iptables_load_ruleset("nat", FWRULESET_GLOBAL, CHAIN_GLOBAL);
+    iptables_batch_add(batch, "filter", "-A " CHAIN_TO_INTERNET " -j " CHAIN_GLOBAL);
+    iptables_load_ruleset(batch, "filter", FWRULESET_GLOBAL, CHAIN_GLOBAL);
+    iptables_load_ruleset(batch, "nat", FWRULESET_GLOBAL, CHAIN_GLOBAL);
 
-    iptables_do_command("-t filter -A " CHAIN_TO_INTERNET " -m mark --mark 0x%u -j " CHAIN_VALIDATE, FW_MARK_PROBATION);
-    iptables_load_ruleset("filter", FWRULESET_VALIDATING_USERS, CHAIN_VALIDATE);
+    iptables_batch_add(batch, "filter", "-A " CHAIN_TO_INTERNET " -m mark --mark 0x%u -j " CHAIN_VALIDATE, FW_MARK_PROBATION);
+    iptables_load_ruleset(batch, "filter", FWRULESET_VALIDATING_USERS, CHAIN_VALIDATE);
 
-    iptables_do_command("-t filter -A " CHAIN_TO_INTERNET " -m mark --mark 0x%u -j " CHAIN_KNOWN, FW_MARK_KNOWN);
-    iptables_load_ruleset("filter", FWRULESET_KNOWN_USERS, CHAIN_KNOWN);
+    iptables_batch_add(batch, "filter", "-A " CHAIN_TO_INTERNET " -m mark --mark 0x%u -j " CHAIN_KNOWN, FW_MARK_KNOWN);
+    iptables_load_ruleset(batch, "filter", FWRULESET_KNOWN_USERS, CHAIN_KNOWN);
 
     if (got_authdown_ruleset) {
-        iptables_do_command("-t filter -A " CHAIN_TO_INTERNET " -m mark --mark 0x%u -j " CHAIN_AUTH_IS_DOWN,
-                            FW_MARK_AUTH_IS_DOWN);
-        iptables_load_ruleset("filter", FWRULESET_AUTH_IS_DOWN, CHAIN_AUTH_IS_DOWN);
+        iptables_batch_add(batch, "filter", "-A " CHAIN_TO_INTERNET " -m mark --mark 0x%u -j " CHAIN_AUTH_IS_DOWN,
+                           FW_MARK_AUTH_IS_DOWN);
+        iptables_load_ruleset(batch, "filter", FWRULESET_AUTH_IS_DOWN, CHAIN_AUTH_IS_DOWN);
     }
 
-    iptables_do_command("-t filter -A " CHAIN_TO_INTERNET " -j " CHAIN_UNKNOWN);
-    iptables_load_ruleset("filter", FWRULESET_UNKNOWN_USERS, CHAIN_UNKNOWN);
-    iptables_do_command("-t filter -A " CHAIN_UNKNOWN " -j REJECT --reject-with icmp-port-unreachable");
+    iptables_batch_add(batch, "filter", "-A " CHAIN_TO_INTERNET " -j " CHAIN_UNKNOWN);
+    iptables_load_ruleset(batch, "filter", FWRULESET_UNKNOWN_USERS, CHAIN_UNKNOWN);
+    iptables_batch_add(batch, "filter", "-A " CHAIN_UNKNOWN " -j REJECT --reject-with icmp-port-unreachable");
+}
+
+/** Initialize the firewall rules
+*/
+int
+iptables_fw_init(void)
+{
+    char *ext_interface = NULL;
+    t_iptables_batch batch;
+    fw_quiet = 0;
+
+    LOCK_CONFIG();
+    ext_interface = iptables_ext_interface();
+
+    if (ext_interface == NULL) {
+        UNLOCK_CONFIG();
+        debug(LOG_ERR, "FATAL: no external interface");
+        return 0;
+    }
+
+    /* Everything goes in with one iptables-restore per table */
+    iptables_batch_init(&batch);
+    iptables_batch_setup(&batch, ext_interface, 0);
+    iptables_batch_commit(&batch);
 
     UNLOCK_CONFIG();
 
@@ -405,15 +766,21 @@ iptables_fw_init(void)
 
 /** Remove the firewall rules
  * This is used when we do a clean shutdown of WiFiDog and when it starts to make
- * sure there are no rules left over
+ * sure there are no rules left over.  The jumps to our chains are removed
+ * first, then the chains themselves with one iptables-restore per table.
  */
 int
 iptables_fw_destroy(void)
 {
     int got_authdown_ruleset = NULL == get_ruleset(FWRULESET_AUTH_IS_DOWN) ? 0 : 1;
+    t_iptables_batch batch;
+    pstr_t *sets;
+    char *cmds;
+    unsigned int i;
     fw_quiet = 1;
 
     debug(LOG_DEBUG, "Destroying our iptables entries");
+    iptables_batch_init(&batch);
 
     /*
      *
@@ -426,16 +793,16 @@ iptables_fw_destroy(void)
     if (got_authdown_ruleset)
         iptables_fw_destroy_mention("mangle", "PREROUTING", CHAIN_AUTH_IS_DOWN);
     iptables_fw_destroy_mention("mangle", "POSTROUTING", CHAIN_INCOMING);
-    iptables_do_command("-t mangle -F " CHAIN_TRUSTED);
-    iptables_do_command("-t mangle -F " CHAIN_OUTGOING);
+    iptables_batch_chain(&batch, "mangle", CHAIN_TRUSTED);
+    iptables_batch_chain(&batch, "mangle", CHAIN_OUTGOING);
     if (got_authdown_ruleset)
-        iptables_do_command("-t mangle -F " CHAIN_AUTH_IS_DOWN);
-    iptables_do_command("-t mangle -F " CHAIN_INCOMING);
-    iptables_do_command("-t mangle -X " CHAIN_TRUSTED);
-    iptables_do_command("-t mangle -X " CHAIN_OUTGOING);
+        iptables_batch_chain(&batch, "mangle", CHAIN_AUTH_IS_DOWN);
+    iptables_batch_chain(&batch, "mangle", CHAIN_INCOMING);
+    iptables_batch_add(&batch, "mangle", "-X " CHAIN_TRUSTED);
+    iptables_batch_add(&batch, "mangle", "-X " CHAIN_OUTGOING);
     if (got_authdown_ruleset)
-        iptables_do_command("-t mangle -X " CHAIN_AUTH_IS_DOWN);
-    iptables_do_command("-t mangle -X " CHAIN_INCOMING);
+        iptables_batch_add(&batch, "mangle", "-X " CHAIN_AUTH_IS_DOWN);
+    iptables_batch_add(&batch, "mangle", "-X " CHAIN_INCOMING);
 
     /*
      *
@@ -444,22 +811,22 @@ iptables_fw_destroy(void)
      */
     debug(LOG_DEBUG, "Destroying chains in the NAT table");
     iptables_fw_destroy_mention("nat", "PREROUTING", CHAIN_OUTGOING);
-    iptables_do_command("-t nat -F " CHAIN_AUTHSERVERS);
-    iptables_do_command("-t nat -F " CHAIN_OUTGOING);
+    iptables_batch_chain(&batch, "nat", CHAIN_AUTHSERVERS);
+    iptables_batch_chain(&batch, "nat", CHAIN_OUTGOING);
     if (got_authdown_ruleset)
-        iptables_do_command("-t nat -F " CHAIN_AUTH_IS_DOWN);
-    iptables_do_command("-t nat -F " CHAIN_TO_ROUTER);
-    iptables_do_command("-t nat -F " CHAIN_TO_INTERNET);
-    iptables_do_command("-t nat -F " CHAIN_GLOBAL);
-    iptables_do_command("-t nat -F " CHAIN_UNKNOWN);
-    iptables_do_command("-t nat -X " CHAIN_AUTHSERVERS);
-    iptables_do_command("-t nat -X " CHAIN_OUTGOING);
+        iptables_batch_chain(&batch, "nat", CHAIN_AUTH_IS_DOWN);
+    iptables_batch_chain(&batch, "nat", CHAIN_TO_ROUTER);
+    iptables_batch_chain(&batch, "nat", CHAIN_TO_INTERNET);
+    iptables_batch_chain(&batch, "nat", CHAIN_GLOBAL);
+    iptables_batch_chain(&batch, "nat", CHAIN_UNKNOWN);
+    iptables_batch_add(&batch, "nat", "-X " CHAIN_AUTHSERVERS);
+    iptables_batch_add(&batch, "nat", "-X " CHAIN_OUTGOING);
     if (got_authdown_ruleset)
-        iptables_do_command("-t nat -X " CHAIN_AUTH_IS_DOWN);
-    iptables_do_command("-t nat -X " CHAIN_TO_ROUTER);
-    iptables_do_command("-t nat -X " CHAIN_TO_INTERNET);
-    iptables_do_command("-t nat -X " CHAIN_GLOBAL);
-    iptables_do_command("-t nat -X " CHAIN_UNKNOWN);
+        iptables_batch_add(&batch, "nat", "-X " CHAIN_AUTH_IS_DOWN);
+    iptables_batch_add(&batch, "nat", "-X " CHAIN_TO_ROUTER);
+    iptables_batch_add(&batch, "nat", "-X " CHAIN_TO_INTERNET);
+    iptables_batch_add(&batch, "nat", "-X " CHAIN_GLOBAL);
+    iptables_batch_add(&batch, "nat", "-X " CHAIN_UNKNOWN);
 
     /*
      *
@@ -468,30 +835,68 @@ iptables_fw_destroy(void)
      */
     debug(LOG_DEBUG, "Destroying chains in the FILTER table");
     iptables_fw_destroy_mention("filter", "FORWARD", CHAIN_TO_INTERNET);
-    iptables_do_command("-t filter -F " CHAIN_TO_INTERNET);
-    iptables_do_command("-t filter -F " CHAIN_AUTHSERVERS);
-    iptables_do_command("-t filter -F " CHAIN_LOCKED);
-    iptables_do_command("-t filter -F " CHAIN_GLOBAL);
-    iptables_do_command("-t filter -F " CHAIN_VALIDATE);
-    iptables_do_command("-t filter -F " CHAIN_KNOWN);
-    iptables_do_command("-t filter -F " CHAIN_UNKNOWN);
+    iptables_batch_chain(&batch, "filter", CHAIN_TO_INTERNET);
+    iptables_batch_chain(&batch, "filter", CHAIN_AUTHSERVERS);
+    iptables_batch_chain(&batch, "filter", CHAIN_LOCKED);
+    iptables_batch_chain(&batch, "filter", CHAIN_GLOBAL);
+    iptables_batch_chain(&batch, "filter", CHAIN_VALIDATE);
+    iptables_batch_chain(&batch, "filter", CHAIN_KNOWN);
+    iptables_batch_chain(&batch, "filter", CHAIN_UNKNOWN);
     if (got_authdown_ruleset)
-        iptables_do_command("-t filter -F " CHAIN_AUTH_IS_DOWN);
-    iptables_do_command("-t filter -X " CHAIN_TO_INTERNET);
-    iptables_do_command("-t filter -X " CHAIN_AUTHSERVERS);
-    iptables_do_command("-t filter -X " CHAIN_LOCKED);
-    iptables_do_command("-t filter -X " CHAIN_GLOBAL);
-    iptables_do_command("-t filter -X " CHAIN_VALIDATE);
-    iptables_do_command("-t filter -X " CHAIN_KNOWN);
-    iptables_do_command("-t filter -X " CHAIN_UNKNOWN);
+        iptables_batch_chain(&batch, "filter", CHAIN_AUTH_IS_DOWN);
+    iptables_batch_add(&batch, "filter", "-X " CHAIN_TO_INTERNET);
+    iptables_batch_add(&batch, "filter", "-X " CHAIN_AUTHSERVERS);
+    iptables_batch_add(&batch, "filter", "-X " CHAIN_LOCKED);
+    iptables_batch_add(&batch, "filter", "-X " CHAIN_GLOBAL);
+    iptables_batch_add(&batch, "filter", "-X " CHAIN_VALIDATE);
+    iptables_batch_add(&batch, "filter", "-X " CHAIN_KNOWN);
+    iptables_batch_add(&batch, "filter", "-X " CHAIN_UNKNOWN);
     if (got_authdown_ruleset)
-        iptables_do_command("-t filter -X " CHAIN_AUTH_IS_DOWN);
+        iptables_batch_add(&batch, "filter", "-X " CHAIN_AUTH_IS_DOWN);
+
+    iptables_batch_commit(&batch);
+
+    if (config_get_config()->fw_ipset) {
+        /* Created first so that a missing set does not stop the others */
+        sets = pstr_new();
+        for (i = 0; i < IPSET_TAGS; i++) {
+            pstr_append_sprintf(sets, "create " IPSET_OUTGOING " hash:ip,mac counters\ndestroy " IPSET_OUTGOING "\n",
+                                ipset_tags[i], ipset_tags[i]);
+            pstr_append_sprintf(sets, "create " IPSET_INCOMING " hash:ip counters\ndestroy " IPSET_INCOMING "\n",
+                                ipset_tags[i], ipset_tags[i]);
+        }
+        cmds = pstr_to_string(sets);
+        ipset_do_commands("%s", cmds);
+        free(cmds);
+    }
 
     return 1;
 }
 
+/** @internal
+ * Whether a rule specification has a word, alone or as an address
+ * followed by its mask, so that 10.0.0.5 is not found in 10.0.0.50
+ */
+static int
+iptables_spec_mentions(const char *spec, const char *word)
+{
+    const char *found;
+    size_t len = strlen(word);
+
+    for (found = strstr(spec, word); found != NULL; found = strstr(found + 1, word)) {
+        if ((found == spec || found[-1] == ' ') &&
+            (found[len] == '\0' || found[len] == ' ' || found[len] == '/'))
+            return 1;
+    }
+    return 0;
+}
+
 /*
  * Helper for iptables_fw_destroy
+ * The chain is listed once and all the matching rules are deleted in a
+ * single iptables-restore.  Rules are deleted by their specification,
+ * as listed, not by their number: the firewall worker may add and
+ * delete client rules in between.
  * @param table The table to search
  * @param chain The chain in that table to search
  * @param mention A word to find and delete in rules in the given table+chain
@@ -499,58 +904,444 @@ iptables_fw_destroy(void)
 int
 iptables_fw_destroy_mention(const char *table, const char *chain, const char *mention)
 {
+    t_iptables_batch batch;
     FILE *p = NULL;
     char *command = NULL;
-    char *command2 = NULL;
+    char *listing, *end, *spec;
     char line[MAX_BUF];
-    char rulenum[10];
+    int count = 0;
     char *victim = safe_strdup(mention);
-    int deleted = 0;
 
     iptables_insert_gateway_id(&victim);
 
     debug(LOG_DEBUG, "Attempting to destroy all mention of %s from %s.%s", victim, table, chain);
 
-    safe_asprintf(&command, "iptables -t %s -L %s -n --line-numbers -v", table, chain);
+    safe_asprintf(&command, "iptables -t %s -S %s", table, chain);
     iptables_insert_gateway_id(&command);
 
-    if ((p = popen(command, "r"))) {
-        /* Skip first 2 lines */
-        while (!feof(p) && fgetc(p) != '\n') ;
-        while (!feof(p) && fgetc(p) != '\n') ;
-        /* Loop over entries */
+    if ((p = iptables_open_output(command, &listing))) {
+        iptables_batch_init(&batch);
+        /* "-A chain spec", after the "-P" or "-N" of the chain itself */
         while (fgets(line, sizeof(line), p)) {
-            /* Look for victim */
-            if (strstr(line, victim)) {
-                /* Found victim - Get the rule number into rulenum */
-                if (sscanf(line, "%9[0-9]", rulenum) == 1) {
-                    /* Delete the rule: */
-                    debug(LOG_DEBUG, "Deleting rule %s from %s.%s because it mentions %s", rulenum, table, chain,
-                          victim);
-                    safe_asprintf(&command2, "-t %s -D %s %s", table, chain, rulenum);
-                    iptables_do_command(command2);
-                    free(command2);
-                    deleted = 1;
-                    /* Do not keep looping - the captured rulenums will no longer be accurate */
-                    break;
-                }
+            if ((end = strchr(line, '\n')) != NULL)
+                *end = '\0';
+            if (strncmp(line, "-A ", 3) == 0 && (spec = strchr(line + 3, ' ')) != NULL &&
+                iptables_spec_mentions(spec + 1, victim)) {
+                debug(LOG_DEBUG, "Deleting rule %s from %s because it mentions %s", line + 3, table, victim);
+                iptables_batch_add(&batch, table, "-D %s", line + 3);
+                count++;
             }
         }
-        pclose(p);
+        iptables_close_output(p, listing);
+        iptables_batch_commit(&batch);
     }
 
     free(command);
     free(victim);
 
-    if (deleted) {
-        /* Recurse just in case there are more in the same table+chain */
-        iptables_fw_destroy_mention(table, chain, mention);
+    return (count > 0);
+}
+
+/** @internal
+ * Adds what a client needs to the list of iptables_fw_reconcile()
+ */
+static void
+iptables_wanted_add(t_iptables_wanted_list * list, const char *ip, const char *mac, int tag, int incoming,
+                    const char *format, ...)
+{
+    t_iptables_wanted *w;
+    va_list vlist;
+
+    if (list->count == list->size) {
+        list->size = list->size ? list->size * 2 : 64;
+        list->items = safe_realloc(list->items, list->size * sizeof(t_iptables_wanted));
+    }
+    w = &list->items[list->count++];
+
+    va_start(vlist, format);
+    vsnprintf(w->key, sizeof(w->key), format, vlist);
+    va_end(vlist);
+    strcpy(w->ip, ip);
+    strcpy(w->mac, mac);
+    w->tag = tag;
+    w->incoming = incoming;
+    w->found = 0;
+}
+
+/** @internal
+ * client_list_foreach() visitor listing the rules, or ipset entries,
+ * of a client with access.  Rules are keyed "o ip mac mark" and
+ * "i ip", entries "set ip,mac" and "set ip", as found in the output of
+ * iptables-save and ipset save.
+ */
+static void
+iptables_wanted_client(t_client * client, void *arg)
+{
+    t_iptables_wanted_list *list = arg;
+    char ip[CLIENT_IP_TEXT_LEN], mac[CLIENT_MAC_TEXT_LEN], *set;
+    int tag = client->fw_connection_state;
+
+    if (tag == FW_MARK_NONE)
+        return;
+    client_ip_text(client, ip);
+    client_mac_text(client, mac);
+
+    if (!config_get_config()->fw_ipset) {
+        iptables_wanted_add(list, ip, mac, tag, 0, "o %s %s %d", ip, mac, tag);
+        iptables_wanted_add(list, ip, mac, tag, 1, "i %s", ip);
+        return;
+    }
+
+    if (!ipset_tag_known(tag))
+        return;
+    safe_asprintf(&set, IPSET_OUTGOING, tag);
+    iptables_insert_gateway_id(&set);
+    iptables_wanted_add(list, ip, mac, tag, 0, "%s %s,%s", set, ip, mac);
+    free(set);
+    safe_asprintf(&set, IPSET_INCOMING, tag);
+    iptables_insert_gateway_id(&set);
+    iptables_wanted_add(list, ip, mac, tag, 1, "%s %s", set, ip);
+    free(set);
+}
+
+/** @internal
+ * Orders t_iptables_wanted by key, MAC addresses are shown in either case
+ */
+static int
+iptables_wanted_cmp(const void *a, const void *b)
+{
+    return strcasecmp(((const t_iptables_wanted *)a)->key, ((const t_iptables_wanted *)b)->key);
+}
+
+/** @internal
+ * Looks up a key in the sorted list and marks it found.
+ * @return 1 if it is wanted and was not found before
+ */
+static int
+iptables_wanted_find(t_iptables_wanted_list * list, const char *key)
+{
+    t_iptables_wanted probe, *w;
+
+    snprintf(probe.key, sizeof(probe.key), "%s", key);
+    w = bsearch(&probe, list->items, list->count, sizeof(t_iptables_wanted), iptables_wanted_cmp);
+    if (w == NULL || w->found)
+        return 0;
+    w->found = 1;
+    return 1;
+}
+
+/** @internal
+ * The rules, or ipset entries, the reconciler added count from zero,
+ * so what their clients had so far becomes history.  The clients whose
+ * rules were kept carry on with the history they came back with.
+ */
+static void
+iptables_wanted_restart_counters(t_iptables_wanted_list * list)
+{
+    t_iptables_wanted *w;
+    t_client_shard *shard;
+    t_client *client;
+    int i;
+
+    for (i = 0; i < list->count; i++) {
+        w = &list->items[i];
+        if (w->found)
+            continue;
+        shard = client_shard_by_ip(w->ip);
+        LOCK_CLIENT_SHARD(shard);
+        if ((client = client_list_find(w->ip, w->mac)) != NULL) {
+            if (w->incoming)
+                client->counters.incoming_history = client->counters.incoming;
+            else
+                client->counters.outgoing_history = client->counters.outgoing;
+            session_store_update(client);
+        }
+        UNLOCK_CLIENT_SHARD(shard);
+    }
+}
+
+/** @internal
+ * Makes the key of a client rule shown by iptables-save, as
+ * iptables_wanted_client() does
+ * @param incoming Whether the rule is in CHAIN_INCOMING
+ * @param spec Rule without "-A chain"
+ * @return 0 if the rule is not one a client gets
+ */
+static int
+iptables_saved_client_key(int incoming, const char *spec, char *key, size_t size)
+{
+    char *copy, *word, *next, *save, ip[CLIENT_IP_TEXT_LEN] = "", mac[CLIENT_MAC_TEXT_LEN] = "";
+    char *mask;
+    int tag = -1;
+
+    copy = safe_strdup(spec);
+    for (word = strtok_r(copy, " ", &save); word != NULL; word = next) {
+        if ((next = strtok_r(NULL, " ", &save)) == NULL)
+            break;
+        if (strcmp(word, incoming ? "-d" : "-s") == 0) {
+            /* A single host is shown as ip/32 */
+            if ((mask = strchr(next, '/')) != NULL && strcmp(mask, "/32") == 0)
+                *mask = '\0';
+            snprintf(ip, sizeof(ip), "%s", next);
+        } else if (strcmp(word, "--mac-source") == 0) {
+            snprintf(mac, sizeof(mac), "%s", next);
+        } else if (strcmp(word, "--set-xmark") == 0 || strcmp(word, "--set-mark") == 0) {
+            tag = strtoul(next, NULL, 0);
+        }
+    }
+    free(copy);
+
+    if (ip[0] == '\0')
+        return 0;
+    if (incoming) {
+        snprintf(key, size, "i %s", ip);
+        return 1;
+    }
+    if (mac[0] == '\0' || tag == -1)
+        return 0;
+    snprintf(key, size, "o %s %s %d", ip, mac, tag);
+    return 1;
+}
+
+/** @internal
+ * Brings the ipsets of the clients up to date with the client list:
+ * entries in place are kept with their counters, the others are added
+ * or deleted in one ipset restore.
+ */
+static void
+iptables_reconcile_ipsets(t_iptables_wanted_list * wanted, int *kept, int *added, int *removed)
+{
+    pstr_t *cmds;
+    char *saved, *line, *save, *set, *entry, *end, key[sizeof(wanted->items[0].key)];
+    char *names[IPSET_TAGS * 2];
+    unsigned int i;
+    int j, ours;
+
+    if (subprocess_command("ipset save", NULL, &saved, 0) != 0 || saved == NULL) {
+        /* The sets exist, the clients are added again */
+        debug(LOG_WARNING, "Could not read the ipsets with ipset save");
+        free(saved);
+        saved = safe_strdup("");
+    }
+
+    for (i = 0; i < IPSET_TAGS; i++) {
+        safe_asprintf(&names[2 * i], IPSET_OUTGOING, ipset_tags[i]);
+        iptables_insert_gateway_id(&names[2 * i]);
+        safe_asprintf(&names[2 * i + 1], IPSET_INCOMING, ipset_tags[i]);
+        iptables_insert_gateway_id(&names[2 * i + 1]);
+    }
+
+    cmds = pstr_new();
+    for (line = strtok_r(saved, "\n", &save); line != NULL; line = strtok_r(NULL, "\n", &save)) {
+        /* "add set entry [packets n bytes n]" */
+        if (strncmp(line, "add ", 4) != 0)
+            continue;
+        set = line + 4;
+        if ((entry = strchr(set, ' ')) == NULL)
+            continue;
+        if ((end = strchr(entry + 1, ' ')) != NULL)
+            *end = '\0';
+        for (ours = 0, i = 0; i < IPSET_TAGS * 2; i++)
+            if (strncmp(set, names[i], entry - set) == 0 && names[i][entry - set] == '\0')
+                ours = 1;
+        if (!ours)
+            continue;
+        snprintf(key, sizeof(key), "%s", set);
+        if (iptables_wanted_find(wanted, key)) {
+            (*kept)++;
+        } else {
+            pstr_append_sprintf(cmds, "del %s\n", set);
+            (*removed)++;
+        }
+    }
+
+    for (j = 0; j < wanted->count; j++) {
+        if (!wanted->items[j].found) {
+            pstr_append_sprintf(cmds, "add %s\n", wanted->items[j].key);
+            (*added)++;
+        }
+    }
+
+    line = pstr_to_string(cmds);
+    if (line[0])
+        ipset_do_commands("%s", line);
+    free(line);
+    for (i = 0; i < IPSET_TAGS * 2; i++)
+        free(names[i]);
+    free(saved);
+}
+
+/** Brings the firewall in place to what iptables_fw_init() and the
+ * client list want, in one iptables-restore per table, instead of
+ * destroying and rebuilding it.  The current rules are read once with
+ * iptables-save.  The chains built from the configuration are reloaded
+ * as a whole, the jumps into them replaced, and chains no longer used
+ * removed.  The rules, or ipset entries, of the clients are compared one
+ * by one: only the missing ones are added and the stale ones deleted, so
+ * clients in place keep their access and their counters.  The clients
+ * that get new ones have their counters started over.
+ * @return 1 on success, 0 if the current rules could not be read
+ */
+int
+iptables_fw_reconcile(void)
+{
+    t_iptables_batch batch;
+    t_iptables_batch_table *t = NULL;
+    t_iptables_wanted_list wanted = { NULL, 0, 0 };
+    pstr_t *ours[IPTABLES_BATCH_TABLES];
+    char *saved, *ext_interface, *prefix, *outgoing, *incoming, *line, *save, *chain, *spec, *target, *decl;
+    char key[sizeof(wanted.items[0].key)];
+    int keep_clients = !config_get_config()->fw_ipset, have_outgoing = 0, have_incoming = 0;
+    int kept = 0, added = 0, removed = 0, i, j;
+    size_t len;
+
+    fw_quiet = 0;
+
+    if (subprocess_command("iptables-save", NULL, &saved, 0) != 0 || saved == NULL) {
+        debug(LOG_WARNING, "Could not read the current firewall rules with iptables-save");
+        free(saved);
+        return 0;
+    }
+
+    client_list_foreach(iptables_wanted_client, &wanted, 0);
+    qsort(wanted.items, wanted.count, sizeof(t_iptables_wanted), iptables_wanted_cmp);
+
+    LOCK_CONFIG();
+    ext_interface = iptables_ext_interface();
+
+    if (ext_interface == NULL) {
+        UNLOCK_CONFIG();
+        debug(LOG_ERR, "FATAL: no external interface");
+        free(wanted.items);
+        free(saved);
+        return 0;
+    }
+
+    prefix = safe_strdup(CHAIN_PREFIX);
+    iptables_insert_gateway_id(&prefix);
+    outgoing = safe_strdup(CHAIN_OUTGOING);
+    iptables_insert_gateway_id(&outgoing);
+    incoming = safe_strdup(CHAIN_INCOMING);
+    iptables_insert_gateway_id(&incoming);
+    len = strlen(prefix);
+
+    iptables_batch_init(&batch);
+    for (i = 0; i < IPTABLES_BATCH_TABLES; i++)
+        ours[i] = pstr_new();
+
+    /* Jumps into our chains go first, the client rules not wanted too */
+    for (line = strtok_r(saved, "\n", &save); line != NULL; line = strtok_r(NULL, "\n", &save)) {
+        if (line[0] == '*') {
+            for (t = NULL, i = 0; i < IPTABLES_BATCH_TABLES; i++)
+                if (strcmp(batch.tables[i].name, line + 1) == 0)
+                    t = &batch.tables[i];
+            continue;
+        }
+        if (t == NULL)
+            continue;
+        i = t - batch.tables;
+
+        if (line[0] == ':') {
+            /* ":chain policy [packets:bytes]" */
+            chain = line + 1;
+            if ((spec = strchr(chain, ' ')) != NULL)
+                *spec = '\0';
+            if (strncmp(chain, prefix, len) == 0)
+                pstr_append_sprintf(ours[i], "%s\n", chain);
+            continue;
+        }
+
+        if (strncmp(line, "-A ", 3) != 0 || (spec = strchr(line + 3, ' ')) == NULL)
+            continue;
+        chain = line + 3;
+
+        if (strncmp(chain, prefix, len) != 0) {
+            /* A built-in chain, the jumps are added back after */
+            if (((target = strstr(spec, " -j ")) != NULL || (target = strstr(spec, " -g ")) != NULL) &&
+                strncmp(target + 4, prefix, len) == 0)
+                iptables_batch_add(&batch, t->name, "-D %s", chain);
+            continue;
+        }
+
+        if (!keep_clients || strcmp(t->name, "mangle") != 0)
+            continue;
+        *spec = '\0';
+        if (strcmp(chain, outgoing) == 0 || strcmp(chain, incoming) == 0) {
+            if (iptables_saved_client_key(strcmp(chain, incoming) == 0, spec + 1, key, sizeof(key)) &&
+                iptables_wanted_find(&wanted, key)) {
+                kept++;
+            } else {
+                iptables_batch_add(&batch, "mangle", "-D %s %s", chain, spec + 1);
+                removed++;
+            }
+        }
+    }
+
+    iptables_batch_setup(&batch, ext_interface, 1);
+
+    /* Our chains the configuration no longer has are removed */
+    for (i = 0; i < IPTABLES_BATCH_TABLES; i++) {
+        t = &batch.tables[i];
+        for (chain = strtok_r(ours[i]->buf, "\n", &save); chain != NULL; chain = strtok_r(NULL, "\n", &save)) {
+            if (keep_clients && strcmp(t->name, "mangle") == 0 && strcmp(chain, outgoing) == 0) {
+                have_outgoing = 1;
+                continue;
+            }
+            if (keep_clients && strcmp(t->name, "mangle") == 0 && strcmp(chain, incoming) == 0) {
+                have_incoming = 1;
+                continue;
+            }
+            safe_asprintf(&decl, ":%s - [0:0]\n", chain);
+            if (strstr(t->chains->buf, decl) == NULL) {
+                debug(LOG_DEBUG, "Removing chain %s.%s, no longer used", t->name, chain);
+                iptables_batch_chain(&batch, t->name, chain);
+                iptables_batch_add(&batch, t->name, "-X %s", chain);
+            }
+            free(decl);
+        }
+        free(pstr_to_string(ours[i]));
+    }
+
+    if (keep_clients) {
+        if (!have_outgoing)
+            iptables_batch_chain(&batch, "mangle", CHAIN_OUTGOING);
+        if (!have_incoming)
+            iptables_batch_chain(&batch, "mangle", CHAIN_INCOMING);
+        for (j = 0; j < wanted.count; j++) {
+            if (wanted.items[j].found)
+                continue;
+            if (wanted.items[j].key[0] == 'o')
+                iptables_batch_add(&batch, "mangle", "-A " CHAIN_OUTGOING
+                                   " -s %s -m mac --mac-source %s -j MARK --set-mark %d", wanted.items[j].ip,
+                                   wanted.items[j].mac, wanted.items[j].tag);
+            else
+                iptables_batch_add(&batch, "mangle", "-A " CHAIN_INCOMING " -d %s -j ACCEPT", wanted.items[j].ip);
+            added++;
+        }
+    } else {
+        iptables_reconcile_ipsets(&wanted, &kept, &added, &removed);
     }
 
-    return (deleted);
+    iptables_batch_commit(&batch);
+
+    UNLOCK_CONFIG();
+
+    iptables_wanted_restart_counters(&wanted);
+
+    debug(LOG_INFO, "Reconciled the firewall: %d client entries kept, %d added, %d removed", kept, added, removed);
+
+    free(wanted.items);
+    free(prefix);
+    free(outgoing);
+    free(incoming);
+    free(ext_interface);
+    free(saved);
+    return 1;
 }
 
-/** Set if a specific client has access through the firewall */
+/** Set if a specific client has access through the firewall.  With
+ * FirewallIpset the client is added to or deleted from the sets of its
+ * mark, otherwise it gets or loses two rules of its own. */
 int
 iptables_fw_access(fw_access_t type, const char *ip, const char *mac, int tag)
 {
@@ -558,6 +1349,23 @@ iptables_fw_access(fw_access_t type, const char *ip, const char *mac, int tag)
 
     fw_quiet = 0;
 
+    if (config_get_config()->fw_ipset) {
+        if (!ipset_tag_known(tag)) {
+            debug(LOG_ERR, "No ipsets for fw_connection_state %d of %s", tag, ip);
+            return -1;
+        }
+        switch (type) {
+        case FW_ACCESS_ALLOW:
+            return ipset_do_commands("add " IPSET_OUTGOING " %s,%s\nadd " IPSET_INCOMING " %s\n", tag, ip, mac, tag,
+                                     ip);
+        case FW_ACCESS_DENY:
+            return ipset_do_commands("del " IPSET_OUTGOING " %s,%s\ndel " IPSET_INCOMING " %s\n", tag, ip, mac, tag,
+                                     ip);
+        default:
+            return -1;
+        }
+    }
+
     switch (type) {
     case FW_ACCESS_ALLOW:
         iptables_do_command("-t mangle -A " CHAIN_OUTGOING " -s %s -m mac --mac-source %s -j MARK --set-mark %d", ip,
@@ -578,6 +1386,69 @@ iptables_fw_access(fw_access_t type, const char *ip, const char *mac, int tag)
     return rc;
 }
 
+/** Set the access of several clients with one ipset or iptables-restore
+ * run, as iptables_fw_access() would one at a time.  If the run fails
+ * nothing was done, or nothing harmful with ipset -exist, and the
+ * operations are applied one at a time to find out which ones fail.
+ * @param ops The operations, applied in order, each gets its result
+ * @param count Number of operations
+ * @return 0 on success
+ */
+int
+iptables_fw_access_many(t_fw_access_op * ops, int count)
+{
+    t_iptables_batch batch;
+    pstr_t *cmds;
+    char *text;
+    const char *verb;
+    int i, rc;
+
+    fw_quiet = 0;
+
+    if (config_get_config()->fw_ipset) {
+        cmds = pstr_new();
+        for (i = 0; i < count; i++) {
+            ops[i].result = 0;
+            if (!ipset_tag_known(ops[i].tag)) {
+                debug(LOG_ERR, "No ipsets for fw_connection_state %d of %s", ops[i].tag, ops[i].ip);
+                ops[i].result = -1;
+                continue;
+            }
+            verb = ops[i].type == FW_ACCESS_ALLOW ? "add" : "del";
+            pstr_append_sprintf(cmds, "%s " IPSET_OUTGOING " %s,%s\n%s " IPSET_INCOMING " %s\n", verb, ops[i].tag,
+                                ops[i].ip, ops[i].mac, verb, ops[i].tag, ops[i].ip);
+        }
+        text = pstr_to_string(cmds);
+        rc = text[0] ? ipset_do_commands("%s", text) : 0;
+        free(text);
+    } else {
+        iptables_batch_init(&batch);
+        batch.replay = 0;
+        for (i = 0; i < count; i++) {
+            ops[i].result = 0;
+            verb = ops[i].type == FW_ACCESS_ALLOW ? "-A" : "-D";
+            iptables_batch_add(&batch, "mangle",
+                               "%s " CHAIN_OUTGOING " -s %s -m mac --mac-source %s -j MARK --set-mark %d", verb,
+                               ops[i].ip, ops[i].mac, ops[i].tag);
+            iptables_batch_add(&batch, "mangle", "%s " CHAIN_INCOMING " -d %s -j ACCEPT", verb, ops[i].ip);
+        }
+        rc = iptables_batch_commit(&batch);
+    }
+
+    for (i = 0; i < count; i++) {
+        if (ops[i].result != 0)
+            continue;
+        if (rc == 0 || rc == SUBPROCESS_NO_STATUS)
+            ops[i].result = rc;
+        else
+            ops[i].result = iptables_fw_access(ops[i].type, ops[i].ip, ops[i].mac, ops[i].tag);
+    }
+    for (rc = 0, i = 0; i < count; i++)
+        if (ops[i].result != 0)
+            rc = ops[i].result;
+    return rc;
+}
+
 int
 iptables_fw_access_host(fw_access_t type, const char *host)
 {
@@ -624,23 +1495,135 @@ iptables_fw_auth_reachable(void)
         return 1;
 }
 
+/** @internal
+ * Records the outgoing byte count the firewall has for a client
+ * @return 0 if the client is not on the list
+ */
+static int
+iptables_update_outgoing(const char *ip, unsigned long long int counter)
+{
+    t_client *p1;
+    t_client_shard *shard;
+    int found = 0;
+
+    debug(LOG_DEBUG, "Read outgoing traffic for %s: Bytes=%llu", ip, counter);
+    shard = client_shard_by_ip(ip);
+    LOCK_CLIENT_SHARD(shard);
+    if ((p1 = client_list_find_by_ip(ip))) {
+        found = 1;
+        if ((p1->counters.outgoing - p1->counters.outgoing_history) < counter) {
+            p1->counters.outgoing = p1->counters.outgoing_history + counter;
+            client_list_touch(p1, time(NULL));
+            debug(LOG_DEBUG, "%s - Updated counter.outgoing to %llu bytes.  Updated last_updated to %d", ip,
+                  counter, p1->counters.last_updated);
+        }
+    }
+    UNLOCK_CLIENT_SHARD(shard);
+    return found;
+}
+
+/** @internal
+ * Records the incoming byte count the firewall has for a client
+ * @return 0 if the client is not on the list
+ */
+static int
+iptables_update_incoming(const char *ip, unsigned long long int counter)
+{
+    t_client *p1;
+    t_client_shard *shard;
+    int found = 0;
+
+    debug(LOG_DEBUG, "Read incoming traffic for %s: Bytes=%llu", ip, counter);
+    shard = client_shard_by_ip(ip);
+    LOCK_CLIENT_SHARD(shard);
+    if ((p1 = client_list_find_by_ip(ip))) {
+        found = 1;
+        if ((p1->counters.incoming - p1->counters.incoming_history) < counter) {
+            p1->counters.incoming = p1->counters.incoming_history + counter;
+            debug(LOG_DEBUG, "%s - Updated counter.incoming to %llu bytes", ip, counter);
+        }
+    }
+    UNLOCK_CLIENT_SHARD(shard);
+    return found;
+}
+
+/** @internal
+ * Reads the per entry counters of one client ipset
+ * @param set_format IPSET_OUTGOING or IPSET_INCOMING
+ * @param tag Mark of the set
+ * @param update Where the byte counts go
+ */
+static int
+ipset_counters_update(const char *set_format, int tag, int (*update) (const char *, unsigned long long int))
+{
+    FILE *output;
+    char *set, *script, *listing, line[MAX_BUF], entry[64], ip[16], *bytes;
+    unsigned long long int counter;
+    struct in_addr tempaddr;
+
+    safe_asprintf(&set, set_format, tag);
+    iptables_insert_gateway_id(&set);
+    safe_asprintf(&script, "ipset list %s", set);
+    output = iptables_open_output(script, &listing);
+    free(script);
+    if (!output) {
+        free(set);
+        return -1;
+    }
+
+    /* Members are "ip[,mac] packets N bytes N", header lines start with a name */
+    while (fgets(line, sizeof(line), output)) {
+        if (sscanf(line, "%63s", entry) != 1 || sscanf(entry, "%15[0-9.]", ip) != 1)
+            continue;
+        if ((bytes = strstr(line, " bytes ")) == NULL || sscanf(bytes, " bytes %llu", &counter) != 1)
+            continue;
+        /* Sanity */
+        if (!inet_aton(ip, &tempaddr)) {
+            debug(LOG_WARNING, "I was supposed to read an IP address but instead got [%s] - ignoring it", ip);
+            continue;
+        }
+        if (!update(ip, counter)) {
+            debug(LOG_ERR,
+                  "iptables_fw_counters_update(): Could not find %s in client list, this should not happen unless if the gateway crashed",
+                  ip);
+            debug(LOG_ERR, "Preventively deleting %s from ipset %s", entry, set);
+            ipset_do_commands("del %s %s\n", set, entry);
+        }
+    }
+    iptables_close_output(output, listing);
+    free(set);
+
+    return 1;
+}
+
 /** Update the counters of all the clients in the client list */
 int
 iptables_fw_counters_update(void)
 {
     FILE *output;
-    char *script, ip[16], rc;
+    char *script, *listing, ip[16], rc;
     unsigned long long int counter;
-    t_client *p1;
     struct in_addr tempaddr;
+    unsigned int i;
+
+    if (config_get_config()->conntrack_counters)
+        return conntrack_counters_update();
+
+    if (config_get_config()->fw_ipset) {
+        for (i = 0; i < IPSET_TAGS; i++) {
+            if (ipset_counters_update(IPSET_OUTGOING, ipset_tags[i], iptables_update_outgoing) == -1 ||
+                ipset_counters_update(IPSET_INCOMING, ipset_tags[i], iptables_update_incoming) == -1)
+                return -1;
+        }
+        return 1;
+    }
 
     /* Look for outgoing traffic */
     safe_asprintf(&script, "%s %s", "iptables", "-v -n -x -t mangle -L " CHAIN_OUTGOING);
     iptables_insert_gateway_id(&script);
-    output = popen(script, "r");
+    output = iptables_open_output(script, &listing);
     free(script);
     if (!output) {
-        debug(LOG_ERR, "popen(): %s", strerror(errno));
         return -1;
     }
 
@@ -656,16 +1639,7 @@ iptables_fw_counters_update(void)
                 debug(LOG_WARNING, "I was supposed to read an IP address but instead got [%s] - ignoring it", ip);
                 continue;
             }
-            debug(LOG_DEBUG, "Read outgoing traffic for %s: Bytes=%llu", ip, counter);
-            LOCK_CLIENT_LIST();
-            if ((p1 = client_list_find_by_ip(ip))) {
-                if ((p1->counters.outgoing - p1->counters.outgoing_history) < counter) {
-                    p1->counters.outgoing = p1->counters.outgoing_history + counter;
-                    p1->counters.last_updated = time(NULL);
-                    debug(LOG_DEBUG, "%s - Updated counter.outgoing to %llu bytes.  Updated last_updated to %d", ip,
-                          counter, p1->counters.last_updated);
-                }
-            } else {
+            if (!iptables_update_outgoing(ip, counter)) {
                 debug(LOG_ERR,
                       "iptables_fw_counters_update(): Could not find %s in client list, this should not happen unless if the gateway crashed",
                       ip);
@@ -674,18 +1648,16 @@ iptables_fw_counters_update(void)
                 debug(LOG_ERR, "Preventively deleting firewall rules for %s in table %s", ip, CHAIN_INCOMING);
                 iptables_fw_destroy_mention("mangle", CHAIN_INCOMING, ip);
             }
-            UNLOCK_CLIENT_LIST();
         }
     }
-    pclose(output);
+    iptables_close_output(output, listing);
 
     /* Look for incoming traffic */
     safe_asprintf(&script, "%s %s", "iptables", "-v -n -x -t mangle -L " CHAIN_INCOMING);
     iptables_insert_gateway_id(&script);
-    output = popen(script, "r");
+    output = iptables_open_output(script, &listing);
     free(script);
     if (!output) {
-        debug(LOG_ERR, "popen(): %s", strerror(errno));
         return -1;
     }
 
@@ -700,14 +1672,7 @@ iptables_fw_counters_update(void)
                 debug(LOG_WARNING, "I was supposed to read an IP address but instead got [%s] - ignoring it", ip);
                 continue;
             }
-            debug(LOG_DEBUG, "Read incoming traffic for %s: Bytes=%llu", ip, counter);
-            LOCK_CLIENT_LIST();
-            if ((p1 = client_list_find_by_ip(ip))) {
-                if ((p1->counters.incoming - p1->counters.incoming_history) < counter) {
-                    p1->counters.incoming = p1->counters.incoming_history + counter;
-                    debug(LOG_DEBUG, "%s - Updated counter.incoming to %llu bytes", ip, counter);
-                }
-            } else {
+            if (!iptables_update_incoming(ip, counter)) {
                 debug(LOG_ERR,
                       "iptables_fw_counters_update(): Could not find %s in client list, this should not happen unless if the gateway crashed",
                       ip);
@@ -716,10 +1681,25 @@ iptables_fw_counters_update(void)
                 debug(LOG_ERR, "Preventively deleting firewall rules for %s in table %s", ip, CHAIN_INCOMING);
                 iptables_fw_destroy_mention("mangle", CHAIN_INCOMING, ip);
             }
-            UNLOCK_CLIENT_LIST();
         }
     }
-    pclose(output);
+    iptables_close_output(output, listing);
 
     return 1;
 }
+
+const t_fw_driver iptables_fw_driver = {
+    "iptables",
+    iptables_fw_init,
+    iptables_fw_destroy,
+    iptables_fw_reconcile,
+    iptables_fw_clear_authservers,
+    iptables_fw_set_authservers,
+    iptables_fw_access,
+    iptables_fw_access_many,
+    iptables_fw_access_host,
+    iptables_fw_auth_unreachable,
+    iptables_fw_auth_reachable,
+    iptables_fw_counters_update,
+    NULL
+};
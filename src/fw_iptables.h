@@ -46,11 +46,18 @@
 #define CHAIN_AUTH_IS_DOWN "WiFiDog_$ID$_AuthIsDown"
 /*@}*/
 
-/** Used by iptables_fw_access to select if the client should be granted of denied access */
-typedef enum fw_access_t_ {
-    FW_ACCESS_ALLOW,
-    FW_ACCESS_DENY
-} fw_access_t;
+/** Start of the names of all the chains above */
+#define CHAIN_PREFIX "WiFiDog_$ID$_"
+
+/*@{*/
+/**Ipsets of the authenticated clients with a given mark, used when
+ * FirewallIpset is set.  Names are limited to 31 characters. */
+#define IPSET_OUTGOING "WD_$ID$_Out%d"
+#define IPSET_INCOMING "WD_$ID$_In%d"
+/*@}*/
+
+/** @brief The iptables firewall driver */
+extern const t_fw_driver iptables_fw_driver;
 
 /** @brief Initialize the firewall */
 int iptables_fw_init(void);
@@ -67,9 +74,15 @@ int iptables_fw_destroy(void);
 /** @brief Helper function for iptables_fw_destroy */
 int iptables_fw_destroy_mention(const char *table, const char *chain, const char *mention);
 
+/** @brief Brings the firewall in place up to date, changing only what differs */
+int iptables_fw_reconcile(void);
+
 /** @brief Define the access of a specific client */
 int iptables_fw_access(fw_access_t type, const char *ip, const char *mac, int tag);
 
+/** @brief Define the access of several clients at once */
+int iptables_fw_access_many(t_fw_access_op *, int);
+
 /** @brief Define the access of a host */
 int iptables_fw_access_host(fw_access_t type, const char *host);
 
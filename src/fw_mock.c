@@ -0,0 +1,350 @@
+/* vim: set et sw=4 ts=4 sts=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/* $Id$ */
+/** @file fw_mock.c
+    @brief In-memory firewall driver for load tests
+
+    Selected with FirewallDriver mock.  Client grants are kept in a hash
+    table in memory instead of the kernel, so the portal and the sync
+    paths can be exercised without root or netfilter.  Every operation
+    is counted and timed; wdctl status shows the figures.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#include "safe.h"
+#include "debug.h"
+#include "pstring.h"
+#include "client_list.h"
+#include "firewall.h"
+#include "fw_mock.h"
+
+/** @internal
+ * Operations counted by the driver
+ */
+typedef enum {
+    FW_MOCK_INIT,
+    FW_MOCK_DESTROY,
+    FW_MOCK_AUTHSERVERS,
+    FW_MOCK_ALLOW,
+    FW_MOCK_DENY,
+    FW_MOCK_HOST,
+    FW_MOCK_AUTHMARK,
+    FW_MOCK_COUNTERS,
+    FW_MOCK_OPS
+} t_fw_mock_op;
+
+static const char *fw_mock_op_names[FW_MOCK_OPS] = {
+    "init", "destroy", "authservers", "allow", "deny", "host", "authmark", "counters"
+};
+
+typedef struct _t_fw_mock_stat {
+    unsigned long calls;
+    unsigned long failed;
+    unsigned long long total_ns;
+    unsigned long long max_ns;
+} t_fw_mock_stat;
+
+/** @internal
+ * A client granted access with a mark
+ */
+typedef struct _t_fw_mock_entry {
+    struct _t_fw_mock_entry *next;
+    uint32_t ip;
+    unsigned char mac[6];
+    int tag;
+} t_fw_mock_entry;
+
+#define FW_MOCK_BUCKETS 1024
+
+/** @internal
+ * Protects everything below.  Never held while taking a client shard
+ * lock, the other callers hold theirs when they come here.
+ */
+static pthread_mutex_t fw_mock_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static t_fw_mock_stat fw_mock_stats[FW_MOCK_OPS];
+static t_fw_mock_entry *fw_mock_entries[FW_MOCK_BUCKETS];
+static unsigned int fw_mock_count = 0;
+
+static unsigned long long
+fw_mock_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/** @internal
+ * Accounts for an operation that started at start.  Lock must be held.
+ */
+static void
+fw_mock_record(t_fw_mock_op op, unsigned long long start, int rc)
+{
+    t_fw_mock_stat *stat = &fw_mock_stats[op];
+    unsigned long long elapsed = fw_mock_now() - start;
+
+    stat->calls++;
+    if (rc != 0)
+        stat->failed++;
+    stat->total_ns += elapsed;
+    if (elapsed > stat->max_ns)
+        stat->max_ns = elapsed;
+}
+
+static t_fw_mock_entry **
+fw_mock_bucket(uint32_t ip)
+{
+    return &fw_mock_entries[(ntohl(ip) * 2654435761U) % FW_MOCK_BUCKETS];
+}
+
+/** @internal
+ * Forgets every grant.  Lock must be held.
+ */
+static void
+fw_mock_clear(void)
+{
+    t_fw_mock_entry *entry, *next;
+    int i;
+
+    for (i = 0; i < FW_MOCK_BUCKETS; i++) {
+        for (entry = fw_mock_entries[i]; entry != NULL; entry = next) {
+            next = entry->next;
+            free(entry);
+        }
+        fw_mock_entries[i] = NULL;
+    }
+    fw_mock_count = 0;
+}
+
+static int
+fw_mock_init(void)
+{
+    unsigned long long start = fw_mock_now();
+
+    pthread_mutex_lock(&fw_mock_mutex);
+    fw_mock_clear();
+    fw_mock_record(FW_MOCK_INIT, start, 0);
+    pthread_mutex_unlock(&fw_mock_mutex);
+    debug(LOG_WARNING, "Using the mock firewall driver, clients are NOT filtered");
+    return 1;
+}
+
+static int
+fw_mock_destroy(void)
+{
+    unsigned long long start = fw_mock_now();
+
+    pthread_mutex_lock(&fw_mock_mutex);
+    fw_mock_clear();
+    fw_mock_record(FW_MOCK_DESTROY, start, 0);
+    pthread_mutex_unlock(&fw_mock_mutex);
+    return 1;
+}
+
+static void
+fw_mock_authservers(void)
+{
+    unsigned long long start = fw_mock_now();
+
+    pthread_mutex_lock(&fw_mock_mutex);
+    fw_mock_record(FW_MOCK_AUTHSERVERS, start, 0);
+    pthread_mutex_unlock(&fw_mock_mutex);
+}
+
+/** @internal
+ * Grants or revokes, failing like iptables -D when revoking a grant
+ * that is not there.
+ */
+static int
+fw_mock_access(fw_access_t type, const char *ip, const char *mac, int tag)
+{
+    unsigned long long start = fw_mock_now();
+    t_fw_mock_entry **link, *entry;
+    uint32_t addr;
+    unsigned char hwaddr[6];
+    int rc = 1;
+
+    if (!client_parse_ip(ip, &addr) || !client_parse_mac(mac, hwaddr)) {
+        debug(LOG_ERR, "Mock firewall: bad client %s %s", ip, mac);
+        return -1;
+    }
+
+    pthread_mutex_lock(&fw_mock_mutex);
+    for (link = fw_mock_bucket(addr); (entry = *link) != NULL; link = &entry->next) {
+        if (entry->ip == addr && entry->tag == tag && memcmp(entry->mac, hwaddr, sizeof(hwaddr)) == 0)
+            break;
+    }
+    if (type == FW_ACCESS_ALLOW) {
+        if (entry == NULL) {
+            entry = safe_malloc(sizeof(t_fw_mock_entry));
+            entry->ip = addr;
+            memcpy(entry->mac, hwaddr, sizeof(hwaddr));
+            entry->tag = tag;
+            entry->next = *fw_mock_bucket(addr);
+            *fw_mock_bucket(addr) = entry;
+            fw_mock_count++;
+        }
+        rc = 0;
+    } else if (entry != NULL) {
+        *link = entry->next;
+        free(entry);
+        fw_mock_count--;
+        rc = 0;
+    }
+    fw_mock_record(type == FW_ACCESS_ALLOW ? FW_MOCK_ALLOW : FW_MOCK_DENY, start, rc);
+    pthread_mutex_unlock(&fw_mock_mutex);
+
+    return rc;
+}
+
+static int
+fw_mock_access_host(fw_access_t type, const char *host)
+{
+    unsigned long long start = fw_mock_now();
+
+    pthread_mutex_lock(&fw_mock_mutex);
+    fw_mock_record(FW_MOCK_HOST, start, 0);
+    pthread_mutex_unlock(&fw_mock_mutex);
+    return 0;
+}
+
+static int
+fw_mock_auth_unreachable(int tag)
+{
+    unsigned long long start = fw_mock_now();
+
+    pthread_mutex_lock(&fw_mock_mutex);
+    fw_mock_record(FW_MOCK_AUTHMARK, start, 0);
+    pthread_mutex_unlock(&fw_mock_mutex);
+    return 0;
+}
+
+static int
+fw_mock_auth_reachable(void)
+{
+    return fw_mock_auth_unreachable(FW_MARK_NONE);
+}
+
+/** @internal
+ * Looks every granted client up on the list, as the iptables driver
+ * does with the rules it reads, and drops the grants of unknown ones.
+ * There is no traffic, so the counters do not move.
+ */
+static int
+fw_mock_counters_update(void)
+{
+    unsigned long long start = fw_mock_now();
+    t_fw_mock_entry **link, *entry;
+    t_client_shard *shard;
+    uint32_t *ips;
+    unsigned int count = 0, i;
+    int found;
+    char ip[CLIENT_IP_TEXT_LEN];
+
+    pthread_mutex_lock(&fw_mock_mutex);
+    ips = safe_malloc((fw_mock_count + 1) * sizeof(uint32_t));
+    for (i = 0; i < FW_MOCK_BUCKETS; i++) {
+        for (entry = fw_mock_entries[i]; entry != NULL; entry = entry->next)
+            ips[count++] = entry->ip;
+    }
+    pthread_mutex_unlock(&fw_mock_mutex);
+
+    for (i = 0; i < count; i++) {
+        inet_ntop(AF_INET, &ips[i], ip, sizeof(ip));
+        shard = client_shard_by_ip(ip);
+        RDLOCK_CLIENT_SHARD(shard);
+        found = client_list_find_by_ip(ip) != NULL;
+        UNLOCK_CLIENT_SHARD(shard);
+        if (found)
+            continue;
+
+        debug(LOG_ERR, "Mock firewall: %s is granted but not on the client list, revoking", ip);
+        pthread_mutex_lock(&fw_mock_mutex);
+        for (link = fw_mock_bucket(ips[i]); (entry = *link) != NULL;) {
+            if (entry->ip == ips[i]) {
+                *link = entry->next;
+                free(entry);
+                fw_mock_count--;
+            } else {
+                link = &entry->next;
+            }
+        }
+        pthread_mutex_unlock(&fw_mock_mutex);
+    }
+    free(ips);
+
+    pthread_mutex_lock(&fw_mock_mutex);
+    fw_mock_record(FW_MOCK_COUNTERS, start, 0);
+    pthread_mutex_unlock(&fw_mock_mutex);
+    return 1;
+}
+
+/** @internal
+ * Operation counts and latencies, for wdctl status
+ */
+static char *
+fw_mock_status(void)
+{
+    pstr_t *pstr = pstr_new();
+    t_fw_mock_stat *stat;
+    int op;
+
+    pthread_mutex_lock(&fw_mock_mutex);
+    pstr_append_sprintf(pstr, "Mock firewall: %u grants\n", fw_mock_count);
+    for (op = 0; op < FW_MOCK_OPS; op++) {
+        stat = &fw_mock_stats[op];
+        if (stat->calls == 0)
+            continue;
+        pstr_append_sprintf(pstr, "  %s: %lu calls, %lu failed, %.1fus avg, %.1fus max\n", fw_mock_op_names[op],
+                            stat->calls, stat->failed, stat->total_ns / 1000.0 / stat->calls, stat->max_ns / 1000.0);
+    }
+    pthread_mutex_unlock(&fw_mock_mutex);
+
+    return pstr_to_string(pstr);
+}
+
+const t_fw_driver mock_fw_driver = {
+    "mock",
+    fw_mock_init,
+    fw_mock_destroy,
+    NULL,
+    fw_mock_authservers,
+    fw_mock_authservers,
+    fw_mock_access,
+    NULL,
+    fw_mock_access_host,
+    fw_mock_auth_unreachable,
+    fw_mock_auth_reachable,
+    fw_mock_counters_update,
+    fw_mock_status
+};
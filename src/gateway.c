@@ -58,8 +58,13 @@
 #include "wdctl_thread.h"
 #include "ping_thread.h"
 #include "httpd_thread.h"
+#include "restart.h"
+#include "session_store.h"
+#include "subprocess.h"
 #include "util.h"
 
+#include "../config.h"
+
 /** XXX Ugly hack 
  * We need to remember the thread IDs of threads that simulate wait with pthread_cond_timedwait
  * so we can explicitly kill them in the termination handler
@@ -72,6 +77,10 @@ time_t started_time = 0;
 /* The internal web server */
 httpd * webserver = NULL;
 
+/* All listen sockets of the web server, webserver is the first one */
+httpd **webservers = NULL;
+int webserver_count = 0;
+
 /* Appends -x, the current PID, and NULL to restartargv
  * see parse_commandline in commandline.c for details
  *
@@ -89,147 +98,6 @@ append_x_restartargv(void)
     safe_asprintf(&(restartargv[i++]), "%d", getpid());
 }
 
-/* @internal
- * @brief During gateway restart, connects to the parent process via the internal socket
- * Downloads from it the active client list
- */
-void
-get_clients_from_parent(void)
-{
-    int sock;
-    struct sockaddr_un sa_un;
-    s_config *config = NULL;
-    char linebuffer[MAX_BUF];
-    int len = 0;
-    char *running1 = NULL;
-    char *running2 = NULL;
-    char *token1 = NULL;
-    char *token2 = NULL;
-    char onechar;
-    char *command = NULL;
-    char *key = NULL;
-    char *value = NULL;
-    t_client *client = NULL;
-
-    config = config_get_config();
-
-    debug(LOG_INFO, "Connecting to parent to download clients");
-
-    /* Connect to socket */
-    sock = socket(AF_UNIX, SOCK_STREAM, 0);
-    /* XXX An attempt to quieten coverity warning about the subsequent connect call:
-     * Coverity says: "sock is apssed to parameter that cannot be negative"
-     * Although connect expects a signed int, coverity probably tells us that it shouldn't
-     * be negative */
-    if (sock < 0) {
-        debug(LOG_ERR, "Could not open socket (%s) - client list not downloaded", strerror(errno));
-        return;
-    }
-    memset(&sa_un, 0, sizeof(sa_un));
-    sa_un.sun_family = AF_UNIX;
-    strncpy(sa_un.sun_path, config->internal_sock, (sizeof(sa_un.sun_path) - 1));
-
-    if (connect(sock, (struct sockaddr *)&sa_un, strlen(sa_un.sun_path) + sizeof(sa_un.sun_family))) {
-        debug(LOG_ERR, "Failed to connect to parent (%s) - client list not downloaded", strerror(errno));
-        close(sock);
-        return;
-    }
-
-    debug(LOG_INFO, "Connected to parent.  Downloading clients");
-
-    LOCK_CLIENT_LIST();
-
-    command = NULL;
-    memset(linebuffer, 0, sizeof(linebuffer));
-    len = 0;
-    client = NULL;
-    /* Get line by line */
-    while (read(sock, &onechar, 1) == 1) {
-        if (onechar == '\n') {
-            /* End of line */
-            onechar = '\0';
-        }
-        linebuffer[len++] = onechar;
-
-        if (!onechar) {
-            /* We have a complete entry in linebuffer - parse it */
-            debug(LOG_DEBUG, "Received from parent: [%s]", linebuffer);
-            running1 = linebuffer;
-            while ((token1 = strsep(&running1, "|")) != NULL) {
-                if (!command) {
-                    /* The first token is the command */
-                    command = token1;
-                } else {
-                    /* Token1 has something like "foo=bar" */
-                    running2 = token1;
-                    key = value = NULL;
-                    while ((token2 = strsep(&running2, "=")) != NULL) {
-                        if (!key) {
-                            key = token2;
-                        } else if (!value) {
-                            value = token2;
-                        }
-                    }
-                }
-
-                if (strcmp(command, "CLIENT") == 0) {
-                    /* This line has info about a client in the client list */
-                    if (NULL == client) {
-                        /* Create a new client struct */
-                        client = client_get_new();
-                    }
-                }
-
-                /* XXX client check to shut up clang... */
-                if (key && value && client) {
-                    if (strcmp(command, "CLIENT") == 0) {
-                        /* Assign the key into the appropriate slot in the connection structure */
-                        if (strcmp(key, "ip") == 0) {
-                            client->ip = safe_strdup(value);
-                        } else if (strcmp(key, "mac") == 0) {
-                            client->mac = safe_strdup(value);
-                        } else if (strcmp(key, "token") == 0) {
-                            client->token = safe_strdup(value);
-                        } else if (strcmp(key, "fw_connection_state") == 0) {
-                            client->fw_connection_state = atoi(value);
-                        } else if (strcmp(key, "fd") == 0) {
-                            client->fd = atoi(value);
-                        } else if (strcmp(key, "counters_incoming") == 0) {
-                            client->counters.incoming_history = (unsigned long long)atoll(value);
-                            client->counters.incoming = client->counters.incoming_history;
-                        } else if (strcmp(key, "counters_outgoing") == 0) {
-                            client->counters.outgoing_history = (unsigned long long)atoll(value);
-                            client->counters.outgoing = client->counters.outgoing_history;
-                        } else if (strcmp(key, "counters_last_updated") == 0) {
-                            client->counters.last_updated = atol(value);
-                        } else {
-                            debug(LOG_NOTICE, "I don't know how to inherit key [%s] value [%s] from parent", key,
-                                  value);
-                        }
-                    }
-                }
-            }
-
-            /* End of parsing this command */
-            if (client) {
-                client->auth_type = normal_auth_type;
-                client_list_insert_client(client);
-            }
-
-            /* Clean up */
-            command = NULL;
-            memset(linebuffer, 0, sizeof(linebuffer));
-            len = 0;
-            client = NULL;
-        }
-    }
-
-    UNLOCK_CLIENT_LIST();
-    debug(LOG_INFO, "Client list downloaded successfully from parent");
-
-    close(sock);
-}
-
 /**@internal
  * @brief Handles SIGCHLD signals to avoid zombie processes
  *
@@ -245,7 +113,9 @@ sigchld_handler(int s)
 
     debug(LOG_DEBUG, "Handler for SIGCHLD called. Trying to reap a child");
 
-    rc = waitpid(-1, &status, WNOHANG);
+    /* Only our own process group: the programs started by
+     * subprocess_run() have their own and are waited for there */
+    rc = waitpid(0, &status, WNOHANG);
 
     debug(LOG_DEBUG, "Handler for SIGCHLD reaped child PID %d", rc);
 }
@@ -270,8 +140,12 @@ termination_handler(int s)
         debug(LOG_INFO, "Cleaning up and exiting");
     }
 
-    debug(LOG_INFO, "Flushing firewall rules...");
-    fw_destroy();
+    if (restart_handed_off) {
+        debug(LOG_INFO, "Leaving the firewall rules to the new process");
+    } else {
+        debug(LOG_INFO, "Flushing firewall rules...");
+        fw_destroy();
+    }
 
     /* XXX Hack
      * Aparently pthread_cond_timedwait under openwrt prevents signals (and therefore
@@ -344,17 +218,72 @@ init_signals(void)
     }
 }
 
+/**@internal
+ * Accepts connections on one listen socket and hands them to the
+ * worker threads.  Runs in the main thread for the first listener and
+ * in a thread of its own for every other one.  Never returns.
+ */
+static void
+thread_httpd_listener(void *arg)
+{
+    httpd *server = (httpd *) arg;
+    request *r;
+
+#ifdef HAVE_SYS_EPOLL_H
+    if (config_get_config()->httpdeventloop) {
+        /* Only returns on error */
+        httpdEventLoop(server, httpd_pool_dispatch);
+        debug(LOG_ERR, "FATAL: httpdEventLoop returned error %d, exiting.", server->lastError);
+        termination_handler(0);
+    }
+#endif
+    while (1) {
+        r = httpdGetConnection(server, NULL);
+
+        /* We can't convert this to a switch because there might be
+         * values that are not -1, 0 or 1. */
+        if (server->lastError == -5) {
+            /* httpd_listeners_stop(), the socket is someone else's now */
+            debug(LOG_INFO, "Stopped accepting connections on listen socket %d", server->serverSock);
+            pthread_exit(NULL);
+        } else if (server->lastError == -1) {
+            /* Interrupted system call */
+            if (NULL != r) {
+                httpdEndRequest(r);
+            }
+        } else if (server->lastError < -1) {
+            /*
+             * FIXME
+             * An error occurred - should we abort?
+             * reboot the device ?
+             */
+            debug(LOG_ERR, "FATAL: httpdGetConnection returned unexpected value %d, exiting.", server->lastError);
+            termination_handler(0);
+        } else if (r != NULL) {
+            /*
+             * We got a connection
+             *
+             * Queue it for the worker threads
+             */
+            debug(LOG_INFO, "Received connection from %s, queueing for a worker thread", r->clientAddr);
+            httpd_pool_dispatch(r);
+        } else {
+            /* server->lastError should be 2 */
+            /* XXX We failed an ACL.... No handling because
+             * we don't set any... */
+        }
+    }
+}
+
 /**@internal
  * Main execution loop 
  */
 static void
 main_loop(void)
 {
-    int result;
+    int result, i, sock;
     pthread_t tid;
     s_config *config = config_get_config();
-    request *r;
-    void **params;
 
     /* Set the time when wifidog started */
     if (!started_time) {
@@ -395,13 +324,24 @@ main_loop(void)
         debug(LOG_DEBUG, "gw_mac %s = %s", config->gw_interface, config->gw_mac);
     }
 
+    /* Forked while this process is still small and has a single thread */
+    if (config->fw_helper && subprocess_helper_start() != 0)
+        debug(LOG_WARNING, "Could not start the command helper, commands will be run directly");
+
     /* Initializes the web server */
     debug(LOG_NOTICE, "Creating web server on %s:%d", config->gw_address, config->gw_port);
-    if ((webserver = httpdCreate(config->gw_address, config->gw_port)) == NULL) {
+    if ((sock = restart_listener(0)) >= 0)
+        webserver = httpdCreateFromSocket(config->gw_address, config->gw_port, sock);
+    else if (config->httpdacceptors > 1)
+        webserver = httpdCreateReusePort(config->gw_address, config->gw_port);
+    else
+        webserver = httpdCreate(config->gw_address, config->gw_port);
+    if (webserver == NULL) {
         debug(LOG_ERR, "Could not create web server: %s", strerror(errno));
         exit(1);
     }
     register_fd_cleanup_on_fork(webserver->serverSock);
+    httpdSetKeepAlive(webserver, config->httpdkeepalive, config->httpdkeepalivemax);
     debug(LOG_DEBUG, "Assigning callbacks to web server");
     httpdAddCContent(webserver, "/", "wifidog", 0, NULL, http_callback_wifidog);
     httpdAddCContent(webserver, "/wifidog", "", 0, NULL, http_callback_wifidog);
@@ -414,14 +354,18 @@ main_loop(void)
 
     httpdSetErrorFunction(webserver, 404, http_callback_404);
 
-    /* Reset the firewall (if WiFiDog crashed) */
-    fw_destroy();
-    /* Then initialize it */
+    /* Reconcile the firewall with the clients, or reset it, unless we took it over from a restart */
     if (!fw_init()) {
         debug(LOG_ERR, "FATAL: Failed to initialize firewall");
         exit(1);
     }
-    fw_allow_host("wifi.weixin.qq.com");
+    if (!restart_fw_kept)
+        fw_allow_host("wifi.weixin.qq.com");
+    /* Client logins and logouts no longer wait for the firewall */
+    if (fw_queue_start() != 0) {
+        debug(LOG_ERR, "FATAL: Failed to create a new thread (firewall) - exiting");
+        termination_handler(0);
+    }
     /* Start clean up thread */
     result = pthread_create(&tid_fw_counter, NULL, (void *)thread_client_timeout_check, NULL);
     if (result != 0) {
@@ -446,54 +390,69 @@ main_loop(void)
     }
     pthread_detach(tid_ping);
 
-    debug(LOG_NOTICE, "Waiting for connections");
-    while (1) {
-        r = httpdGetConnection(webserver, NULL);
+    /* Start the web server workers */
+    if (httpd_pool_init(webserver, config->httpdthreads, config->httpdqueuesize, config->httpdoverloadpolicy) != 0) {
+        debug(LOG_ERR, "FATAL: Failed to create the httpd worker threads - exiting");
+        termination_handler(0);
+    }
 
-        /* We can't convert this to a switch because there might be
-         * values that are not -1, 0 or 1. */
-        if (webserver->lastError == -1) {
-            /* Interrupted system call */
-            if (NULL != r) {
-                httpdEndRequest(r);
-            }
-        } else if (webserver->lastError < -1) {
-            /*
-             * FIXME
-             * An error occurred - should we abort?
-             * reboot the device ?
-             */
-            debug(LOG_ERR, "FATAL: httpdGetConnection returned unexpected value %d, exiting.", webserver->lastError);
+    /* Open the extra listen sockets now that the content is set up */
+    webservers = safe_malloc(config->httpdacceptors * sizeof(httpd *));
+    webservers[0] = webserver;
+    webserver_count = 1;
+    while (webserver_count < config->httpdacceptors) {
+        httpd *listener;
+
+        if ((sock = restart_listener(webserver_count)) >= 0)
+            listener = httpdAddListenerFromSocket(webserver, sock);
+        else
+            listener = httpdAddListener(webserver);
+        if (listener == NULL) {
+            debug(LOG_WARNING, "Could not open HTTP listener %d: %s, continuing with %d",
+                  webserver_count, strerror(errno), webserver_count);
+            break;
+        }
+        register_fd_cleanup_on_fork(listener->serverSock);
+        webservers[webserver_count++] = listener;
+    }
+    restart_close_listeners(webserver_count);
+    for (i = 1; i < webserver_count; i++) {
+        result = pthread_create(&tid, NULL, (void *)thread_httpd_listener, (void *)webservers[i]);
+        if (result != 0) {
+            debug(LOG_ERR, "FATAL: Failed to create a new thread (httpd listener) - exiting");
             termination_handler(0);
-        } else if (r != NULL) {
-            /*
-             * We got a connection
-             *
-             * We should create another thread
-             */
-            debug(LOG_INFO, "Received connection from %s, spawning worker thread", r->clientAddr);
-            /* The void**'s are a simulation of the normal C
-             * function calling sequence. */
-            params = safe_malloc(2 * sizeof(void *));
-            *params = webserver;
-            *(params + 1) = r;
-
-            result = pthread_create(&tid, NULL, (void *)thread_httpd, (void *)params);
-            if (result != 0) {
-                debug(LOG_ERR, "FATAL: Failed to create a new thread (httpd) - exiting");
-                termination_handler(0);
-            }
-            pthread_detach(tid);
-        } else {
-            /* webserver->lastError should be 2 */
-            /* XXX We failed an ACL.... No handling because
-             * we don't set any... */
         }
+        pthread_detach(tid);
     }
 
+    debug(LOG_NOTICE, "Waiting for connections on %d listener(s)", webserver_count);
+    thread_httpd_listener(webserver);
     /* never reached */
 }
 
+/** Stops accepting connections on every listen socket.  New
+ * connections stay in the listen queues, for instance for a restarted
+ * wifidog that takes the sockets over, and the ones already accepted
+ * are still served.
+ * @return 0 once no listener accepts any more, -1 if some did not stop
+ * within a few seconds
+ */
+int
+httpd_listeners_stop(void)
+{
+    int i, tries;
+
+    for (i = 0; i < webserver_count; i++)
+        httpdStopAccepting(webservers[i]);
+    for (tries = 0; tries < 30; tries++) {
+        for (i = 0; i < webserver_count && webservers[i]->acceptState == HTTP_ACCEPT_STOPPED; i++) ;
+        if (i == webserver_count)
+            return 0;
+        usleep(100000);
+    }
+    return -1;
+}
+
 /** Reads the configuration file and then starts the main loop */
 int
 gw_main(int argc, char **argv)
@@ -518,12 +477,13 @@ gw_main(int argc, char **argv)
         /*
          * We were restarted and our parent is waiting for us to talk to it over the socket
          */
-        get_clients_from_parent();
+        restart_receive_state();
 
         /*
-         * At this point the parent will start destroying itself and the firewall. Let it finish it's job before we continue
+         * At this point the parent will start destroying itself and the firewall. Let it finish it's job before we continue.
+         * There is nothing to wait for when we took over its firewall.
          */
-        while (kill(restart_orig_pid, 0) != -1) {
+        while (!restart_fw_kept && kill(restart_orig_pid, 0) != -1) {
             debug(LOG_INFO, "Waiting for parent PID %d to die before continuing loading", restart_orig_pid);
             sleep(1);
         }
@@ -531,6 +491,10 @@ gw_main(int argc, char **argv)
         debug(LOG_INFO, "Parent PID %d seems to be dead. Continuing loading.");
     }
 
+    /* Clients kept across a crash or reboot, their rules are restored by fw_init() */
+    if (config->session_store)
+        session_store_open(config->session_store);
+
     if (config->daemon) {
 
         debug(LOG_INFO, "Forking into background");
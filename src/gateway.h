@@ -37,6 +37,13 @@ extern time_t started_time;
 /** @brief The internal web server */
 extern httpd *webserver;
 
+/** @brief All listen sockets of the web server, see HTTPDAcceptors */
+extern httpd **webservers;
+extern int webserver_count;
+
+/** @brief Stops accepting connections on all listen sockets */
+int httpd_listeners_stop(void);
+
 /** @brief actual program entry point. */
 int gw_main(int, char **);
 
@@ -38,8 +38,10 @@
 #include <syslog.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <ctype.h>
 
 #include "httpd.h"
 
@@ -164,13 +166,229 @@ extend_arg_t parseExtend(const char* extend_arg_src) {
     return ret;
 }
 
+/** @internal
+ * Connectivity checks sent by operating systems and browsers when they
+ * join a network.  Every new client sends several of them, so they are
+ * answered without the ARP lookup of the generic 404 handler.
+ */
+typedef struct {
+    const char *host;           /**< @brief Host the check goes to, NULL if only the path identifies it */
+    const char *path;
+    const char *response;       /**< @brief What an open network answers... */
+    const char *content_type;
+    const char *body;           /**< @brief ...and with which body */
+} t_portal_probe;
+
+#define PROBE_APPLE_SUCCESS "<HTML><HEAD><TITLE>Success</TITLE></HEAD><BODY>Success</BODY></HTML>"
+
+static const t_portal_probe portal_probes[] = {
+    {NULL, "/generate_204", "204 No Content\n", "text/plain", ""},
+    {NULL, "/gen_204", "204 No Content\n", "text/plain", ""},
+    {NULL, "/hotspot-detect.html", "200 OK\n", "text/html", PROBE_APPLE_SUCCESS},
+    {NULL, "/library/test/success.html", "200 OK\n", "text/html", PROBE_APPLE_SUCCESS},
+    {NULL, "/connecttest.txt", "200 OK\n", "text/plain", "Microsoft Connect Test"},
+    {NULL, "/ncsi.txt", "200 OK\n", "text/plain", "Microsoft NCSI"},
+    {"detectportal.firefox.com", "/success.txt", "200 OK\n", "text/plain", "success\n"},
+    {NULL, NULL, NULL, NULL, NULL}
+};
+
+/** @internal
+ * The parts of the auth server URLs that only depend on the
+ * configuration and the current auth server, rendered and encoded
+ * once.  They are rebuilt when a different auth server becomes the
+ * current one.
+ */
+static struct {
+    t_auth_serv *auth_server;
+    char *base;                 /**< @brief protocol://host:port/path/ */
+    char *login;                /**< @brief Login URL up to and including "ip=" */
+    char *wx_args;              /**< @brief authurl and extend arguments of the WeChat flow */
+} login_url;
+
+static pthread_mutex_t login_url_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/** @internal Must be called with login_url_mutex held */
+static void
+login_url_update(void)
+{
+    const s_config *config = config_get_config();
+    t_auth_serv *auth_server = get_auth_server();
+    char *authurl, *extend, *tmp;
+
+    if (login_url.auth_server == auth_server)
+        return;
+    free(login_url.base);
+    free(login_url.login);
+    free(login_url.wx_args);
+
+    safe_asprintf(&login_url.base, "%s://%s:%d%s",
+                  auth_server->authserv_use_ssl ? "https" : "http", auth_server->authserv_hostname,
+                  auth_server->authserv_use_ssl ? auth_server->authserv_ssl_port : auth_server->authserv_http_port,
+                  auth_server->authserv_path);
+    safe_asprintf(&login_url.login, "%s%sgw_address=%s&gw_port=%d&gw_id=%s&gw_mac=%s&ip=",
+                  login_url.base, auth_server->authserv_login_script_path_fragment,
+                  config->gw_address, config->gw_port, config->gw_id, config->gw_mac);
+
+    safe_asprintf(&tmp, "http://%s:%d/wifidog/wx_auth", config->gw_address, config->gw_port);
+    authurl = httpdUrlEncode(tmp);
+    extend = httpdUrlEncode("extend_msg_for_wifi_dog_from_qscan");
+    safe_asprintf(&login_url.wx_args, "&authurl=%s&extend=%s", authurl, extend);
+    free(tmp);
+    free(authurl);
+    free(extend);
+
+    login_url.auth_server = auth_server;
+    debug(LOG_DEBUG, "Login URL is now %s...", login_url.login);
+}
+
+/** @internal
+ * Builds the login URL for a client
+ * @param ip The client's IP address
+ * @param mac The client's MAC address, NULL if unknown
+ * @param url The URL the client asked for, already encoded
+ * @param req_src wx_req for the WeChat flow
+ * @return The URL, to be freed by the caller
+ */
+static char *
+login_url_get(const char *ip, const char *mac, const char *url, int req_src)
+{
+    char *result;
+
+    pthread_mutex_lock(&login_url_mutex);
+    login_url_update();
+    safe_asprintf(&result, "%s%s%s%s&url=%s%s", login_url.login, ip, mac ? "&mac=" : "", mac ? mac : "", url,
+                  req_src == wx_req ? login_url.wx_args : "");
+    pthread_mutex_unlock(&login_url_mutex);
+    return result;
+}
+
+/** @internal
+ * Lets a client through to a host of the global ruleset, or one of its
+ * subdomains, whose address was not known when the rules were set up.
+ * @param tmp_url The URL the client asked for, it is sent back there
+ * @return 1 if the host is whitelisted and the client was redirected
+ */
+static int
+http_redirect_whitelisted(request * r, const char *tmp_url)
+{
+    t_firewall_rule *rule;
+
+    debug(LOG_INFO, "Check host %s is in whitelist or not", r->request.host);   // e.g. www.example.com
+    //e.g. example.com is in whitelist
+    // if request http://www.example.com/, it's not equal example.com.
+    for (rule = get_ruleset("global"); rule != NULL; rule = rule->next) {
+        debug(LOG_INFO, "rule mask %s", rule->mask);
+        if (strstr(r->request.host, rule->mask) == NULL) {
+            debug(LOG_INFO, "host %s is not in %s, continue", r->request.host, rule->mask);
+            continue;
+        }
+        int host_length = strlen(r->request.host);
+        int mask_length = strlen(rule->mask);
+        if (host_length > mask_length) {
+            char prefix[host_length + 1];
+            // must be *.example.com, if not have ".", maybe Phishing. e.g. phishingexample.com
+            // e.g. www + . + example.com
+            snprintf(prefix, sizeof(prefix), "%.*s.%s", host_length - mask_length - 1, r->request.host, rule->mask);
+            if (strcasecmp(r->request.host, prefix) == 0) {
+                debug(LOG_INFO, "allow subdomain");
+                fw_allow_host(r->request.host);
+                http_send_redirect(r, tmp_url, "allow subdomain");
+                return 1;
+            }
+        } else {
+            // e.g. "example.com" is in conf, so it had been parse to IP and added into "iptables allow" when wifidog start. but then its' A record(IP) changed, it will go to here.
+            debug(LOG_INFO, "allow domain again, because IP changed");
+            fw_allow_host(r->request.host);
+            http_send_redirect(r, tmp_url, "allow domain");
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static const t_portal_probe *
+http_find_probe(request * r)
+{
+    const t_portal_probe *probe;
+    const char *host = r->request.host;
+    size_t len;
+
+    for (probe = portal_probes; probe->path != NULL; probe++) {
+        if (strcmp(r->request.path, probe->path) != 0)
+            continue;
+        if (probe->host == NULL)
+            return probe;
+        /* The Host header may carry a port */
+        len = strlen(probe->host);
+        if (strncasecmp(host, probe->host, len) == 0 && (host[len] == 0 || host[len] == ':'))
+            return probe;
+    }
+    return NULL;
+}
+
+/** @internal
+ * Answers a connectivity check.  Clients that already have access get
+ * what the check expects, everyone else a plain redirect to the login
+ * page.
+ * @return 1 if the request was answered, 0 if it must take the
+ * generic path
+ */
+static int
+http_send_probe_response(request * r)
+{
+    const t_portal_probe *probe;
+    t_client *client;
+    t_client_shard *shard;
+    struct iovec iov;
+    char tmp_url[MAX_BUF], *url, *header, *location;
+    int authenticated = 0;
+
+    if ((probe = http_find_probe(r)) == NULL)
+        return 0;
+    /* The apology pages are still served the usual way */
+    if (!is_online() || !is_auth_online())
+        return 0;
+
+    shard = client_shard_by_ip(r->clientAddr);
+    RDLOCK_CLIENT_SHARD(shard);
+    client = client_list_find_by_ip(r->clientAddr);
+    if (client && (client->fw_connection_state == FW_MARK_KNOWN || client->fw_connection_state == FW_MARK_PROBATION))
+        authenticated = 1;
+    UNLOCK_CLIENT_SHARD(shard);
+
+    if (authenticated) {
+        debug(LOG_DEBUG, "Answering connectivity check %s%s from authenticated client %s",
+              r->request.host, r->request.path, r->clientAddr);
+        httpdSetResponse(r, probe->response);
+        httpdSetContentType(r, probe->content_type);
+        iov.iov_base = (void *)probe->body;
+        iov.iov_len = strlen(probe->body);
+        httpdWritev(r, &iov, 1);
+        return 1;
+    }
+
+    snprintf(tmp_url, sizeof(tmp_url), "http://%s%s%s%s",
+             r->request.host, r->request.path, r->request.query[0] ? "?" : "", r->request.query);
+    if (http_redirect_whitelisted(r, tmp_url))
+        return 1;
+    url = httpdUrlEncode(tmp_url);
+    location = login_url_get(r->clientAddr, NULL, url, normal_req);
+    debug(LOG_INFO, "Captured connectivity check %s from %s, re-directing to login page", tmp_url, r->clientAddr);
+    safe_asprintf(&header, "Location: %s", location);
+    httpdSetResponse(r, "302 Redirect to login page\n");
+    httpdAddHeader(r, header);
+    httpdPrintf(r, "Please <a href='%s'>click here</a>.", location);
+    free(header);
+    free(location);
+    free(url);
+    return 1;
+}
+
 /** The 404 handler is also responsible for redirecting to the auth server */
 void
 http_callback_404(httpd * webserver, request * r, int error_code)
 {
     char tmp_url[MAX_BUF], *url, *mac;
-    s_config *config = config_get_config();
-    t_auth_serv *auth_server = get_auth_server();
     debug(LOG_INFO, "http_callback_404 ua:%s", r->request.user_agent);
     memset(tmp_url, 0, sizeof(tmp_url));
     int req_src = normal_req;
@@ -182,6 +400,8 @@ http_callback_404(httpd * webserver, request * r, int error_code)
             debug(LOG_INFO, "Is wx req.");
         }
     }
+    if (req_src == normal_req && http_send_probe_response(r))
+        return;
     
     /* 
      * XXX Note the code below assumes that the client's request is a plain
@@ -219,88 +439,24 @@ http_callback_404(httpd * webserver, request * r, int error_code)
               r->clientAddr);
     } else {
          /* Re-direct them to auth server */
-        char *urlFragment;
+        char *location;
+        // if host is not in whitelist, maybe not in conf or domain'IP changed, it will go to here.
+        if (http_redirect_whitelisted(r, tmp_url)) {
+            free(url);
+            return;
+        }
         if (!(mac = arp_get(r->clientAddr))) {
             /* We could not get their MAC address */
             debug(LOG_INFO, "Failed to retrieve MAC address for ip %s, so not putting in the login request",
                   r->clientAddr);
-            if (req_src == wx_req) {
-                char *authurl_temp;
-                safe_asprintf(&authurl_temp, "http://%s:%d/wifidog/wx_auth", config->gw_address, config->gw_port);
-                char *authurl = httpdUrlEncode(authurl_temp);
-                free(authurl_temp);
-                char *extend = httpdUrlEncode("extend_msg_for_wifi_dog_from_qscan");
-                safe_asprintf(&urlFragment, "%sgw_address=%s&gw_port=%d&gw_id=%s&gw_mac=%s&ip=%s&url=%s&authurl=%s&extend=%s",
-                                  auth_server->authserv_login_script_path_fragment, config->gw_address, config->gw_port,
-                                  config->gw_id, config->gw_mac, r->clientAddr, url, authurl, extend);
-                free(authurl);
-                free(extend);
-            } else {
-                safe_asprintf(&urlFragment, "%sgw_address=%s&gw_port=%d&gw_id=%s&gw_mac=%s&ip=%s&url=%s",
-                              auth_server->authserv_login_script_path_fragment, config->gw_address, config->gw_port,
-                              config->gw_id, config->gw_mac, r->clientAddr, url);
-            }
         } else {
             debug(LOG_INFO, "Got client MAC address for ip %s: %s", r->clientAddr, mac);
-            if (req_src == wx_req) {
-                char *authurl_temp;
-                safe_asprintf(&authurl_temp, "http://%s:%d/wifidog/wx_auth", config->gw_address, config->gw_port);
-                char *authurl = httpdUrlEncode(authurl_temp);
-                free(authurl_temp);
-                char *extend = httpdUrlEncode("extend_msg_for_wifi_dog_from_qscan");
-                safe_asprintf(&urlFragment, "%sgw_address=%s&gw_port=%d&gw_id=%s&gw_mac=%s&ip=%s&mac=%s&url=%s&authurl=%s&extend=%s",
-                              auth_server->authserv_login_script_path_fragment,
-                              config->gw_address, config->gw_port, config->gw_id, config->gw_mac, r->clientAddr, mac, url, 
-                              authurl, extend);
-                free(authurl);
-                free(extend);
-            } else {
-                safe_asprintf(&urlFragment, "%sgw_address=%s&gw_port=%d&gw_id=%s&gw_mac=%s&ip=%s&mac=%s&url=%s",
-                              auth_server->authserv_login_script_path_fragment,
-                              config->gw_address, config->gw_port, config->gw_id, config->gw_mac, r->clientAddr, mac, url);
-            }
-            free(mac);
-        }
-        // if host is not in whitelist, maybe not in conf or domain'IP changed, it will go to here.
-        debug(LOG_INFO, "Check host %s is in whitelist or not", r->request.host);       // e.g. www.example.com
-        t_firewall_rule *rule;
-        //e.g. example.com is in whitelist
-        // if request http://www.example.com/, it's not equal example.com.
-        for (rule = get_ruleset("global"); rule != NULL; rule = rule->next) {
-            debug(LOG_INFO, "rule mask %s", rule->mask);
-            if (strstr(r->request.host, rule->mask) == NULL) {
-                debug(LOG_INFO, "host %s is not in %s, continue", r->request.host, rule->mask);
-                continue;
-            }
-            int host_length = strlen(r->request.host);
-            int mask_length = strlen(rule->mask);
-            if (host_length != mask_length) {
-                char prefix[1024] = { 0 };
-                // must be *.example.com, if not have ".", maybe Phishing. e.g. phishingexample.com
-                strncpy(prefix, r->request.host, host_length - mask_length - 1);        // e.g. www
-                strcat(prefix, ".");    // www.
-                strcat(prefix, rule->mask);     // www.example.com
-                if (strcasecmp(r->request.host, prefix) == 0) {
-                    debug(LOG_INFO, "allow subdomain");
-                    fw_allow_host(r->request.host);
-                    http_send_redirect(r, tmp_url, "allow subdomain");
-                    free(url);
-                    free(urlFragment);
-                    return;
-                }
-            } else {
-                // e.g. "example.com" is in conf, so it had been parse to IP and added into "iptables allow" when wifidog start. but then its' A record(IP) changed, it will go to here.
-                debug(LOG_INFO, "allow domain again, because IP changed");
-                fw_allow_host(r->request.host);
-                http_send_redirect(r, tmp_url, "allow domain");
-                free(url);
-                free(urlFragment);
-                return;
-            }
         }
+        location = login_url_get(r->clientAddr, mac, url, req_src);
+        free(mac);
         debug(LOG_INFO, "Captured %s requesting [%s] and re-directing them to login page", r->clientAddr, url);
-        http_send_redirect_to_auth(r, urlFragment, "Redirect to login page");
-        free(urlFragment);
+        http_send_redirect(r, location, "Redirect to login page");
+        free(location);
     }
     free(url);
 }
@@ -346,21 +502,12 @@ http_callback_status(httpd * webserver, request * r)
 void
 http_send_redirect_to_auth(request * r, const char *urlFragment, const char *text)
 {
-    char *protocol = NULL;
-    int port = 80;
-    t_auth_serv *auth_server = get_auth_server();
-
-    if (auth_server->authserv_use_ssl) {
-        protocol = "https";
-        port = auth_server->authserv_ssl_port;
-    } else {
-        protocol = "http";
-        port = auth_server->authserv_http_port;
-    }
-
     char *url = NULL;
-    safe_asprintf(&url, "%s://%s:%d%s%s",
-                  protocol, auth_server->authserv_hostname, port, auth_server->authserv_path, urlFragment);
+
+    pthread_mutex_lock(&login_url_mutex);
+    login_url_update();
+    safe_asprintf(&url, "%s%s", login_url.base, urlFragment);
+    pthread_mutex_unlock(&login_url_mutex);
     http_send_redirect(r, url, text);
     free(url);
 }
@@ -437,17 +584,20 @@ void http_wx_auth(httpd *webserver, request *r){
             mac = safe_strdup("");
             debug(LOG_ERR, "Failed to retrieve MAC address for ip %s", ip);
         }
-        LOCK_CLIENT_LIST();
+        t_client_shard *shard = client_shard_by_ip(ip);
+        LOCK_CLIENT_SHARD(shard);
         if ((client = client_list_find(ip, mac)) == NULL) {
             debug(LOG_DEBUG, "wx_auth_New client for %s", ip);
             client = client_list_add(ip, mac, token, wx_auth_type);
         } else {
             client->auth_type = wx_auth_type;
-            debug(LOG_DEBUG, "Client for %s is already in the client list", client->ip);
+            debug(LOG_DEBUG, "Client for %s is already in the client list", ip);
         }
-        UNLOCK_CLIENT_LIST();
-        int retCode = authenticate_client(r, 1);
-        if (retCode == AUTH_ALLOWED) {
+        UNLOCK_CLIENT_SHARD(shard);
+        if (client == NULL) {
+            debug(LOG_ERR, "Could not add client %s with MAC %s", ip, mac);
+            success = 0;
+        } else if (authenticate_client(r, 1) == AUTH_ALLOWED) {
             success = 1;
         } else {
             success = 0;
@@ -484,7 +634,8 @@ int wx_tmp_auth_callback(void *data, int type) {
         debug(LOG_DEBUG, "logout_client ip:%s, mac:%s",t->ip, t->mac);
         t_client *client = NULL;
         if (t->ip != NULL && t->mac != NULL) {
-            LOCK_CLIENT_LIST();
+            t_client_shard *shard = client_shard_by_ip(t->ip);
+            LOCK_CLIENT_SHARD(shard);
             client = client_list_find(t->ip, t->mac);
             if (client != NULL && client->auth_type == wx_temp_auth_type) {
                 client->auth_type = normal_auth_type;
@@ -493,7 +644,7 @@ int wx_tmp_auth_callback(void *data, int type) {
             }
             free(t->ip);
             free(t->mac);
-            UNLOCK_CLIENT_LIST();
+            UNLOCK_CLIENT_SHARD(shard);
         }
     }
     return 0;
@@ -515,22 +666,26 @@ http_callback_wx_temp_auth(httpd *webserver, request *r)
             send_http_page(r, "WiFiDog Error", "Failed to retrieve your MAC address");
         } else {
             /* We have their MAC address */
-            LOCK_CLIENT_LIST();
+            t_client_shard *shard = client_shard_by_ip(r->clientAddr);
+            LOCK_CLIENT_SHARD(shard);
             if ((client = client_list_find(r->clientAddr, mac)) == NULL) {
                 debug(LOG_DEBUG, "wx_tmp_auth_New client for %s", r->clientAddr);
                 client = client_list_add(r->clientAddr, mac, token->value, wx_temp_auth_type);
             } else if (logout) {
                 logout_client(client);
             } else {
-                debug(LOG_DEBUG, "Client for %s is already in the client list", client->ip);
+                debug(LOG_DEBUG, "Client for %s is already in the client list", r->clientAddr);
             }
-            UNLOCK_CLIENT_LIST();
-            if (!logout) { /* applies for case 1 and 3 from above if */
+            UNLOCK_CLIENT_SHARD(shard);
+            if (!logout && client == NULL) {
+                debug(LOG_ERR, "Could not add client %s with MAC %s", r->clientAddr, mac);
+                httpdOutput(r, "try{jsonpTmpAuthCallback({\"success\":false})}catch(e){};");
+            } else if (!logout) { /* applies for case 1 and 3 from above if */
                 if (client != NULL) {
                     showDebugInfo("start wx_tmp_auth", client);
                     wx_temp_resume_t resume = malloc(sizeof(_wx_temp_resume));
-                    resume->ip = safe_strdup(client->ip);
-                    resume->mac = safe_strdup(client->mac);
+                    resume->ip = safe_strdup(r->clientAddr);
+                    resume->mac = safe_strdup(mac);
 //                    timer_obj_t to = new_timer_obj(2 * 60 * 1000, wx_temp_auth, (void*)resume, wx_tmp_auth_callback);
                     timer_obj_t to = new_timer_obj(30 * 1000, wx_temp_auth, (void*)resume, wx_tmp_auth_callback);
                     appendTimerTask(to);
@@ -570,19 +725,23 @@ http_callback_auth(httpd * webserver, request * r)
             send_http_page(r, "WiFiDog Error", "Failed to retrieve your MAC address");
         } else {
             /* We have their MAC address */
-            LOCK_CLIENT_LIST();
+            t_client_shard *shard = client_shard_by_ip(r->clientAddr);
+            LOCK_CLIENT_SHARD(shard);
 
             if ((client = client_list_find(r->clientAddr, mac)) == NULL) {
                 debug(LOG_DEBUG, "New client for %s", r->clientAddr);
-                client_list_add(r->clientAddr, mac, token->value, normal_auth_type);
+                client = client_list_add(r->clientAddr, mac, token->value, normal_auth_type);
             } else if (logout) {
                 logout_client(client);
             } else {
-                debug(LOG_DEBUG, "Client for %s is already in the client list", client->ip);
+                debug(LOG_DEBUG, "Client for %s is already in the client list", r->clientAddr);
             }
 
-            UNLOCK_CLIENT_LIST();
-            if (!logout) { /* applies for case 1 and 3 from above if */
+            UNLOCK_CLIENT_SHARD(shard);
+            if (!logout && client == NULL) {
+                debug(LOG_ERR, "Could not add client %s with MAC %s", r->clientAddr, mac);
+                send_http_page(r, "WiFiDog Error", "Failed to add you to the client list");
+            } else if (!logout) { /* applies for case 1 and 3 from above if */
                 authenticate_client(r, 0);
             }
             free(mac);
@@ -635,41 +794,211 @@ http_callback_disconnect(httpd * webserver, request * r)
     return;
 }
 
-void
-send_http_page(request * r, const char *title, const char *message)
+/** @internal
+ * Segment types of the parsed HTML message file.  Anything else than
+ * the variables send_http_page() fills in is looked up among the
+ * request variables, like httpdOutput() does.
+ */
+#define MSG_SEGMENT_TEXT    0
+#define MSG_SEGMENT_TITLE   1
+#define MSG_SEGMENT_MESSAGE 2
+#define MSG_SEGMENT_NODEID  3
+#define MSG_SEGMENT_OTHER   4
+
+/** @internal Longest variable name recognized in the message file */
+#define MSG_MAX_VARNAME     79
+/** @internal Segments sent from the stack, larger templates allocate */
+#define MSG_MAX_IOV         32
+
+typedef struct {
+    int type;
+    const char *text;           /**< Literal text, or the placeholder including its '$' */
+    size_t len;
+    char *name;                 /**< Variable name for MSG_SEGMENT_OTHER */
+} t_msg_segment;
+
+/** @internal
+ * The HTML message file, loaded once and shared by all HTTP threads.
+ * It is reloaded when the file on disk changes.
+ */
+static struct {
+    char *path;
+    time_t mtime;
+    off_t size;
+    ino_t ino;
+    char *text;
+    t_msg_segment *segments;
+    int nsegments;
+} msg_template;
+
+static pthread_mutex_t msg_template_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+msg_template_free(void)
+{
+    int i;
+
+    for (i = 0; i < msg_template.nsegments; i++)
+        free(msg_template.segments[i].name);
+    free(msg_template.segments);
+    free(msg_template.text);
+    free(msg_template.path);
+    memset(&msg_template, 0, sizeof(msg_template));
+}
+
+static void
+msg_template_add(int type, const char *text, size_t len)
+{
+    t_msg_segment *segment = &msg_template.segments[msg_template.nsegments++];
+
+    segment->type = type;
+    segment->text = text;
+    segment->len = len;
+    segment->name = NULL;
+    if (type == MSG_SEGMENT_OTHER) {
+        segment->name = safe_malloc(len);
+        memcpy(segment->name, text + 1, len - 1);
+        segment->name[len - 1] = 0;
+    }
+}
+
+/** @internal
+ * Read the message file and split it into literal text and $variable
+ * placeholders.  Must be called with msg_template_mutex held.
+ */
+static int
+msg_template_load(const char *path)
 {
-    s_config *config = config_get_config();
-    char *buffer;
     struct stat stat_info;
-    int fd;
-    ssize_t written;
+    const char *cp, *start;
+    size_t done, len;
+    ssize_t got;
+    int fd, count, type;
 
-    fd = open(config->htmlmsgfile, O_RDONLY);
+    fd = open(path, O_RDONLY);
     if (fd == -1) {
-        debug(LOG_CRIT, "Failed to open HTML message file %s: %s", config->htmlmsgfile, strerror(errno));
-        return;
+        debug(LOG_CRIT, "Failed to open HTML message file %s: %s", path, strerror(errno));
+        return -1;
     }
-
     if (fstat(fd, &stat_info) == -1) {
         debug(LOG_CRIT, "Failed to stat HTML message file: %s", strerror(errno));
         close(fd);
-        return;
+        return -1;
     }
-    // Cast from long to unsigned int
-    buffer = (char *)safe_malloc((size_t) stat_info.st_size + 1);
-    written = read(fd, buffer, (size_t) stat_info.st_size);
-    if (written == -1) {
-        debug(LOG_CRIT, "Failed to read HTML message file: %s", strerror(errno));
-        free(buffer);
-        close(fd);
-        return;
+
+    msg_template_free();
+    msg_template.text = safe_malloc((size_t) stat_info.st_size + 1);
+    for (done = 0; done < (size_t) stat_info.st_size; done += got) {
+        got = read(fd, msg_template.text + done, (size_t) stat_info.st_size - done);
+        if (got == -1 && errno == EINTR) {
+            got = 0;
+            continue;
+        }
+        if (got == -1) {
+            debug(LOG_CRIT, "Failed to read HTML message file: %s", strerror(errno));
+            close(fd);
+            msg_template_free();
+            return -1;
+        }
+        if (got == 0)
+            break;
     }
     close(fd);
+    msg_template.text[done] = 0;
+
+    /* Every placeholder can split a literal in two */
+    for (count = 1, cp = msg_template.text; (cp = strchr(cp, '$')) != NULL; cp++)
+        count += 2;
+    msg_template.segments = safe_malloc(count * sizeof(t_msg_segment));
+
+    start = msg_template.text;
+    for (cp = msg_template.text; *cp; cp++) {
+        if (*cp != '$')
+            continue;
+        for (len = 0; len < MSG_MAX_VARNAME && (isalnum((unsigned char)cp[len + 1]) || cp[len + 1] == '_'); len++) ;
+        if (len == 0)
+            continue;
+
+        if (len == 5 && strncmp(cp + 1, "title", len) == 0)
+            type = MSG_SEGMENT_TITLE;
+        else if (len == 7 && strncmp(cp + 1, "message", len) == 0)
+            type = MSG_SEGMENT_MESSAGE;
+        else if (len == 6 && strncmp(cp + 1, "nodeID", len) == 0)
+            type = MSG_SEGMENT_NODEID;
+        else
+            type = MSG_SEGMENT_OTHER;
+
+        if (cp > start)
+            msg_template_add(MSG_SEGMENT_TEXT, start, cp - start);
+        msg_template_add(type, cp, len + 1);
+        cp += len;
+        start = cp + 1;
+    }
+    if (cp > start)
+        msg_template_add(MSG_SEGMENT_TEXT, start, cp - start);
+
+    msg_template.path = safe_strdup(path);
+    msg_template.mtime = stat_info.st_mtime;
+    msg_template.size = stat_info.st_size;
+    msg_template.ino = stat_info.st_ino;
+    debug(LOG_DEBUG, "Loaded HTML message file %s (%d segments)", path, msg_template.nsegments);
+    return 0;
+}
+
+void
+send_http_page(request * r, const char *title, const char *message)
+{
+    s_config *config = config_get_config();
+    struct iovec stack_iov[MSG_MAX_IOV], *iov;
+    struct stat stat_info;
+    t_msg_segment *segment;
+    httpVar *var;
+    int i;
+
+    if (stat(config->htmlmsgfile, &stat_info) == -1) {
+        debug(LOG_CRIT, "Failed to stat HTML message file %s: %s", config->htmlmsgfile, strerror(errno));
+        return;
+    }
+
+    pthread_mutex_lock(&msg_template_mutex);
+    if (msg_template.text == NULL || strcmp(msg_template.path, config->htmlmsgfile) != 0 ||
+        msg_template.mtime != stat_info.st_mtime || msg_template.size != stat_info.st_size ||
+        msg_template.ino != stat_info.st_ino) {
+        if (msg_template_load(config->htmlmsgfile) == -1) {
+            pthread_mutex_unlock(&msg_template_mutex);
+            return;
+        }
+    }
+
+    iov = stack_iov;
+    if (msg_template.nsegments > MSG_MAX_IOV)
+        iov = safe_malloc(msg_template.nsegments * sizeof(struct iovec));
+    for (i = 0; i < msg_template.nsegments; i++) {
+        segment = &msg_template.segments[i];
+        iov[i].iov_base = (void *)segment->text;
+        iov[i].iov_len = segment->len;
+        switch (segment->type) {
+        case MSG_SEGMENT_TITLE:
+            iov[i].iov_base = (void *)title;
+            break;
+        case MSG_SEGMENT_MESSAGE:
+            iov[i].iov_base = (void *)message;
+            break;
+        case MSG_SEGMENT_NODEID:
+            iov[i].iov_base = config->gw_id ? config->gw_id : "";
+            break;
+        case MSG_SEGMENT_OTHER:
+            if ((var = httpdGetVariableByName(r, segment->name)) != NULL)
+                iov[i].iov_base = var->value;
+            break;
+        }
+        if (iov[i].iov_base != segment->text)
+            iov[i].iov_len = strlen(iov[i].iov_base);
+    }
+    /* Only copies into the request's output buffer, safe under the lock */
+    httpdWritev(r, iov, msg_template.nsegments);
+    pthread_mutex_unlock(&msg_template_mutex);
 
-    buffer[written] = 0;
-    httpdAddVariable(r, "title", title);
-    httpdAddVariable(r, "message", message);
-    httpdAddVariable(r, "nodeID", config->gw_id);
-    httpdOutput(r, buffer);
-    free(buffer);
+    if (iov != stack_iov)
+        free(iov);
 }
@@ -32,44 +32,220 @@
 #include <pthread.h>
 #include <string.h>
 #include <unistd.h>
+#include <time.h>
 #include <syslog.h>
 #include <signal.h>
 #include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
 
 #include "httpd.h"
 
 #include "../config.h"
 #include "common.h"
+#include "conf.h"
 #include "debug.h"
+#include "safe.h"
 #include "httpd_thread.h"
 
+/** Canned answer for connections we have no room for. Written straight to
+ * the socket so an overloaded gateway spends no time on them. */
+#define HTTPD_OVERLOAD_RESPONSE "HTTP/1.0 503 Service Unavailable\r\n" \
+    "Connection: close\r\n" \
+    "Retry-After: 1\r\n" \
+    "Content-Length: 0\r\n\r\n"
+
+/** @internal
+ * Bounded FIFO of accepted connections waiting for a worker.
+ */
+static struct {
+    httpd *server;              /**< @brief Web server the connections belong to */
+    request **queue;            /**< @brief Ring buffer of queued connections */
+    int size;                   /**< @brief Capacity of the ring buffer */
+    int head;                   /**< @brief Index of the oldest queued connection */
+    int count;                  /**< @brief Number of queued connections */
+    int threads;                /**< @brief Number of worker threads */
+    int busy;                   /**< @brief Workers currently serving a request */
+    int policy;                 /**< @brief t_httpd_overload policy when the queue is full */
+    t_httpd_pool_stats stats;   /**< @brief Counters reported by wdctl status */
+} pool;
+
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pool_idle_cond = PTHREAD_COND_INITIALIZER;       /**< @brief Nothing queued or being served */
+
+static void httpd_reject(request *);
+static void httpd_serve(httpd *, request *);
+
+/** @internal
+ * Answers a connection with a 503 and closes it, without reading the request.
+ */
+static void
+httpd_reject(request * r)
+{
+    send(r->clientSock, HTTPD_OVERLOAD_RESPONSE, sizeof(HTTPD_OVERLOAD_RESPONSE) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+    httpdEndRequest(r);
+}
+
+/** @internal
+ * Reads and processes requests until the connection is closed.
+ * Persistent connections stay with the worker between requests, unless
+ * they belong to the event loop, which then gets them back.
+ */
+static void
+httpd_serve(httpd * webserver, request * r)
+{
+    while (httpdReadRequest(webserver, r) == 0) {
+        /*
+         * We read the request fine
+         */
+        debug(LOG_DEBUG, "Processing request from %s", r->clientAddr);
+        debug(LOG_DEBUG, "Calling httpdProcessRequest() for %s", r->clientAddr);
+        httpdProcessRequest(webserver, r);
+        debug(LOG_DEBUG, "Returned from httpdProcessRequest() for %s", r->clientAddr);
+        if (!httpdFinishRequest(webserver, r)) {
+            debug(LOG_DEBUG, "Closing connection with %s", r->clientAddr);
+            httpdEndRequest(r);
+            return;
+        }
+    }
+    debug(LOG_DEBUG, "No valid request received from %s, closing connection", r->clientAddr);
+    httpdEndRequest(r);
+}
+
+/** Creates the worker threads and the accept queue.
+ * Must be called once, before the first call to httpd_pool_dispatch().
+ * @param webserver The web server the workers will serve
+ * @param threads Number of worker threads
+ * @param queue_size Number of accepted connections that may wait for a worker
+ * @param policy What to do when the queue is full, see t_httpd_overload
+ * @return 0 on success, -1 if a thread could not be created
+ */
+int
+httpd_pool_init(httpd * webserver, int threads, int queue_size, int policy)
+{
+    pthread_t tid;
+    int i;
+
+    pool.server = webserver;
+    pool.size = queue_size > 0 ? queue_size : 1;
+    pool.queue = safe_malloc(pool.size * sizeof(request *));
+    pool.head = pool.count = pool.busy = 0;
+    pool.threads = threads > 0 ? threads : 1;
+    pool.policy = policy;
+
+    debug(LOG_INFO, "Starting %d httpd worker threads, accept queue of %d", pool.threads, pool.size);
+
+    for (i = 0; i < pool.threads; i++) {
+        if (pthread_create(&tid, NULL, (void *)thread_httpd, NULL) != 0) {
+            debug(LOG_ERR, "Failed to create httpd worker thread %d: %s", i, strerror(errno));
+            return -1;
+        }
+        pthread_detach(tid);
+    }
+    return 0;
+}
+
+/** Hands an accepted connection to the worker pool.
+ * Never blocks: if the queue is full the overload policy decides which
+ * connection is answered with a 503.
+ * @param r The accepted connection; ownership passes to the pool
+ */
+void
+httpd_pool_dispatch(request * r)
+{
+    request *victim = NULL;
+
+    pthread_mutex_lock(&pool_mutex);
+    if (pool.count == pool.size) {
+        if (pool.policy == HTTPD_OVERLOAD_DROP_OLDEST) {
+            victim = pool.queue[pool.head];
+            pool.head = (pool.head + 1) % pool.size;
+            pool.count--;
+            pool.stats.dropped++;
+        } else {
+            victim = r;
+            r = NULL;
+            pool.stats.rejected++;
+        }
+    }
+    if (r != NULL) {
+        pool.queue[(pool.head + pool.count) % pool.size] = r;
+        pool.count++;
+        if (pool.count > pool.stats.queue_peak)
+            pool.stats.queue_peak = pool.count;
+        pthread_cond_signal(&pool_cond);
+    }
+    pthread_mutex_unlock(&pool_mutex);
+
+    if (victim != NULL) {
+        debug(LOG_WARNING, "httpd queue full, answering %s with 503", victim->clientAddr);
+        httpd_reject(victim);
+    }
+}
+
+/** Copies the pool counters for status reporting.
+ * @param stats Where to store the counters
+ */
+void
+httpd_pool_get_stats(t_httpd_pool_stats * stats)
+{
+    pthread_mutex_lock(&pool_mutex);
+    *stats = pool.stats;
+    stats->threads = pool.threads;
+    stats->busy = pool.busy;
+    stats->queued = pool.count;
+    pthread_mutex_unlock(&pool_mutex);
+}
+
+/** Waits until the workers have served every queued connection.
+ * Connections that stay open for more requests count as being served.
+ * @param seconds Longest wait
+ * @return 0 once idle, -1 on timeout
+ */
+int
+httpd_pool_drain(int seconds)
+{
+    struct timespec deadline;
+    int result = 0;
+
+    deadline.tv_sec = time(NULL) + seconds;
+    deadline.tv_nsec = 0;
+    pthread_mutex_lock(&pool_mutex);
+    while ((pool.count > 0 || pool.busy > 0) && result == 0)
+        result = pthread_cond_timedwait(&pool_idle_cond, &pool_mutex, &deadline);
+    result = (pool.count > 0 || pool.busy > 0) ? -1 : 0;
+    pthread_mutex_unlock(&pool_mutex);
+
+    return result;
+}
+
 /** Main request handling thread.
-@param args Two item array of void-cast pointers to the httpd and request struct
+ * Waits on the accept queue and serves connections one at a time.
+@param args Unused
 */
 void
 thread_httpd(void *args)
 {
-	void	**params;
-	httpd	*webserver;
-	request	*r;
-	
-	params = (void **)args;
-	webserver = *params;
-	r = *(params + 1);
-	free(params); /* XXX We must release this ourselves. */
-	
-	if (httpdReadRequest(webserver, r) == 0) {
-		/*
-		 * We read the request fine
-		 */
-		debug(LOG_DEBUG, "Processing request from %s", r->clientAddr);
-		debug(LOG_DEBUG, "Calling httpdProcessRequest() for %s", r->clientAddr);
-		httpdProcessRequest(webserver, r);
-		debug(LOG_DEBUG, "Returned from httpdProcessRequest() for %s", r->clientAddr);
-	}
-	else {
-		debug(LOG_DEBUG, "No valid request received from %s", r->clientAddr);
-	}
-	debug(LOG_DEBUG, "Closing connection with %s", r->clientAddr);
-	httpdEndRequest(r);
+    request *r;
+
+    while (1) {
+        pthread_mutex_lock(&pool_mutex);
+        while (pool.count == 0)
+            pthread_cond_wait(&pool_cond, &pool_mutex);
+        r = pool.queue[pool.head];
+        pool.head = (pool.head + 1) % pool.size;
+        pool.count--;
+        pool.busy++;
+        pthread_mutex_unlock(&pool_mutex);
+
+        httpd_serve(pool.server, r);
+
+        pthread_mutex_lock(&pool_mutex);
+        pool.busy--;
+        pool.stats.served++;
+        if (pool.count == 0 && pool.busy == 0)
+            pthread_cond_broadcast(&pool_idle_cond);
+        pthread_mutex_unlock(&pool_mutex);
+    }
 }
@@ -27,7 +27,32 @@
 #ifndef _HTTPD_THREAD_H_
 #define _HTTPD_THREAD_H_
 
-/** @brief Handle a web request */
+#include "httpd.h"
+
+/** Counters for the httpd worker pool */
+typedef struct _t_httpd_pool_stats {
+    int threads;                /**< @brief Number of worker threads */
+    int busy;                   /**< @brief Workers currently serving a request */
+    int queued;                 /**< @brief Connections waiting for a worker */
+    int queue_peak;             /**< @brief Highest number of queued connections seen */
+    unsigned long served;       /**< @brief Connections served by a worker */
+    unsigned long rejected;     /**< @brief New connections answered with a 503 */
+    unsigned long dropped;      /**< @brief Queued connections dropped for newer ones */
+} t_httpd_pool_stats;
+
+/** @brief Start the httpd worker threads */
+int httpd_pool_init(httpd *, int, int, int);
+
+/** @brief Queue an accepted connection for the workers */
+void httpd_pool_dispatch(request *);
+
+/** @brief Get the worker pool counters */
+void httpd_pool_get_stats(t_httpd_pool_stats *);
+
+/** @brief Wait for the queued connections to be served */
+int httpd_pool_drain(int);
+
+/** @brief Handle web requests from the accept queue */
 void thread_httpd(void *args);
 
 #endif
@@ -0,0 +1,465 @@
+/* vim: set et sw=4 ts=4 sts=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/* $Id$ */
+/** @file restart.c
+    @brief Handoff of the running state to a restarted wifidog
+
+    On wdctl restart the old process forks and re-executes itself with
+    -x.  The new process connects to the internal socket and the old one
+    sends it, in one message, a header with the listen sockets of the
+    web server attached as SCM_RIGHTS, then all client records in bulk.
+
+    The old process stops accepting connections first, so they wait in
+    the listen queues for the new one.  The firewall is not torn down
+    and rebuilt: the old process leaves its rules in place on exit and
+    the new one adopts them, so the clients never lose connectivity.
+    If the handoff fails half way the new process falls back to
+    rebuilding the firewall itself.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+
+#include "httpd.h"
+#include "safe.h"
+#include "debug.h"
+#include "conf.h"
+#include "gateway.h"
+#include "client_list.h"
+#include "firewall.h"
+#include "httpd_thread.h"
+#include "restart.h"
+
+#define RESTART_MAGIC 0x57444f47        /* "WDOG" */
+#define RESTART_VERSION 1
+
+/** Most listen sockets passed along */
+#define RESTART_MAX_LISTENERS 32
+
+/** @internal
+ * Start of the handoff, the listen sockets come with it
+ */
+typedef struct _t_restart_header {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t flags;             /**< @brief None defined yet, 0 */
+    uint32_t client_count;
+    uint32_t listener_count;
+    uint32_t records_len;       /**< @brief Bytes of client records that follow */
+} t_restart_header;
+
+/** @internal
+ * One client.  Followed by token_len bytes of token, not terminated.
+ * Both processes run the same build on the same host, so the record is
+ * in native byte order; RESTART_VERSION changes with the layout.
+ */
+typedef struct _t_restart_client {
+    uint64_t incoming;
+    uint64_t outgoing;
+    uint64_t incoming_history;
+    uint64_t outgoing_history;
+    int64_t last_updated;
+    uint32_t ip;
+    int32_t fw_connection_state;
+    int32_t auth_type;
+    int32_t fd;
+    uint16_t token_len;
+    unsigned char mac[6];
+} t_restart_client;
+
+int restart_handed_off = 0;
+
+int restart_fw_kept = 0;
+
+/** @internal
+ * Listen sockets received from the old process, -1 once taken or closed
+ */
+static int restart_listeners[RESTART_MAX_LISTENERS];
+static int restart_listener_count = 0;
+
+/** @internal
+ * Growing buffer of packed client records
+ */
+typedef struct _t_restart_buf {
+    char *data;
+    size_t len;
+    size_t size;
+    uint32_t count;
+} t_restart_buf;
+
+static void
+restart_buf_append(t_restart_buf * buf, const void *data, size_t len)
+{
+    if (buf->len + len > buf->size) {
+        while (buf->len + len > buf->size)
+            buf->size = buf->size ? 2 * buf->size : 16384;
+        buf->data = safe_realloc(buf->data, buf->size);
+    }
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+}
+
+static void
+restart_pack_client(t_restart_buf * buf, const t_client * client)
+{
+    t_restart_client rec;
+    size_t token_len = strlen(client->token);
+
+    if (token_len > UINT16_MAX) {
+        debug(LOG_WARNING, "Token of client %llu is too long to hand over, dropping it", client->id);
+        return;
+    }
+    memset(&rec, 0, sizeof(rec));
+    rec.incoming = client->counters.incoming;
+    rec.outgoing = client->counters.outgoing;
+    rec.incoming_history = client->counters.incoming_history;
+    rec.outgoing_history = client->counters.outgoing_history;
+    rec.last_updated = client->counters.last_updated;
+    rec.ip = client->ip;
+    rec.fw_connection_state = client->fw_connection_state;
+    rec.auth_type = client->auth_type;
+    rec.fd = client->fd;
+    rec.token_len = (uint16_t)token_len;
+    memcpy(rec.mac, client->mac, sizeof(rec.mac));
+    restart_buf_append(buf, &rec, sizeof(rec));
+    restart_buf_append(buf, client->token, token_len);
+    buf->count++;
+}
+
+static int
+restart_write(int fd, const char *data, size_t len)
+{
+    ssize_t written;
+
+    while (len > 0) {
+        written = write(fd, data, len);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written <= 0)
+            return -1;
+        data += written;
+        len -= written;
+    }
+    return 0;
+}
+
+static int
+restart_read(int fd, char *data, size_t len)
+{
+    ssize_t got;
+
+    while (len > 0) {
+        got = read(fd, data, len);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got <= 0)
+            return -1;
+        data += got;
+        len -= got;
+    }
+    return 0;
+}
+
+/** Sends the clients and the listen sockets to the new process.
+ *
+ * This process stops accepting connections before, and once the
+ * handoff went through it no longer touches the firewall: nothing it
+ * does to its clients on the way out could reach the new one anyway.
+ * The connections it already accepted are served before it returns.
+ * @param fd Connection of the new process on the internal socket
+ * @return 0 once the new process has everything, -1 on error
+ */
+int
+restart_send_state(int fd)
+{
+    t_restart_header header;
+    t_restart_buf buf;
+    t_client *client;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    char control[CMSG_SPACE(RESTART_MAX_LISTENERS * sizeof(int))];
+    int i, *fds;
+
+    if (httpd_listeners_stop() != 0)
+        debug(LOG_WARNING, "Some listeners did not stop accepting, a few connections may be lost");
+
+    memset(&buf, 0, sizeof(buf));
+    RDLOCK_CLIENT_LIST();
+    /* The rules handed over must match the clients, nothing can be queued meanwhile */
+    fw_flush();
+    for (i = 0; i < CLIENT_SHARDS; i++) {
+        for (client = client_shards[i].first; client != NULL; client = client->next)
+            restart_pack_client(&buf, client);
+    }
+
+    memset(&header, 0, sizeof(header));
+    header.magic = RESTART_MAGIC;
+    header.version = RESTART_VERSION;
+    header.client_count = buf.count;
+    header.listener_count = webserver_count < RESTART_MAX_LISTENERS ? webserver_count : RESTART_MAX_LISTENERS;
+    header.records_len = buf.len;
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = &header;
+    iov.iov_len = sizeof(header);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (header.listener_count > 0) {
+        memset(control, 0, sizeof(control));
+        msg.msg_control = control;
+        msg.msg_controllen = CMSG_SPACE(header.listener_count * sizeof(int));
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(header.listener_count * sizeof(int));
+        fds = (int *)CMSG_DATA(cmsg);
+        for (i = 0; i < (int)header.listener_count; i++)
+            fds[i] = webservers[i]->serverSock;
+    }
+
+    if (sendmsg(fd, &msg, 0) != sizeof(header) || restart_write(fd, buf.data, buf.len) != 0) {
+        debug(LOG_ERR, "Could not hand over state to the new process: %s", strerror(errno));
+        UNLOCK_CLIENT_LIST();
+        free(buf.data);
+        return -1;
+    }
+    free(buf.data);
+    fw_release();
+    restart_handed_off = 1;
+    UNLOCK_CLIENT_LIST();
+
+    debug(LOG_INFO, "Handed over %u clients and %u listen sockets (%u bytes)", header.client_count,
+          header.listener_count, header.records_len);
+    if (httpd_pool_drain(5) != 0)
+        debug(LOG_WARNING, "Connections still open after the handoff will be closed");
+    return 0;
+}
+
+/** @internal
+ * Keeps the listen sockets that came with the header, unless they are
+ * not bound to the port we are configured for.
+ */
+static void
+restart_take_listeners(struct msghdr *msg, int port)
+{
+    struct cmsghdr *cmsg;
+    struct sockaddr_in addr;
+    socklen_t len;
+    int i, count, *fds;
+
+    for (cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            continue;
+        fds = (int *)CMSG_DATA(cmsg);
+        count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (i = 0; i < count; i++) {
+            if (restart_listener_count < RESTART_MAX_LISTENERS)
+                restart_listeners[restart_listener_count++] = fds[i];
+            else
+                close(fds[i]);
+        }
+    }
+    if (restart_listener_count == 0)
+        return;
+
+    len = sizeof(addr);
+    if (getsockname(restart_listeners[0], (struct sockaddr *)&addr, &len) != 0 ||
+        addr.sin_family != AF_INET || ntohs(addr.sin_port) != port) {
+        debug(LOG_NOTICE, "Listen sockets of the parent are not on port %d, opening new ones", port);
+        restart_close_listeners(0);
+    }
+}
+
+/** Receives the clients and the listen sockets from the old process.
+ *
+ * Called early in the new process, before the firewall and the web
+ * server are set up.  Sets restart_fw_kept if the whole state came
+ * through and the firewall rules of the old process can be adopted.
+ */
+void
+restart_receive_state(void)
+{
+    int sock;
+    struct sockaddr_un sa_un;
+    s_config *config = NULL;
+    t_restart_header header;
+    t_restart_client rec;
+    t_client *client;
+    struct msghdr msg;
+    struct iovec iov;
+    char control[CMSG_SPACE(RESTART_MAX_LISTENERS * sizeof(int))];
+    char *records = NULL, *p, *end, *token;
+    ssize_t got;
+    uint32_t i;
+    int complete = 0;
+
+    config = config_get_config();
+
+    debug(LOG_INFO, "Connecting to parent to download clients");
+
+    /* Connect to socket */
+    sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    /* XXX An attempt to quieten coverity warning about the subsequent connect call:
+     * Coverity says: "sock is apssed to parameter that cannot be negative"
+     * Although connect expects a signed int, coverity probably tells us that it shouldn't
+     * be negative */
+    if (sock < 0) {
+        debug(LOG_ERR, "Could not open socket (%s) - client list not downloaded", strerror(errno));
+        return;
+    }
+    memset(&sa_un, 0, sizeof(sa_un));
+    sa_un.sun_family = AF_UNIX;
+    strncpy(sa_un.sun_path, config->internal_sock, (sizeof(sa_un.sun_path) - 1));
+
+    if (connect(sock, (struct sockaddr *)&sa_un, strlen(sa_un.sun_path) + sizeof(sa_un.sun_family))) {
+        debug(LOG_ERR, "Failed to connect to parent (%s) - client list not downloaded", strerror(errno));
+        close(sock);
+        return;
+    }
+
+    debug(LOG_INFO, "Connected to parent.  Downloading clients");
+
+    memset(&header, 0, sizeof(header));
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = &header;
+    iov.iov_len = sizeof(header);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    do {
+        got = recvmsg(sock, &msg, 0);
+    } while (got < 0 && errno == EINTR);
+    if (got <= 0) {
+        debug(LOG_ERR, "Parent sent nothing (%s) - client list not downloaded", got ? strerror(errno) : "EOF");
+        close(sock);
+        return;
+    }
+    restart_take_listeners(&msg, config->gw_port);
+    if ((size_t)got < sizeof(header) && restart_read(sock, (char *)&header + got, sizeof(header) - got) != 0) {
+        debug(LOG_ERR, "Short handoff header from parent - client list not downloaded");
+        goto out;
+    }
+    if (header.magic != RESTART_MAGIC || header.version != RESTART_VERSION) {
+        debug(LOG_ERR, "Parent speaks handoff version %u, we want %u - client list not downloaded",
+              header.magic == RESTART_MAGIC ? header.version : 0, RESTART_VERSION);
+        goto out;
+    }
+
+    records = safe_malloc(header.records_len ? header.records_len : 1);
+    if (restart_read(sock, records, header.records_len) != 0) {
+        debug(LOG_ERR, "Parent hung up in the middle of the client list");
+        goto out;
+    }
+
+    LOCK_CLIENT_LIST();
+    p = records;
+    end = records + header.records_len;
+    for (i = 0; i < header.client_count; i++) {
+        if ((size_t)(end - p) < sizeof(rec))
+            break;
+        memcpy(&rec, p, sizeof(rec));
+        p += sizeof(rec);
+        if ((size_t)(end - p) < rec.token_len)
+            break;
+
+        client = client_get_new();
+        client->ip = rec.ip;
+        memcpy(client->mac, rec.mac, sizeof(client->mac));
+        token = safe_malloc(rec.token_len + 1);
+        memcpy(token, p, rec.token_len);
+        token[rec.token_len] = '\0';
+        client_set_token(client, token);
+        free(token);
+        p += rec.token_len;
+        client->fw_connection_state = rec.fw_connection_state;
+        client->auth_type = rec.auth_type;
+        client->fd = rec.fd;
+        client->counters.incoming = rec.incoming;
+        client->counters.outgoing = rec.outgoing;
+        /* The iptables counters carry on from where they were */
+        client->counters.incoming_history = rec.incoming_history;
+        client->counters.outgoing_history = rec.outgoing_history;
+        client->counters.last_updated = rec.last_updated;
+        client_list_insert_client(client);
+    }
+    UNLOCK_CLIENT_LIST();
+
+    if (i == header.client_count) {
+        complete = 1;
+        debug(LOG_INFO, "Client list downloaded successfully from parent: %u clients", i);
+    } else {
+        debug(LOG_ERR, "Client list from parent is corrupt, kept the first %u of %u clients", i,
+              header.client_count);
+    }
+
+  out:
+    free(records);
+    close(sock);
+    restart_fw_kept = complete;
+    if (!complete)
+        restart_close_listeners(0);
+}
+
+/** Listen socket handed over by the old process
+ * @param index Which one, the first is the main web server's
+ * @return The socket, now owned by the caller, or -1
+ */
+int
+restart_listener(int index)
+{
+    int sock;
+
+    if (index < 0 || index >= restart_listener_count)
+        return -1;
+    sock = restart_listeners[index];
+    restart_listeners[index] = -1;
+    return sock;
+}
+
+/** Closes the handed over listen sockets that were not taken
+ * @param first Index of the first one to close
+ */
+void
+restart_close_listeners(int first)
+{
+    int i;
+
+    for (i = first; i < restart_listener_count; i++) {
+        if (restart_listeners[i] >= 0)
+            close(restart_listeners[i]);
+        restart_listeners[i] = -1;
+    }
+}
@@ -0,0 +1,50 @@
+/* vim: set et sw=4 ts=4 sts=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/* $Id$ */
+/** @file restart.h
+    @brief Handoff of the running state to a restarted wifidog
+*/
+
+#ifndef _RESTART_H_
+#define _RESTART_H_
+
+/** @brief Set in the old process once the new one has all of its state.
+ * The firewall is then left in place on exit. */
+extern int restart_handed_off;
+
+/** @brief Set in the new process when it took over the firewall rules
+ * of the old one, which must then not be rebuilt */
+extern int restart_fw_kept;
+
+/** @brief Sends the clients and listen sockets to the new process */
+int restart_send_state(int);
+
+/** @brief Receives the clients and listen sockets from the old process */
+void restart_receive_state(void);
+
+/** @brief Listen socket handed over by the old process, or -1 */
+int restart_listener(int);
+
+/** @brief Closes the handed over listen sockets from an index on */
+void restart_close_listeners(int);
+
+#endif                          /* _RESTART_H_ */
@@ -34,6 +34,7 @@
 #include <string.h>
 #include <errno.h>
 #include <syslog.h>
+#include <fcntl.h>
 
 #include "safe.h"
 #include "debug.h"
@@ -75,6 +76,9 @@ register_fd_cleanup_on_fork(const int fd)
     entry->fd = fd;
     entry->next = fd_list;
     fd_list = entry;
+
+    /* Programs spawned without fork() must not get it either */
+    fcntl(fd, F_SETFD, fcntl(fd, F_GETFD) | FD_CLOEXEC);
 }
 
 /** Allocate zero-filled ram or die.
@@ -0,0 +1,418 @@
+/* vim: set et sw=4 ts=4 sts=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/* $Id$ */
+/** @file session_store.c
+    @brief Client sessions kept on disk across crashes and reboots
+
+    The store is a file of fixed size records, one per client on the
+    list, memory mapped and updated in place as clients are added,
+    changed and removed.  On startup the clients found in it are put
+    back on the list, and fw_init() then restores their firewall rules
+    before the web server is started.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "safe.h"
+#include "debug.h"
+#include "conf.h"
+#include "client_list.h"
+#include "session_store.h"
+
+#define SESSION_STORE_MAGIC 0x57445353  /* "WDSS" */
+#define SESSION_STORE_VERSION 2
+#define SESSION_STORE_MIN_SLOTS 256
+
+/** Tokens this long or longer are not kept in the store */
+#define SESSION_STORE_TOKEN_LEN 128
+
+/** @internal
+ * Start of the file
+ */
+typedef struct _t_session_store_header {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t record_size;
+    uint32_t slots;
+    uint32_t reserved;
+} t_session_store_header;
+
+/** @internal
+ * One client.  The store lives on a single host, so records are in
+ * native byte order.
+ */
+typedef struct _t_session_record {
+    uint32_t in_use;
+    uint32_t ip;
+    int32_t fw_connection_state;
+    int32_t auth_type;
+    uint64_t incoming;
+    uint64_t outgoing;
+    uint64_t incoming_history;  /**< @brief Traffic its firewall rules did not count */
+    uint64_t outgoing_history;
+    int64_t last_updated;
+    unsigned char mac[6];
+    char token[SESSION_STORE_TOKEN_LEN];
+    char pad[2];
+} t_session_record;
+
+/** @internal
+ * Protects everything below.  The records of clients in different
+ * shards are written concurrently, and growing the file moves them.
+ */
+static pthread_mutex_t session_store_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int store_fd = -1;
+static t_session_store_header *store_map = NULL;
+static size_t store_size = 0;
+
+/** @internal
+ * Stack of the free slots, the lowest on top
+ */
+static unsigned int *free_slots = NULL;
+static unsigned int free_count = 0;
+
+#define STORE_RECORD(slot) ((t_session_record *)(store_map + 1) + (slot))
+
+static size_t
+session_store_size(unsigned int slots)
+{
+    return sizeof(t_session_store_header) + (size_t)slots * sizeof(t_session_record);
+}
+
+/** @internal
+ * Sizes the file for slots records and maps it, replacing the current
+ * mapping.  New records read as zero, that is free.
+ */
+static int
+session_store_map(unsigned int slots)
+{
+    size_t size = session_store_size(slots);
+    void *map;
+
+    if (ftruncate(store_fd, size) != 0)
+        return -1;
+    map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, store_fd, 0);
+    if (map == MAP_FAILED)
+        return -1;
+    if (store_map)
+        munmap(store_map, store_size);
+    store_map = map;
+    store_size = size;
+    store_map->slots = slots;
+    return 0;
+}
+
+/** @internal
+ * Refills the free stack from the records not in use
+ */
+static void
+session_store_collect_free(void)
+{
+    unsigned int slot;
+
+    free(free_slots);
+    free_slots = safe_malloc(store_map->slots * sizeof(unsigned int));
+    free_count = 0;
+    for (slot = store_map->slots; slot-- > 0;) {
+        if (!STORE_RECORD(slot)->in_use)
+            free_slots[free_count++] = slot;
+    }
+}
+
+/** @internal
+ * Doubles the number of records.  Lock must be held.
+ */
+static int
+session_store_grow(void)
+{
+    unsigned int slots = store_map->slots;
+
+    if (session_store_map(2 * slots) != 0) {
+        debug(LOG_ERR, "Could not grow the session store to %u clients: %s", 2 * slots, strerror(errno));
+        return -1;
+    }
+    session_store_collect_free();
+    return 0;
+}
+
+static void
+session_store_write(t_session_record * rec, const t_client * client)
+{
+    rec->ip = client->ip;
+    memcpy(rec->mac, client->mac, sizeof(rec->mac));
+    rec->fw_connection_state = client->fw_connection_state;
+    rec->auth_type = client->auth_type;
+    rec->incoming = client->counters.incoming;
+    rec->outgoing = client->counters.outgoing;
+    rec->incoming_history = client->counters.incoming_history;
+    rec->outgoing_history = client->counters.outgoing_history;
+    rec->last_updated = client->counters.last_updated;
+    strcpy(rec->token, client->token);
+}
+
+/** @internal
+ * Frees the record of a client.  Lock must be held.
+ */
+static void
+session_store_release(t_client * client)
+{
+    STORE_RECORD(client->store_slot)->in_use = 0;
+    free_slots[free_count++] = client->store_slot;
+    client->store_slot = -1;
+}
+
+/** Records a client that was just added to the list.  A client that
+ * already has a slot, as the restored ones do, is written to it.
+ * @param client The client, on the list, with its shard locked
+ */
+void
+session_store_add(t_client * client)
+{
+    t_session_record *rec;
+
+    pthread_mutex_lock(&session_store_mutex);
+    if (store_map == NULL) {
+        pthread_mutex_unlock(&session_store_mutex);
+        return;
+    }
+    if (strlen(client->token) >= SESSION_STORE_TOKEN_LEN) {
+        debug(LOG_WARNING, "Token of client %llu is too long for the session store, not keeping it", client->id);
+        pthread_mutex_unlock(&session_store_mutex);
+        return;
+    }
+    if (client->store_slot < 0) {
+        if (free_count == 0 && session_store_grow() != 0) {
+            pthread_mutex_unlock(&session_store_mutex);
+            return;
+        }
+        client->store_slot = free_slots[--free_count];
+    }
+    rec = STORE_RECORD(client->store_slot);
+    session_store_write(rec, client);
+    /* Last, so a record torn by a crash is not in use */
+    rec->in_use = 1;
+    pthread_mutex_unlock(&session_store_mutex);
+}
+
+/** Records a change to a client.  Clients not in the store, such as
+ * copies, are ignored.
+ * @param client The client, on the list, with its shard locked
+ */
+void
+session_store_update(t_client * client)
+{
+    if (client->store_slot < 0)
+        return;
+    pthread_mutex_lock(&session_store_mutex);
+    if (store_map != NULL) {
+        if (strlen(client->token) < SESSION_STORE_TOKEN_LEN)
+            session_store_write(STORE_RECORD(client->store_slot), client);
+        else
+            session_store_release(client);
+    }
+    pthread_mutex_unlock(&session_store_mutex);
+}
+
+/** Forgets a client that left the list
+ * @param client The client, with its shard locked
+ */
+void
+session_store_remove(t_client * client)
+{
+    if (client->store_slot < 0)
+        return;
+    pthread_mutex_lock(&session_store_mutex);
+    if (store_map != NULL)
+        session_store_release(client);
+    pthread_mutex_unlock(&session_store_mutex);
+}
+
+/** Schedules the records changed since the last call to be written to
+ * the file.  Called once per check interval, which bounds what a power
+ * loss can cost without wearing out flash.
+ */
+void
+session_store_sync(void)
+{
+    pthread_mutex_lock(&session_store_mutex);
+    if (store_map != NULL)
+        msync(store_map, store_size, MS_ASYNC);
+    pthread_mutex_unlock(&session_store_mutex);
+}
+
+/** @internal
+ * Visitor of session_store_open() for clients inherited from a parent
+ */
+static void
+session_store_add_one(t_client * client, void *arg)
+{
+    session_store_add(client);
+}
+
+/** @internal
+ * Puts the clients found in the store back on the list, dropping the
+ * ones that have been idle for too long.  Returns how many came back.
+ */
+static int
+session_store_restore(void)
+{
+    s_config *config = config_get_config();
+    time_t oldest = time(NULL) - config->checkinterval * config->clienttimeout;
+    t_session_record *rec;
+    t_client_shard *shard;
+    t_client *client;
+    unsigned int slot;
+    char ip[CLIENT_IP_TEXT_LEN];
+    int restored = 0;
+
+    for (slot = 0; slot < store_map->slots; slot++) {
+        rec = STORE_RECORD(slot);
+        if (!rec->in_use)
+            continue;
+        if (memchr(rec->token, '\0', sizeof(rec->token)) == NULL || rec->last_updated < oldest) {
+            rec->in_use = 0;
+            continue;
+        }
+        client = client_get_new();
+        client->ip = rec->ip;
+        memcpy(client->mac, rec->mac, sizeof(client->mac));
+        client_set_token(client, rec->token);
+        client->fw_connection_state = rec->fw_connection_state;
+        client->auth_type = rec->auth_type;
+        /* As if the firewall counters carried on, fw_init() starts them
+         * over for the clients whose rules it sets up again */
+        client->counters.incoming = rec->incoming;
+        client->counters.outgoing = rec->outgoing;
+        client->counters.incoming_history = rec->incoming_history;
+        client->counters.outgoing_history = rec->outgoing_history;
+        client->counters.last_updated = rec->last_updated;
+        client->store_slot = slot;
+
+        shard = client_shard_of(client);
+        LOCK_CLIENT_SHARD(shard);
+        if (client_list_find_by_ip(client_ip_text(client, ip)) != NULL) {
+            UNLOCK_CLIENT_SHARD(shard);
+            rec->in_use = 0;
+            client_free_node(client);
+            continue;
+        }
+        client_list_insert_client(client);
+        UNLOCK_CLIENT_SHARD(shard);
+        restored++;
+    }
+    return restored;
+}
+
+/** Opens the session store, creating it if needed, and syncs it with
+ * the client list.  If the list already holds clients, handed over by
+ * a restarting parent, they replace what the store holds.  Otherwise
+ * the clients kept in the store are put back on the list.
+ * @param path The store file
+ * @return Number of clients restored from the store, -1 on error
+ */
+int
+session_store_open(const char *path)
+{
+    struct stat st;
+    unsigned int slots = SESSION_STORE_MIN_SLOTS;
+    int inherited = 0, restored = 0, valid = 0, i;
+
+    pthread_mutex_lock(&session_store_mutex);
+    store_fd = open(path, O_RDWR | O_CREAT, 0600);
+    if (store_fd < 0 || fstat(store_fd, &st) != 0) {
+        debug(LOG_ERR, "Could not open session store %s: %s", path, strerror(errno));
+        goto error;
+    }
+
+    if ((size_t)st.st_size >= sizeof(t_session_store_header)) {
+        t_session_store_header header;
+
+        if (pread(store_fd, &header, sizeof(header), 0) == sizeof(header) &&
+            header.magic == SESSION_STORE_MAGIC && header.version == SESSION_STORE_VERSION &&
+            header.record_size == sizeof(t_session_record) && header.slots >= SESSION_STORE_MIN_SLOTS &&
+            (size_t)st.st_size >= session_store_size(header.slots)) {
+            slots = header.slots;
+            valid = 1;
+        } else {
+            debug(LOG_WARNING, "Session store %s is not in a format we know, starting it over", path);
+        }
+    }
+    if (!valid && ftruncate(store_fd, 0) != 0) {
+        debug(LOG_ERR, "Could not reset session store %s: %s", path, strerror(errno));
+        goto error;
+    }
+    if (session_store_map(slots) != 0) {
+        debug(LOG_ERR, "Could not map session store %s: %s", path, strerror(errno));
+        goto error;
+    }
+    store_map->magic = SESSION_STORE_MAGIC;
+    store_map->version = SESSION_STORE_VERSION;
+    store_map->record_size = sizeof(t_session_record);
+    pthread_mutex_unlock(&session_store_mutex);
+
+    RDLOCK_CLIENT_LIST();
+    for (i = 0; i < CLIENT_SHARDS; i++)
+        inherited += client_shards[i].count;
+    UNLOCK_CLIENT_LIST();
+
+    if (inherited > 0) {
+        /* Clients handed over by our parent are more recent than the store */
+        pthread_mutex_lock(&session_store_mutex);
+        for (i = 0; i < (int)store_map->slots; i++)
+            STORE_RECORD(i)->in_use = 0;
+        session_store_collect_free();
+        pthread_mutex_unlock(&session_store_mutex);
+        client_list_foreach(session_store_add_one, NULL, 1);
+        debug(LOG_INFO, "Session store %s now holds the %d clients inherited from parent", path, inherited);
+    } else {
+        /* Restored clients keep their slots, nothing else may take one yet */
+        free_count = 0;
+        restored = session_store_restore();
+        pthread_mutex_lock(&session_store_mutex);
+        session_store_collect_free();
+        pthread_mutex_unlock(&session_store_mutex);
+        debug(LOG_NOTICE, "Restored %d clients from session store %s", restored, path);
+    }
+    return restored;
+
+  error:
+    if (store_fd >= 0)
+        close(store_fd);
+    store_fd = -1;
+    pthread_mutex_unlock(&session_store_mutex);
+    return -1;
+}
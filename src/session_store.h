@@ -0,0 +1,47 @@
+/* vim: set et sw=4 ts=4 sts=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/* $Id$ */
+/** @file session_store.h
+    @brief Client sessions kept on disk across crashes and reboots
+*/
+
+#ifndef _SESSION_STORE_H_
+#define _SESSION_STORE_H_
+
+#include "client_list.h"
+
+/** @brief Opens the store and restores the clients kept in it */
+int session_store_open(const char *);
+
+/** @brief Records a client that was added to the list */
+void session_store_add(t_client *);
+
+/** @brief Records a change to a client on the list */
+void session_store_update(t_client *);
+
+/** @brief Forgets a client that left the list */
+void session_store_remove(t_client *);
+
+/** @brief Schedules the store to be written out */
+void session_store_sync(void);
+
+#endif                          /* _SESSION_STORE_H_ */
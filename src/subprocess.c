@@ -0,0 +1,521 @@
+/* vim: set et sw=4 ts=4 sts=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/* $Id$ */
+/** @file subprocess.c
+    @brief Running external programs without a shell
+
+    Programs are started with posix_spawn(), or vfork() where it is
+    missing, straight from an argument vector: no shell is started and
+    the multi-threaded gateway is never copied by fork().  Each one gets
+    a process group of its own, so the SIGCHLD handler of the gateway,
+    which only reaps its own group, leaves its exit code to us.
+
+    With FirewallHelper the gateway forks once, before any other thread
+    exists, a helper process that runs the programs for it.  Requests
+    and results go over a socketpair; the helper exits when the gateway
+    closes its end.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "../config.h"
+
+#ifdef HAVE_POSIX_SPAWNP
+#include <spawn.h>
+#endif
+
+#include "safe.h"
+#include "debug.h"
+#include "subprocess.h"
+
+extern char **environ;
+
+/** The program reads the input */
+#define SUBPROCESS_INPUT 0x0001
+/** The output of the program is sent back */
+#define SUBPROCESS_OUTPUT 0x0002
+/** Errors of the program are not shown */
+#define SUBPROCESS_QUIET 0x0004
+
+/** Largest argument, input or output passed to or from the helper */
+#define SUBPROCESS_MAX_BLOB (16 * 1024 * 1024)
+
+/** Gateway end of the socketpair to the helper, or -1 */
+static int helper_fd = -1;
+
+/** One request to the helper at a time */
+static pthread_mutex_t helper_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/** @internal
+ * Output of a program as it is read
+ */
+typedef struct _t_subprocess_output {
+    char *buf;
+    size_t len;
+    size_t size;
+} t_subprocess_output;
+
+/** @internal
+ * Opens a pipe that is not inherited by other programs
+ */
+static int
+subprocess_pipe(int fds[2])
+{
+    if (pipe(fds) == -1) {
+        debug(LOG_ERR, "pipe(): %s", strerror(errno));
+        return -1;
+    }
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    return 0;
+}
+
+/** @internal
+ * Writes what the program reads and reads what it writes, until it
+ * closes its output
+ */
+static void
+subprocess_io(int in, const char *input, int out, t_subprocess_output * output)
+{
+    struct pollfd fds[2];
+    size_t pos = 0, len = input ? strlen(input) : 0;
+    ssize_t n;
+    int nfds;
+
+    if (in != -1 && len == 0) {
+        close(in);
+        in = -1;
+    }
+    if (in != -1)
+        fcntl(in, F_SETFL, fcntl(in, F_GETFL) | O_NONBLOCK);
+
+    while (in != -1 || out != -1) {
+        nfds = 0;
+        if (in != -1) {
+            fds[nfds].fd = in;
+            fds[nfds++].events = POLLOUT;
+        }
+        if (out != -1) {
+            fds[nfds].fd = out;
+            fds[nfds++].events = POLLIN;
+        }
+        if (poll(fds, nfds, -1) == -1) {
+            if (errno == EINTR)
+                continue;
+            debug(LOG_ERR, "poll(): %s", strerror(errno));
+            break;
+        }
+
+        if (in != -1 && fds[0].revents) {
+            n = write(in, input + pos, len - pos);
+            if (n > 0)
+                pos += n;
+            if (pos == len || (n == -1 && errno != EINTR && errno != EAGAIN)) {
+                close(in);
+                in = -1;
+            }
+        }
+
+        if (out != -1 && fds[nfds - 1].revents) {
+            if (output->size - output->len < PIPE_BUF + 1) {
+                output->size = output->size * 2 + PIPE_BUF + 1;
+                output->buf = safe_realloc(output->buf, output->size);
+            }
+            n = read(out, output->buf + output->len, output->size - output->len - 1);
+            if (n > 0)
+                output->len += n;
+            else if (n == 0 || (errno != EINTR && errno != EAGAIN)) {
+                close(out);
+                out = -1;
+            }
+        }
+    }
+
+    if (in != -1)
+        close(in);
+    if (out != -1)
+        close(out);
+}
+
+/** @internal
+ * Starts the program in this process and waits for it
+ * @return Exit code of the program, -1 if it could not be started
+ */
+static int
+subprocess_spawn(char *const argv[], const char *input, char **output, int quiet)
+{
+    int in[2] = { -1, -1 }, out[2] = { -1, -1 };
+    t_subprocess_output result = { NULL, 0, 0 };
+    pid_t pid;
+    int status, rc;
+#ifdef HAVE_POSIX_SPAWNP
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    sigset_t signals;
+#endif
+
+    if ((input && subprocess_pipe(in) == -1) || (output && subprocess_pipe(out) == -1)) {
+        if (in[0] != -1) {
+            close(in[0]);
+            close(in[1]);
+        }
+        return -1;
+    }
+
+#ifdef HAVE_POSIX_SPAWNP
+    posix_spawn_file_actions_init(&actions);
+    if (input)
+        posix_spawn_file_actions_adddup2(&actions, in[0], STDIN_FILENO);
+    if (output)
+        posix_spawn_file_actions_adddup2(&actions, out[1], STDOUT_FILENO);
+    if (quiet)
+        posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null", O_WRONLY, 0);
+
+    /* The gateway ignores SIGPIPE and its threads may block signals */
+    posix_spawnattr_init(&attr);
+    sigemptyset(&signals);
+    posix_spawnattr_setsigmask(&attr, &signals);
+    sigaddset(&signals, SIGPIPE);
+    posix_spawnattr_setsigdefault(&attr, &signals);
+    posix_spawnattr_setpgroup(&attr, 0);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETPGROUP);
+
+    if ((rc = posix_spawnp(&pid, argv[0], &actions, &attr, argv, environ)) != 0) {
+        debug(LOG_ERR, "posix_spawnp(%s): %s", argv[0], strerror(rc));
+        pid = -1;
+    }
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+#else
+    pid = vfork();
+    if (pid == 0) {
+        setpgid(0, 0);
+        if (input)
+            dup2(in[0], STDIN_FILENO);
+        if (output)
+            dup2(out[1], STDOUT_FILENO);
+        if (quiet)
+            close(STDERR_FILENO);
+        signal(SIGPIPE, SIG_DFL);
+        execvp(argv[0], argv);
+        _exit(127);
+    } else if (pid == -1) {
+        debug(LOG_ERR, "vfork(): %s", strerror(errno));
+    }
+#endif
+
+    if (input)
+        close(in[0]);
+    if (output)
+        close(out[1]);
+
+    if (pid == -1) {
+        if (input)
+            close(in[1]);
+        if (output)
+            close(out[0]);
+        return -1;
+    }
+
+    subprocess_io(input ? in[1] : -1, input, output ? out[0] : -1, &result);
+    if (output) {
+        if (result.buf == NULL)
+            result.buf = safe_malloc(1);
+        result.buf[result.len] = '\0';
+        *output = result.buf;
+    }
+
+    debug(LOG_DEBUG, "Waiting for PID %d to exit", pid);
+    while ((rc = waitpid(pid, &status, 0)) == -1 && errno == EINTR) ;
+    debug(LOG_DEBUG, "Process PID %d exited", rc);
+
+    if (-1 == rc) {
+        debug(LOG_ERR, "waitpid() failed (%s)", strerror(errno));
+        return SUBPROCESS_NO_STATUS;
+    }
+
+    if (WIFEXITED(status)) {
+        return (WEXITSTATUS(status));
+    } else {
+        debug(LOG_DEBUG, "Child may have been killed.");
+        return SUBPROCESS_NO_STATUS;
+    }
+}
+
+/** @internal
+ * Sends all of a buffer, or fails
+ */
+static int
+subprocess_write(int fd, const void *buf, size_t len)
+{
+    const char *p = buf;
+    ssize_t n;
+
+    while (len > 0) {
+        if ((n = write(fd, p, len)) == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/** @internal
+ * Reads all of a buffer, or fails
+ */
+static int
+subprocess_read(int fd, void *buf, size_t len)
+{
+    char *p = buf;
+    ssize_t n;
+
+    while (len > 0) {
+        if ((n = read(fd, p, len)) <= 0) {
+            if (n == -1 && errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/** @internal
+ * Sends a string prefixed with its length
+ */
+static int
+subprocess_write_blob(int fd, const char *s)
+{
+    uint32_t len = s ? strlen(s) : 0;
+
+    if (subprocess_write(fd, &len, sizeof(len)) == -1)
+        return -1;
+    return subprocess_write(fd, s, len);
+}
+
+/** @internal
+ * Reads a string prefixed with its length
+ * @return The string, to be freed, or NULL
+ */
+static char *
+subprocess_read_blob(int fd)
+{
+    uint32_t len;
+    char *s;
+
+    if (subprocess_read(fd, &len, sizeof(len)) == -1 || len > SUBPROCESS_MAX_BLOB)
+        return NULL;
+    s = safe_malloc(len + 1);
+    if (subprocess_read(fd, s, len) == -1) {
+        free(s);
+        return NULL;
+    }
+    s[len] = '\0';
+    return s;
+}
+
+/** @internal
+ * Runs the program through the helper, with helper_mutex held.
+ * @return Exit code of the program, -2 if the helper could not be
+ * asked, so the program did not run, or SUBPROCESS_NO_STATUS
+ */
+static int
+subprocess_helper_run(char *const argv[], const char *input, char **output, int quiet)
+{
+    uint32_t header[2];
+    int32_t rc;
+    int i;
+
+    header[0] = (input ? SUBPROCESS_INPUT : 0) | (output ? SUBPROCESS_OUTPUT : 0) | (quiet ? SUBPROCESS_QUIET : 0);
+    for (header[1] = 0; argv[header[1]] != NULL; header[1]++) ;
+
+    if (subprocess_write(helper_fd, header, sizeof(header)) == -1)
+        return -2;
+    for (i = 0; argv[i] != NULL; i++)
+        if (subprocess_write_blob(helper_fd, argv[i]) == -1)
+            return -2;
+    if (subprocess_write_blob(helper_fd, input) == -1)
+        return -2;
+
+    /* From here on the program may have run */
+    if (subprocess_read(helper_fd, &rc, sizeof(rc)) == -1)
+        return SUBPROCESS_NO_STATUS;
+    if (output && (*output = subprocess_read_blob(helper_fd)) == NULL)
+        return SUBPROCESS_NO_STATUS;
+    return rc;
+}
+
+/** @internal
+ * Main loop of the helper process: runs the programs the gateway asks
+ * for until it goes away
+ */
+static void
+subprocess_helper_loop(int fd)
+{
+    uint32_t header[2], i;
+    char **argv, *input, *output;
+    int32_t rc;
+
+    while (subprocess_read(fd, header, sizeof(header)) == 0 && header[1] > 0 && header[1] <= SUBPROCESS_MAX_ARGS) {
+        argv = safe_malloc((header[1] + 1) * sizeof(char *));
+        for (i = 0; i < header[1]; i++)
+            if ((argv[i] = subprocess_read_blob(fd)) == NULL)
+                return;
+        if ((input = subprocess_read_blob(fd)) == NULL)
+            return;
+
+        output = NULL;
+        rc = subprocess_spawn(argv, (header[0] & SUBPROCESS_INPUT) ? input : NULL,
+                              (header[0] & SUBPROCESS_OUTPUT) ? &output : NULL, header[0] & SUBPROCESS_QUIET);
+
+        if (subprocess_write(fd, &rc, sizeof(rc)) == -1 ||
+            ((header[0] & SUBPROCESS_OUTPUT) && subprocess_write_blob(fd, output) == -1))
+            return;
+
+        for (i = 0; i < header[1]; i++)
+            free(argv[i]);
+        free(argv);
+        free(input);
+        free(output);
+    }
+}
+
+/** Starts the helper process.  Call it before any thread is created,
+ * the helper is a fork() of the caller.
+ * @return 0 on success
+ */
+int
+subprocess_helper_start(void)
+{
+    int fds[2], fd;
+    pid_t pid;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1) {
+        debug(LOG_ERR, "socketpair(): %s", strerror(errno));
+        return -1;
+    }
+
+    pid = safe_fork();
+    if (pid == 0) {
+        /* Nothing of the gateway, listen sockets included, stays open */
+        for (fd = sysconf(_SC_OPEN_MAX) - 1; fd > STDERR_FILENO; fd--)
+            if (fd != fds[1])
+                close(fd);
+        /* The gateway's handlers must not run here, it exits on its own
+         * once the gateway is gone */
+        signal(SIGINT, SIG_IGN);
+        signal(SIGTERM, SIG_IGN);
+        signal(SIGQUIT, SIG_IGN);
+        signal(SIGHUP, SIG_IGN);
+        signal(SIGCHLD, SIG_DFL);
+        subprocess_helper_loop(fds[1]);
+        _exit(0);
+    }
+
+    close(fds[1]);
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    helper_fd = fds[0];
+    debug(LOG_INFO, "Started the command helper, PID %d", pid);
+    return 0;
+}
+
+/** Runs a program and waits for it to exit.  The program is looked up
+ * in PATH; nothing is interpreted by a shell.
+ * @param argv Program and its arguments, NULL terminated
+ * @param input What the program reads, or NULL to leave its input alone
+ * @param output Where to put what the program writes, to be freed, or
+ * NULL to leave its output alone
+ * @param quiet Whether to hide the errors of the program
+ * @return Exit code of the program, -1 if it could not be started,
+ * SUBPROCESS_NO_STATUS if it was killed or its exit code was lost
+ */
+int
+subprocess_run(char *const argv[], const char *input, char **output, int quiet)
+{
+    int rc = -2;
+
+    if (output)
+        *output = NULL;
+
+    pthread_mutex_lock(&helper_mutex);
+    if (helper_fd != -1 && (rc = subprocess_helper_run(argv, input, output, quiet)) == -2) {
+        debug(LOG_ERR, "The command helper went away, running commands directly");
+        close(helper_fd);
+        helper_fd = -1;
+    }
+    pthread_mutex_unlock(&helper_mutex);
+
+    if (rc == -2)
+        rc = subprocess_spawn(argv, input, output, quiet);
+
+    return rc;
+}
+
+/** Runs a command line with subprocess_run().  The line is split on
+ * blanks, no quoting is understood.
+ * @return As subprocess_run()
+ */
+int
+subprocess_command(const char *cmd_line, const char *input, char **output, int quiet)
+{
+    char *line, *argv[SUBPROCESS_MAX_ARGS + 1], *arg, *save;
+    int argc = 0, rc;
+
+    if (output)
+        *output = NULL;
+
+    line = safe_strdup(cmd_line);
+    for (arg = strtok_r(line, " \t\n", &save); arg != NULL && argc < SUBPROCESS_MAX_ARGS;
+         arg = strtok_r(NULL, " \t\n", &save))
+        argv[argc++] = arg;
+    argv[argc] = NULL;
+
+    if (argc == 0 || arg != NULL) {
+        debug(LOG_ERR, "Can not run command: %s", cmd_line);
+        free(line);
+        return -1;
+    }
+
+    rc = subprocess_run(argv, input, output, quiet);
+    free(line);
+    return rc;
+}
@@ -0,0 +1,45 @@
+/* vim: set et sw=4 ts=4 sts=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/* $Id$ */
+/** @file subprocess.h
+    @brief Running external programs without a shell
+*/
+
+#ifndef _SUBPROCESS_H_
+#define _SUBPROCESS_H_
+
+/** @brief Most arguments subprocess_command() splits a command line into */
+#define SUBPROCESS_MAX_ARGS 64
+
+/** @brief Returned when the program ran but how it ended is unknown */
+#define SUBPROCESS_NO_STATUS -3
+
+/** @brief Runs a program with the given argument vector */
+int subprocess_run(char *const[], const char *, char **, int);
+
+/** @brief Runs a command line split on blanks, without a shell */
+int subprocess_command(const char *, const char *, char **, int);
+
+/** @brief Starts the helper process which then runs all programs */
+int subprocess_helper_start(void);
+
+#endif                          /* _SUBPROCESS_H_ */
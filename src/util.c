@@ -57,6 +57,7 @@
 #include "util.h"
 #include "debug.h"
 #include "pstring.h"
+#include "subprocess.h"
 
 #include "../config.h"
 
@@ -80,52 +81,18 @@ static pthread_mutex_t ghbn_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 static unsigned short rand16(void);
 
-/** Fork a child and execute a shell command, the parent
- * process waits for the child to return and returns the child's exit()
- * value.
+/** Execute a shell command and wait for it to return.  The shell is
+ * spawned, the gateway itself is not forked.
  * @return Return code of the command
  */
 int
 execute(const char *cmd_line, int quiet)
 {
-    int pid, status, rc;
-
-    const char *new_argv[4];
-    new_argv[0] = "/bin/sh";
-    new_argv[1] = "-c";
-    new_argv[2] = cmd_line;
-    new_argv[3] = NULL;
-
-    pid = safe_fork();
-    if (pid == 0) {             /* for the child process:         */
-        /* We don't want to see any errors if quiet flag is on */
-        if (quiet)
-            close(2);
-        if (execvp("/bin/sh", (char *const *)new_argv) == -1) { /* execute the command  */
-            debug(LOG_ERR, "execvp(): %s", strerror(errno));
-        } else {
-            debug(LOG_ERR, "execvp() failed");
-        }
-        exit(1);
-    }
+    char *const new_argv[] = { "/bin/sh", "-c", (char *)cmd_line, NULL };
+    int rc;
 
-    /* for the parent:      */
-    debug(LOG_DEBUG, "Waiting for PID %d to exit", pid);
-    rc = waitpid(pid, &status, 0);
-    debug(LOG_DEBUG, "Process PID %d exited", rc);
-    
-    if (-1 == rc) {
-        debug(LOG_ERR, "waitpid() failed (%s)", strerror(errno));
-        return 1; /* waitpid failed. */
-    }
-
-    if (WIFEXITED(status)) {
-        return (WEXITSTATUS(status));
-    } else {
-        /* If we get here, child did not exit cleanly. Will return non-zero exit code to caller*/
-        debug(LOG_DEBUG, "Child may have been killed.");
-        return 1;
-    }
+    rc = subprocess_run(new_argv, NULL, NULL, quiet);
+    return rc == -1 ? 1 : rc;
 }
 
 struct in_addr *
@@ -44,6 +44,8 @@
 #include "wd_util.h"
 #include "debug.h"
 #include "pstring.h"
+#include "httpd_thread.h"
+#include "firewall.h"
 
 #include "../config.h"
 
@@ -153,6 +155,31 @@ is_auth_online()
     }
 }
 
+/** @internal
+ * State of the client walk in get_status_text()
+ */
+typedef struct {
+    pstr_t *pstr;
+    int count;
+} t_status_clients;
+
+/** @internal
+ * Appends one client to the status text
+ */
+static void
+status_client_text(t_client * client, void *arg)
+{
+    t_status_clients *clients = arg;
+    char ip[CLIENT_IP_TEXT_LEN], mac[CLIENT_MAC_TEXT_LEN];
+
+    clients->count++;
+    pstr_append_sprintf(clients->pstr, "\nClient %d\n", clients->count);
+    pstr_append_sprintf(clients->pstr, "  IP: %s MAC: %s\n", client_ip_text(client, ip), client_mac_text(client, mac));
+    pstr_append_sprintf(clients->pstr, "  Token: %s\n", client->token);
+    pstr_append_sprintf(clients->pstr, "  Downloaded: %llu\n  Uploaded: %llu\n", client->counters.incoming,
+                        client->counters.outgoing);
+}
+
         /*
          * @return A string containing human-readable status text. MUST BE free()d by caller
          */
@@ -162,11 +189,13 @@ get_status_text()
     pstr_t *pstr = pstr_new();
     s_config *config;
     t_auth_serv *auth_server;
-    t_client *sublist, *current;
+    t_status_clients clients;
+    char *text;
     int count;
     time_t uptime = 0;
     unsigned int days = 0, hours = 0, minutes = 0, seconds = 0;
     t_trusted_mac *p;
+    t_httpd_pool_stats httpd_stats;
 
     pstr_cat(pstr, "WiFiDog status\n\n");
 
@@ -191,30 +220,33 @@ get_status_text()
 
     pstr_append_sprintf(pstr, "Internet Connectivity: %s\n", (is_online()? "yes" : "no"));
     pstr_append_sprintf(pstr, "Auth server reachable: %s\n", (is_auth_online()? "yes" : "no"));
-    pstr_append_sprintf(pstr, "Clients served this session: %lu\n\n", served_this_session);
-
-    LOCK_CLIENT_LIST();
-
-    count = client_list_dup(&sublist);
-
-    UNLOCK_CLIENT_LIST();
+    pstr_append_sprintf(pstr, "Clients served this session: %lu\n", served_this_session);
+
+    httpd_pool_get_stats(&httpd_stats);
+    pstr_append_sprintf(pstr, "HTTP workers: %d busy of %d, %d queued (peak %d)\n",
+                        httpd_stats.busy, httpd_stats.threads, httpd_stats.queued, httpd_stats.queue_peak);
+    pstr_append_sprintf(pstr, "HTTP requests: %lu served, %lu rejected, %lu dropped\n",
+                        httpd_stats.served, httpd_stats.rejected, httpd_stats.dropped);
+    for (count = 0; count < webserver_count; count++) {
+        pstr_append_sprintf(pstr, "HTTP listener %d: %lu accepted, %lu accept errors\n", count,
+                            webservers[count]->accepted, webservers[count]->acceptErrors);
+    }
+    pstr_append_sprintf(pstr, "Firewall driver: %s\n", fw_get_driver()->name);
+    if (fw_get_driver()->status && (text = fw_get_driver()->status())) {
+        pstr_cat(pstr, text);
+        free(text);
+    }
+    pstr_cat(pstr, "\n");
 
-    current = sublist;
+    /* Rendered straight from the table, one shard at a time */
+    clients.pstr = pstr_new();
+    clients.count = 0;
+    count = client_list_foreach(status_client_text, &clients, 0);
 
     pstr_append_sprintf(pstr, "%d clients " "connected.\n", count);
-
-    count = 1;
-    while (current != NULL) {
-        pstr_append_sprintf(pstr, "\nClient %d\n", count);
-        pstr_append_sprintf(pstr, "  IP: %s MAC: %s\n", current->ip, current->mac);
-        pstr_append_sprintf(pstr, "  Token: %s\n", current->token);
-        pstr_append_sprintf(pstr, "  Downloaded: %llu\n  Uploaded: %llu\n", current->counters.incoming,
-                            current->counters.outgoing);
-        count++;
-        current = current->next;
-    }
-
-    client_list_destroy(sublist);
+    text = pstr_to_string(clients.pstr);
+    pstr_cat(pstr, text);
+    free(text);
 
     config = config_get_config();
 
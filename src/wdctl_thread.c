@@ -53,6 +53,7 @@
 #include "wdctl_thread.h"
 #include "commandline.h"
 #include "gateway.h"
+#include "restart.h"
 #include "safe.h"
 
 
@@ -270,8 +271,6 @@ wdctl_restart(int afd)
     char *sock_name;
     s_config *conf = NULL;
     struct sockaddr_un sa_un;
-    t_client *client;
-    char *tempstring = NULL;
     pid_t pid;
     socklen_t len;
 
@@ -310,26 +309,14 @@ wdctl_restart(int afd)
 
         debug(LOG_DEBUG, "Received connection from child.  Sending them all existing clients");
 
-        /* The child is connected. Send them over the socket the existing clients */
-        LOCK_CLIENT_LIST();
-        client = client_get_first_client();
-        while (client) {
-            /* Send this client */
-            safe_asprintf(&tempstring,
-                          "CLIENT|ip=%s|mac=%s|token=%s|fw_connection_state=%u|fd=%d|counters_incoming=%llu|counters_outgoing=%llu|counters_last_updated=%lu\n",
-                          client->ip, client->mac, client->token, client->fw_connection_state, client->fd,
-                          client->counters.incoming, client->counters.outgoing, client->counters.last_updated);
-            debug(LOG_DEBUG, "Sending to child client data: %s", tempstring);
-            write_to_socket(fd, tempstring, strlen(tempstring));        /* XXX Despicably not handling error. */
-            free(tempstring);
-            client = client->next;
-        }
-        UNLOCK_CLIENT_LIST();
+        /* The child is connected. Hand it the clients and the listen sockets */
+        if (restart_send_state(fd) == 0)
+            debug(LOG_INFO, "Sent all existing clients to child.  Committing suicide!");
+        else
+            debug(LOG_ERR, "Child did not get all clients, it will rebuild the firewall.  Committing suicide!");
 
         close(fd);
 
-        debug(LOG_INFO, "Sent all existing clients to child.  Committing suicide!");
-
         shutdown(afd, 2);
         close(afd);
 